@@ -0,0 +1,515 @@
+/*** genlex ***/
+
+/*
+ * genlex compiles the syntax definitions in syntax/ into the tables kilo's
+ * highlighter runs on. The Makefile runs it before building kilo:
+ *
+ *   ./genlex syntax/c.syntax syntax/go.syntax ... > syntax.h
+ *
+ * For every language it writes out
+ *
+ *   - a class table, mapping each of the 256 byte values to a character
+ *     class (separator, identifier, digit, quote, comment delimiter, ...)
+ *   - a DFA transition table indexed by state and class. The color of a byte
+ *     is the color of the state it moves the DFA into, so highlighting a row
+ *     takes one table lookup per byte.
+ *   - a perfect hash of the keywords: a hash function whose seeds are picked
+ *     here, by trying them until no two keywords collide, and a table with a
+ *     slot for each keyword. Looking up a word is one hash and one memcmp().
+ *
+ * A .syntax file is a list of "key value..." lines, '#' starts a comment:
+ *
+ *   name      the name shown in the status bar
+ *   match     file extensions (".c") or substrings of the file name
+ *   comment   the line comment start, one or two characters
+ *   spaced    "yes" if that only starts a comment at the start of a row or
+ *             after whitespace, as YAML's '#' does (foo#bar isn't one)
+ *   block     the block comment start and end, one or two characters each
+ *   strings   the quote characters
+ *   numbers   "yes" to highlight numbers
+ *   keyword1  keywords
+ *   keyword2  type names and the like, drawn in another color
+ */
+
+/*** includes ***/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*** defines ***/
+#define MAX_MATCH 16
+#define MAX_QUOTES 3
+#define MAX_DELIMS 4
+#define MAX_WORDS 256
+#define MAX_STATES 32
+#define MAX_CLASSES 16
+
+/* set on a transition that also recolors the previous byte, see buildDFA() */
+#define LEX_RECOLOR 0x80
+
+/* the classes every language has, quotes and delimiters come after these */
+enum lexClass {
+  CL_SEP = 0,
+  CL_IDENT,
+  CL_DIGIT,
+  CL_DOT,
+  CL_BSLASH,
+  CL_SPACE,
+  CL_OTHER
+};
+#define CL_QUOTE (CL_OTHER + 1)
+#define CL_DELIM (CL_QUOTE + MAX_QUOTES)
+
+/*** data ***/
+struct syntaxDef {
+  char *name;
+  char *match[MAX_MATCH];
+  int nmatch;
+  char *comment;
+  int spaced; /* the comment only starts after whitespace */
+  char *block[2];
+  int nblock;
+  char quotes[MAX_QUOTES];
+  int nquotes;
+  int numbers;
+  char *words[MAX_WORDS];
+  int kwtype[MAX_WORDS];
+  int nwords;
+};
+
+struct lexGen {
+  struct syntaxDef *def;
+  unsigned char cls[256];
+  unsigned char sep[MAX_CLASSES]; /* does the class end a keyword */
+  int nclasses;
+  char delims[MAX_DELIMS]; /* comment characters, with a class each */
+  int ndelims;
+
+  int nstates;
+  const char *color[MAX_STATES];
+  unsigned char eol[MAX_STATES]; /* does a block comment go on past the row */
+  unsigned char next[MAX_STATES][MAX_CLASSES];
+
+  int normal, punct, word, ident, number, line, block, block_star,
+      block_end, str_end;
+  int str[MAX_QUOTES], esc[MAX_QUOTES];
+  int prefix[MAX_DELIMS]; /* seen the first character of a comment start */
+
+  unsigned kw_a, kw_b, kw_c, kw_mask;
+};
+
+/*** syntax files ***/
+void die(const char *msg, const char *arg) {
+  fprintf(stderr, "genlex: %s: %s\n", msg, arg);
+  exit(1);
+}
+
+char *copyWord(const char *s) {
+  char *d = malloc(strlen(s) + 1);
+  if (d == NULL)
+    die("out of memory", s);
+  return strcpy(d, s);
+}
+
+char *copyDelim(const char *s, const char *file) {
+  if (strlen(s) > 2)
+    die("comment delimiters are one or two characters", file);
+  return copyWord(s);
+}
+
+void parseSyntax(const char *file, struct syntaxDef *def) {
+  FILE *fp = fopen(file, "r");
+  char line[1024];
+
+  if (fp == NULL)
+    die("can't open", file);
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *key = strtok(line, " \t\r\n");
+    char *tok;
+
+    if (key == NULL || key[0] == '#')
+      continue;
+
+    while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+      if (!strcmp(key, "name")) {
+        def->name = copyWord(tok);
+      } else if (!strcmp(key, "match")) {
+        if (def->nmatch == MAX_MATCH)
+          die("too many matches", file);
+        def->match[def->nmatch++] = copyWord(tok);
+      } else if (!strcmp(key, "comment")) {
+        def->comment = copyDelim(tok, file);
+      } else if (!strcmp(key, "block")) {
+        if (def->nblock == 2)
+          die("a block comment has a start and an end", file);
+        def->block[def->nblock++] = copyDelim(tok, file);
+      } else if (!strcmp(key, "strings")) {
+        if (def->nquotes == MAX_QUOTES)
+          die("too many quote characters", file);
+        def->quotes[def->nquotes++] = tok[0];
+      } else if (!strcmp(key, "spaced")) {
+        def->spaced = !strcmp(tok, "yes");
+      } else if (!strcmp(key, "numbers")) {
+        def->numbers = !strcmp(tok, "yes");
+      } else if (!strcmp(key, "keyword1") || !strcmp(key, "keyword2")) {
+        if (def->nwords == MAX_WORDS)
+          die("too many keywords", file);
+        def->kwtype[def->nwords] = key[7] == '1' ? 1 : 2;
+        def->words[def->nwords++] = copyWord(tok);
+      } else {
+        die("unknown key", key);
+      }
+    }
+  }
+  fclose(fp);
+
+  if (def->name == NULL)
+    die("no name", file);
+  if (def->nblock == 1)
+    die("a block comment has a start and an end", file);
+}
+
+/*** character classes ***/
+
+/* the characters kilo has always taken to separate words */
+int isSeparator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+int delimClass(struct lexGen *g, int c) {
+  char *p = c ? memchr(g->delims, c, g->ndelims) : NULL;
+  return p ? CL_DELIM + (int)(p - g->delims) : -1;
+}
+
+void addDelims(struct lexGen *g, const char *s) {
+  for (; s && *s; s++) {
+    if (delimClass(g, (unsigned char)*s) != -1)
+      continue;
+    if (g->ndelims == MAX_DELIMS)
+      die("too many comment characters", g->def->name);
+    g->delims[g->ndelims++] = *s;
+  }
+}
+
+void buildClasses(struct lexGen *g) {
+  struct syntaxDef *def = g->def;
+  int c, i;
+
+  addDelims(g, def->comment);
+  addDelims(g, def->block[0]);
+  addDelims(g, def->block[1]);
+  g->nclasses = CL_DELIM + g->ndelims;
+
+  for (c = 0; c < 256; c++) {
+    int cl = CL_OTHER;
+
+    if (c >= 128 || isalpha(c) || c == '_')
+      cl = CL_IDENT;
+    else if (isdigit(c))
+      cl = CL_DIGIT;
+    else if (c == '.')
+      cl = CL_DOT;
+    else if (c == '\\')
+      cl = CL_BSLASH;
+    else if (isspace(c))
+      cl = CL_SPACE;
+    else if (isSeparator(c))
+      cl = CL_SEP;
+    for (i = 0; i < def->nquotes; i++)
+      if (c == (unsigned char)def->quotes[i])
+        cl = CL_QUOTE + i;
+    if (delimClass(g, c) != -1)
+      cl = delimClass(g, c);
+    g->cls[c] = cl;
+    g->sep[cl] = isSeparator(c);
+  }
+}
+
+/*** dfa ***/
+int addState(struct lexGen *g, const char *color, int eol) {
+  g->color[g->nstates] = color;
+  g->eol[g->nstates] = eol;
+  return g->nstates++;
+}
+
+/* is cl the class of the i-th character of the delimiter d */
+int delimAt(struct lexGen *g, const char *d, int i, int cl) {
+  return d && (int)strlen(d) > i &&
+         delimClass(g, (unsigned char)d[i]) == cl;
+}
+
+/* what the byte before was, for startTrans() */
+enum { PREV_WORD, PREV_SEP, PREV_SPACE };
+
+/*
+ * Where a byte of class cl takes us from outside any comment or string.
+ * prev says what the byte before was: a number or a keyword can only start
+ * after a separator, and a spaced comment only after whitespace (the start of
+ * a row counts as that).
+ */
+int startTrans(struct lexGen *g, int prev, int cl) {
+  struct syntaxDef *def = g->def;
+  int line = delimAt(g, def->comment, 0, cl) &&
+             (!def->spaced || prev == PREV_SPACE);
+  int block = delimAt(g, def->block[0], 0, cl);
+  int q;
+
+  if (line && !def->comment[1])
+    return g->line;
+  if (block && !def->block[0][1])
+    return g->block;
+  if (line || block)
+    return g->prefix[cl - CL_DELIM];
+  for (q = 0; q < def->nquotes; q++)
+    if (cl == CL_QUOTE + q)
+      return g->str[q];
+
+  if (cl == CL_DIGIT && prev != PREV_WORD && def->numbers)
+    return g->number;
+  if (cl == CL_IDENT || cl == CL_DIGIT)
+    return prev != PREV_WORD ? g->ident : g->word;
+  if (cl == CL_SPACE)
+    return g->normal;
+  return g->sep[cl] ? g->punct : g->word;
+}
+
+void buildDFA(struct lexGen *g) {
+  struct syntaxDef *def = g->def;
+  char *end = def->block[1];
+  int i, q, cl;
+
+  g->normal = addState(g, "HL_NORMAL", 0);
+  g->punct = addState(g, "HL_NORMAL", 0);
+  g->word = addState(g, "HL_NORMAL", 0);
+  g->ident = addState(g, "HL_NORMAL", 0);
+  g->number = addState(g, "HL_NUMBER", 0);
+  g->line = addState(g, "HL_COMMENT", 0);
+  g->block = addState(g, "HL_MLCOMMENT", 1);
+  g->block_star = addState(g, "HL_MLCOMMENT", 1);
+  g->block_end = addState(g, "HL_MLCOMMENT", 0);
+  g->str_end = addState(g, "HL_STRING", 0);
+  for (q = 0; q < def->nquotes; q++) {
+    g->str[q] = addState(g, "HL_STRING", 0);
+    g->esc[q] = addState(g, "HL_STRING", 0);
+  }
+  for (i = 0; i < g->ndelims; i++)
+    g->prefix[i] = addState(g, "HL_NORMAL", 0);
+
+  for (cl = 0; cl < g->nclasses; cl++) {
+    int wordch = cl == CL_IDENT || cl == CL_DIGIT;
+
+    /*
+     * normal is where a row starts and where whitespace takes us, punct is
+     * after any other separator. A string or a comment that just ended counts
+     * as one of those.
+     */
+    g->next[g->normal][cl] = startTrans(g, PREV_SPACE, cl);
+    g->next[g->punct][cl] = startTrans(g, PREV_SEP, cl);
+    g->next[g->str_end][cl] = startTrans(g, PREV_SEP, cl);
+    g->next[g->block_end][cl] = startTrans(g, PREV_SEP, cl);
+
+    g->next[g->word][cl] = wordch ? g->word : startTrans(g, PREV_WORD, cl);
+    g->next[g->ident][cl] = wordch ? g->ident : startTrans(g, PREV_WORD, cl);
+    g->next[g->number][cl] = cl == CL_DIGIT || cl == CL_DOT
+                                 ? g->number
+                                 : startTrans(g, PREV_WORD, cl);
+    g->next[g->line][cl] = g->line;
+
+    /* block comments, watching for the end */
+    if (delimAt(g, end, 0, cl))
+      g->next[g->block][cl] = end[1] ? g->block_star : g->block_end;
+    else
+      g->next[g->block][cl] = g->block;
+    if (delimAt(g, end, 1, cl))
+      g->next[g->block_star][cl] = g->block_end;
+    else
+      g->next[g->block_star][cl] = g->next[g->block][cl];
+
+    /* strings, skipping over backslash escapes */
+    for (q = 0; q < def->nquotes; q++) {
+      if (cl == CL_BSLASH)
+        g->next[g->str[q]][cl] = g->esc[q];
+      else if (cl == CL_QUOTE + q)
+        g->next[g->str[q]][cl] = g->str_end;
+      else
+        g->next[g->str[q]][cl] = g->str[q];
+      g->next[g->esc[q]][cl] = g->str[q];
+    }
+
+    /*
+     * We've seen the first character of a two character comment start. If
+     * this byte completes it, the byte before is part of the comment too and
+     * gets recolored. If not, the byte before was just a separator (or not,
+     * as the case may be).
+     */
+    for (i = 0; i < g->ndelims; i++) {
+      int c = (unsigned char)g->delims[i];
+      int t = startTrans(g, g->sep[CL_DELIM + i] ? PREV_SEP : PREV_WORD, cl);
+
+      if (def->comment && def->comment[0] == c &&
+          delimAt(g, def->comment, 1, cl))
+        t = g->line | LEX_RECOLOR;
+      else if (def->block[0] && def->block[0][0] == c &&
+               delimAt(g, def->block[0], 1, cl))
+        t = g->block | LEX_RECOLOR;
+      g->next[g->prefix[i]][cl] = t;
+    }
+  }
+}
+
+/*** keywords ***/
+
+/* this has to match editorKeywordHash() in kilo.c */
+unsigned keywordHash(const char *s, size_t len, unsigned a, unsigned b,
+                     unsigned c) {
+  return (unsigned char)s[0] * a + (unsigned char)s[len / 2] * b +
+         (unsigned char)s[len - 1] * c + (unsigned)len;
+}
+
+int tryHash(struct syntaxDef *def, unsigned a, unsigned b, unsigned c,
+            unsigned mask) {
+  static unsigned char used[MAX_WORDS * 8];
+  int i;
+
+  memset(used, 0, mask + 1);
+  for (i = 0; i < def->nwords; i++) {
+    char *w = def->words[i];
+    unsigned h = keywordHash(w, strlen(w), a, b, c) & mask;
+    if (used[h])
+      return 0;
+    used[h] = 1;
+  }
+  return 1;
+}
+
+/*
+ * Look for seeds that give every keyword a slot of its own, starting with a
+ * table about twice the number of keywords and doubling it until we do.
+ */
+void findPerfectHash(struct lexGen *g) {
+  unsigned mask = 1, a, b, c;
+
+  while (mask + 1 < (unsigned)g->def->nwords * 2)
+    mask = mask * 2 + 1;
+
+  for (; mask < MAX_WORDS * 8; mask = mask * 2 + 1) {
+    for (a = 1; a < 64; a++)
+      for (b = 0; b < 64; b++)
+        for (c = 0; c < 64; c++)
+          if (tryHash(g->def, a, b, c, mask)) {
+            g->kw_a = a;
+            g->kw_b = b;
+            g->kw_c = c;
+            g->kw_mask = mask;
+            return;
+          }
+  }
+  die("no perfect hash for the keywords of", g->def->name);
+}
+
+/*** output ***/
+void emitBytes(const char *name, const char *table, const unsigned char *v,
+               int n) {
+  int i;
+
+  printf("static const unsigned char lex_%s_%s[%d] = {", name, table, n);
+  for (i = 0; i < n; i++)
+    printf("%s%d,", i % 16 ? " " : "\n    ", v[i]);
+  printf("\n};\n\n");
+}
+
+void emitLanguage(struct lexGen *g) {
+  struct syntaxDef *def = g->def;
+  const char *n = def->name;
+  int i, j;
+
+  printf("/* %s */\n\n", n);
+  printf("static char *lex_%s_match[] = {", n);
+  for (i = 0; i < def->nmatch; i++)
+    printf("\"%s\", ", def->match[i]);
+  printf("NULL};\n\n");
+
+  emitBytes(n, "class", g->cls, 256);
+
+  printf("static const unsigned char lex_%s_next[%d] = {\n", n,
+         g->nstates * g->nclasses);
+  for (i = 0; i < g->nstates; i++) {
+    printf("   ");
+    for (j = 0; j < g->nclasses; j++)
+      printf(" %d,", g->next[i][j]);
+    printf("\n");
+  }
+  printf("};\n\n");
+
+  printf("static const unsigned char lex_%s_color[%d] = {\n", n, g->nstates);
+  for (i = 0; i < g->nstates; i++)
+    printf("    %s,\n", g->color[i]);
+  printf("};\n\n");
+
+  emitBytes(n, "eol", g->eol, g->nstates);
+  emitBytes(n, "sep", g->sep, g->nclasses);
+
+  printf("static const struct lexKeyword lex_%s_keywords[%u] = {\n", n,
+         g->kw_mask + 1);
+  for (i = 0; i <= (int)g->kw_mask; i++) {
+    for (j = 0; j < def->nwords; j++) {
+      char *w = def->words[j];
+      if ((keywordHash(w, strlen(w), g->kw_a, g->kw_b, g->kw_c) &
+           g->kw_mask) == (unsigned)i)
+        break;
+    }
+    if (j < def->nwords)
+      printf("    {\"%s\", %d, HL_KEYWORD%d},\n", def->words[j],
+             (int)strlen(def->words[j]), def->kwtype[j]);
+    else
+      printf("    {NULL, 0, HL_NORMAL},\n");
+  }
+  printf("};\n\n");
+}
+
+void emitEntry(struct lexGen *g) {
+  const char *n = g->def->name;
+
+  printf("    {\"%s\", lex_%s_match, lex_%s_class, lex_%s_next, "
+         "lex_%s_color,\n",
+         n, n, n, n, n);
+  printf("     lex_%s_eol, lex_%s_sep, %d, %d, %d, %d, lex_%s_keywords,\n", n,
+         n, g->nclasses, g->normal, g->block, g->ident, n);
+  printf("     %u, %u, %u, %u},\n", g->kw_a, g->kw_b, g->kw_c, g->kw_mask);
+}
+
+int main(int argc, char *argv[]) {
+  struct syntaxDef *defs;
+  struct lexGen *gens;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: genlex <file.syntax>... > syntax.h\n");
+    return 1;
+  }
+  defs = calloc(argc, sizeof(*defs));
+  gens = calloc(argc, sizeof(*gens));
+  if (defs == NULL || gens == NULL)
+    die("out of memory", argv[0]);
+
+  printf("/* generated by genlex from the files in syntax/, don't edit */\n\n");
+  for (i = 1; i < argc; i++) {
+    struct lexGen *g = &gens[i];
+
+    parseSyntax(argv[i], &defs[i]);
+    g->def = &defs[i];
+    buildClasses(g);
+    buildDFA(g);
+    findPerfectHash(g);
+    emitLanguage(g);
+  }
+
+  printf("struct editorSyntax HLDB[] = {\n");
+  for (i = 1; i < argc; i++)
+    emitEntry(&gens[i]);
+  printf("};\n\n");
+  printf("#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))\n");
+  return 0;
+}
@@ -1,27 +1,985 @@
 /*** includes ***/
+
+/*
+ * feature test macros, so that -std=c99 still gives us the POSIX bits we use
+ * (sigaction(), clock_gettime(), ...). They have to come before any include.
+ */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) ||       \
+    defined(__OpenBSD__)
+#include <sys/event.h>
+#define KILO_KQUEUE 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KILO_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KILO_NEON 1
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
 /*** defines ***/
+#define KILO_TAB_STOP 8
+#define KILO_INDEX_CHUNK (1 << 20)
+#define KILO_ADD_CHUNK (64 * 1024)
+#define KILO_ARENA_BLOCK (64 * 1024)
+#define KILO_POOL_SLAB 1024
+#define KILO_PROF_SAMPLES 1024
+#define KILO_INPUT_RING (64 * 1024) /* must be a power of two */
+#define KILO_QUIT_TIMES 3
+#define KILO_SAVE_BUF (1 << 20)
+#define KILO_SAVE_PROGRESS (16 << 20)
+#define KILO_STATUS_MSG_MS 5000
+#define KILO_PROBE_MS 200 /* how long to wait for the terminal to answer */
+#define KILO_SEQ_MS 50 /* how long the rest of a key's bytes can take */
+#define KILO_RESIZE_MS 40 /* how long the size has to hold for a redraw */
+#define KILO_WRAP_WINDOW (1 << 20) /* rows the soft wrap cache covers at most */
+#define KILO_WRAP_GAP 4096 /* how far past it to extend rather than move it */
+#define KILO_HL_PAGE (64 * 1024) /* rows per page of background results */
+#define KILO_HL_PAGES (64 * 1024)
+#define KILO_HL_IDLE_MS 150
+#define KILO_SEARCH_CHUNK (8 << 20)
+#define KILO_SEARCH_THREADS 8
+#define KILO_SEARCH_MAX_HITS (1 << 24)
+#define KILO_RE_MAX_INSTS (64 * 1024) /* biggest a compiled regex may get */
+#define KILO_RE_MAX_REPEAT 1000       /* most {m,n} may ask for */
+#define KILO_SIDECAR_MIN (32 << 20) /* smaller files are quick to scan */
+#define KILO_TRIGRAM_BUCKETS (1 << 16)
+#define KILO_TRIGRAM_MAX_CHUNKS 4096
+#define KILO_FOLLOW_POLL_MS 1000
+#define KILO_FOLLOW_CHECK 1024 /* bytes before the end compared on growth */
+#define KILO_FOLLOW_SLICE (16 << 20) /* most read in one turn of the loop */
+#define KILO_UNDO_MB 16 /* history kept, KILO_UNDO_MB=<n> in the env says */
+#define KILO_UNDO_RUN_MS 1000 /* a pause this long ends a run of typing */
+#define KILO_JOURNAL_MS 250 /* changes wait this long to go to the swap file */
+#define KILO_JOURNAL_RETRY_MS 5000 /* and this long after a failed write */
+#define KILO_JOURNAL_CHUNK (1 << 20) /* longest text a journal record holds */
+#define KILO_SERVER_FILES 64 /* indexes the server keeps */
+#define KILO_SERVER_TIMEOUT 10 /* seconds a client gets to ask or listen */
+#define KILO_STREAM_CHUNK (1 << 20) /* most a stream's reader asks for */
+#define KILO_VIEW_EVERY 1024 /* rows between the checkpoints of kilo -v */
+#define KILO_VIEW_PAGE (64 * 1024) /* what kilo -v reads the file in */
+#define KILO_VIEW_PAGES 256        /* and how many of those it keeps */
+#define KILO_VIEW_BLOCKS 4 /* checkpoint stretches whose rows are kept */
+#define KILO_VIEW_SCAN (1 << 20)   /* what the kilo -v indexer reads at once */
+#define KILO_VIEW_POKE (64 << 20)  /* how often it updates the status bar */
+#define KILO_VIEW_ROW_MAX (1 << 20) /* longer rows are shown cut short */
+#define KILO_GLYPH_ROWS 256 /* rows whose glyphs are cached, a power of two */
+#define KILO_GLYPH_ROW_MAX (64 * 1024) /* longer ones are decoded as needed */
+
 #define CTRL_KEY(k) ((k) & 0x1f)
+#define EDITOR_MAX_TIMERS 8
+
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH
+};
+
+/* what the lexer carries from the end of one row into the next */
+enum editorLexState { LEX_NORMAL = 0, LEX_MLCOMMENT, LEX_UNKNOWN = 0xff };
+
+/* set on a DFA transition that also recolors the byte before, see genlex.c */
+#define LEX_RECOLOR 0x80
+
+/*
+ * what editorUtf8Glyph() makes of the bytes at some point in a row. A glyph is
+ * a character plus the combining marks and such that are drawn on top of it;
+ * its first byte has its kind, the rest are GLYPH_CONT.
+ */
+enum editorGlyph {
+  GLYPH_CONT = 0,
+  GLYPH_NARROW, /* one column */
+  GLYPH_WIDE,   /* two: CJK, most emoji */
+  GLYPH_MARK,   /* combining marks with nothing to combine with, one column */
+  GLYPH_BAD     /* control characters and broken UTF-8, shown as '?' */
+};
+
+/* keys that aren't characters are numbered past the last Unicode code point */
+enum editorKey {
+  BACKSPACE = 127,
+  ARROW_LEFT = 0x110000,
+  ARROW_RIGHT,
+  ARROW_UP,
+  ARROW_DOWN,
+  DEL_KEY,
+  HOME_KEY,
+  END_KEY,
+  PAGE_UP,
+  PAGE_DOWN,
+  PASTE_START
+};
 
 /*** data ***/
+struct editorTimer {
+  long long deadline; /* monotonic milliseconds, 0 when the slot is free */
+  void (*fn)(void);
+};
+
+/*
+ * one row of the screen, as cells: the UTF-8 shown in each column and the
+ * attributes it's drawn with, an SGR foreground color plus ATTR_REVERSE. A
+ * wide glyph's bytes go in its first cell, and the cell after it is left
+ * empty. The shadow keeps what we last sent to the terminal for each row, so
+ * the next frame only has to send the cells that changed.
+ */
+#define ATTR_DEFAULT 39
+#define ATTR_REVERSE 0x80
+
+struct screenLine {
+  char *chars; /* the bytes of every cell, one after the other */
+  int *cells;  /* cell x is chars[cells[x] .. cells[x + 1]), see cellStart() */
+  unsigned char *attrs;
+  int len; /* in cells */
+  int cap; /* how many bytes chars has room for */
+  int dirty; /* the terminal's copy is unknown, repaint no matter what */
+};
+
+/*
+ * what the terminal told us it can do (see editorProbeTerminal()), and the
+ * state we left it in: where its cursor is and what attributes are set, or -1
+ * when we can't be sure
+ */
+struct terminal {
+  int sync;   /* synchronized output, mode 2026 */
+  int scroll; /* scroll regions (DECSTBM) */
+  int su;     /* and SU/SD to scroll them, rather than IND/RI */
+  int x, y;
+  int attr;
+};
+
+/*
+ * The line index records where every '\n' in the file is, but only as far as
+ * we've needed to look so far. Opening a 10 GB log only has to find the first
+ * screenful of newlines; the rest are found on demand as the viewport moves.
+ */
+struct lineIndex {
+  size_t *nl; /* file offsets of the newlines found so far, in order */
+  size_t count;
+  size_t cap;
+  size_t scanned; /* every byte before this offset has been indexed */
+  int mapped;     /* nl points into a sidecar, see struct sidecar */
+};
+
+/*
+ * Instead of doing lots of small write() calls every time we refresh the
+ * screen, we build the whole frame up in a buffer first and then write it out
+ * in one go. Every write() is a syscall, and over SSH each one can end up as
+ * its own tiny TCP segment, so one write() per frame is a lot cheaper.
+ *
+ * The buffer keeps track of its capacity separately from its length and
+ * doubles the capacity whenever it runs out, so appending is amortized O(1)
+ * instead of calling realloc() on every append.
+ *
+ * Buffers that only live for one frame can be given an arena instead, so they
+ * grow by bumping a pointer and are all thrown away together when the next
+ * frame starts.
+ */
+struct arena;
+
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+  struct arena *arena; /* NULL for buffers on the regular heap */
+};
+
+#define ABUF_INIT {NULL, 0, 0, NULL}
+#define ABUF_ARENA(a) {NULL, 0, 0, (a)}
+
+/*
+ * The frame arena hands out memory for everything that only lives until the
+ * next screen refresh. Allocating is a pointer bump, and editorRefreshScreen()
+ * resets the whole thing at once. If a frame needs more than the current
+ * block, the old blocks are kept until the reset and then replaced by one
+ * block big enough for the whole frame, so after the first few frames the
+ * arena doesn't call malloc() at all.
+ */
+struct arenaBlock {
+  struct arenaBlock *prev;
+  size_t used;
+  size_t cap;
+  char data[];
+};
+
+struct arena {
+  struct arenaBlock *block;
+  size_t frame_bytes; /* bytes handed out since the last reset */
+  unsigned long allocs;
+  unsigned long resets;
+  unsigned long mallocs;
+  size_t high_water;
+};
+
+/*
+ * pool for fixed size objects (the piece table nodes). Objects come out of
+ * slabs of KILO_POOL_SLAB at a time and freed ones go on a free list, so
+ * nodes are recycled instead of going back and forth to malloc().
+ */
+struct poolFree {
+  struct poolFree *next;
+};
+
+struct pool {
+  size_t size;
+  struct poolFree *free;
+  unsigned long live;
+  unsigned long allocs;
+  unsigned long slabs;
+};
+
+/*
+ * The text itself lives in a piece table: the file we opened (mmap()ed, never
+ * modified) plus an append-only "add" buffer holding everything typed since.
+ * The document is a sequence of pieces, each one a span of one of those two
+ * buffers. Edits never move text around, they only split and insert pieces.
+ */
+enum pieceBuffer { PIECE_ORIG, PIECE_ADD };
+
+struct piece {
+  int buf; /* PIECE_ORIG or PIECE_ADD */
+  size_t off;
+  size_t len;
+  size_t lf; /* newlines inside the span */
+};
+
+/*
+ * pieces are kept in a treap (a randomly balanced binary tree) ordered by
+ * their position in the document. Every node also knows the total length and
+ * newline count of its subtree, which turns "where is byte n" and "where does
+ * row n start" into O(log n) walks from the root.
+ */
+struct pieceNode {
+  struct piece p;
+  struct pieceNode *left, *right;
+  unsigned prio;
+  size_t len; /* bytes in this subtree */
+  size_t lf;  /* newlines in this subtree */
+};
+
+/*
+ * The add buffer is a list of chunks that are never reallocated, so a pointer
+ * into it stays valid forever. Offsets are global across chunks; chunk i
+ * covers [base, base + cap).
+ */
+struct addChunk {
+  char *data;
+  size_t base;
+  size_t len;
+  size_t cap;
+  int dead; /* nothing can point into it any more, see editorAddReclaim() */
+};
+
+struct addBuffer {
+  struct addChunk *chunks;
+  int numchunks;
+  struct lineIndex idx; /* newlines in the add buffer, always complete */
+};
+
+/* the last KILO_PROF_SAMPLES timings of something, in nanoseconds */
+struct profStat {
+  long long v[KILO_PROF_SAMPLES];
+  int n;
+  int next;
+};
+
+/*
+ * Instrumentation, only switched on by the KILO_PROFILE environment variable.
+ * With KILO_PROFILE=1 the numbers are shown in the message bar, with any
+ * other value it's taken as a file name and a summary is written there on
+ * exit.
+ */
+struct profile {
+  int enabled;
+  char *dumpfile;
+  struct profStat keypress;
+  struct profStat draw;
+  struct profStat flush;
+  struct profStat latency; /* from reading a key to the frame showing it */
+  long long key_at;        /* when the oldest unpainted key came in, or 0 */
+  unsigned long frames;
+  unsigned long writes;
+  unsigned long long bytes;
+  unsigned long frame_writes;
+  unsigned long frame_bytes;
+  unsigned long long re_bytes; /* the last regex search: how much it read */
+  long long re_ns;             /* and how long that took */
+};
+
+/*
+ * bytes read from the terminal but not turned into keys yet. head and tail
+ * only ever grow; the difference is how much is buffered.
+ */
+struct inputRing {
+  char buf[KILO_INPUT_RING];
+  unsigned head, tail;
+};
+
+/*
+ * Saving happens on a background thread. When the save starts we take a
+ * snapshot of the piece table: just the list of spans, since the buffers they
+ * point into never change. The writer streams those spans into a temporary
+ * file next to the target and rename()s it into place when it's done, so a
+ * crash halfway through leaves the old file untouched.
+ */
+struct saveSpan {
+  const char *text; /* NULL for a span of the original file */
+  off_t off;        /* where in the original file, for those */
+  size_t len;
+};
+
+/*
+ * Background threads read the file through E.map and E.fd while the main
+ * thread goes on. When either has to change under them (a save that overwrites
+ * the file moves them to a copy of it first), the main thread closes the gate:
+ * it waits for the readers inside to come out, and new ones wait at the gate
+ * until it opens again. Readers only go in for a bounded stretch, a search
+ * chunk or a page of rows, so that never takes long.
+ */
+struct mapGate {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int readers;
+  int closed;
+};
+
+/*
+ * A save writes the document to a new file next to the target and fsync()s
+ * it before anything happens to the old one. Usually the new file is then
+ * renamed over the old. When that would lose something (see editorSave()), it
+ * is copied into the old file instead, as a second phase: by then the text is
+ * safe on disk, and if copying fails or we crash, it's still in tmpname.
+ */
+struct saveJob {
+  int active;
+  pthread_t thread;
+  char *filename;
+  char *target; /* filename with its symlinks resolved */
+  char *tmpname;
+  int staged;   /* the new file, open until it's been copied into target */
+  int aside;    /* a copy of the old file, for E.map to move to, or -1 */
+  int phase;    /* 0 writing the new file, 1 copying it into target */
+  int kept;     /* the copy failed, the new text was left in tmpname */
+  struct saveSpan *spans;
+  size_t numspans;
+  int srcfd;
+  const char *map; /* srcfd's private mapping, and its size */
+  size_t mapsize;
+  int exists; /* target is there already, with this mode and owner */
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  int inplace; /* copy into target rather than rename a new file over it */
+  int pinned;  /* a followed file, which we never write into */
+  size_t total;
+  size_t done;  /* bytes written so far, updated by the writer */
+  int finished; /* set by the writer, read with __atomic_load_n() */
+  int error;    /* errno of the first thing that went wrong */
+  int dirty;    /* E.dirty when the snapshot was taken */
+  unsigned long undostate; /* editorUndoState() then */
+};
+
+/*
+ * A regular expression compiled to a Thompson NFA, see the regex section.
+ * RE_BYTE takes one byte from sets[x]; RE_SPLIT goes on at x and at y, x
+ * first; RE_JMP goes on at x. RE_BOL and RE_EOL only let a thread through at
+ * the start or end of a row.
+ */
+enum reOp { RE_BYTE, RE_SPLIT, RE_JMP, RE_BOL, RE_EOL, RE_MATCH };
+
+struct reInst {
+  int op;
+  int x, y;
+};
+
+struct regex {
+  struct reInst *code;
+  int n, cap;
+  uint64_t (*sets)[4]; /* 256 bit byte sets */
+  int nsets, setcap;
+  uint64_t first[4]; /* bytes a match can start with */
+  int firstbyte;     /* the only one, or -1 */
+  int nullable;      /* it can match nothing, so it matches everywhere */
+  const char *error; /* why it didn't compile */
+};
+
+/* a thread of the NFA: where in the program, and where its match started */
+struct reThread {
+  int pc;
+  size_t start;
+};
+
+/* what running a regex needs, one per thread that runs it */
+struct reVM {
+  const struct regex *re;
+  struct reThread *cur, *next;
+  int *stack;
+  unsigned *mark; /* pc was added in step gen already */
+  unsigned gen;
+};
+
+/*
+ * Searching cuts a snapshot of the document into chunks of KILO_SEARCH_CHUNK
+ * bytes and lets a pool of threads loose on them, starting with the chunk
+ * the cursor is in. A chunk's hits are in document order and belong to the
+ * worker until it sets done; after that the main thread may read them. Each
+ * finished chunk pokes the wake pipe, so results show up as they come in.
+ *
+ * A job is shared by the main thread and every worker that picked it up, and
+ * the last of them to let go frees it. When the query changes the old job is
+ * cancelled and the workers move on to the new one as soon as they notice.
+ */
+struct searchChunk {
+  size_t start, end; /* the hits that start in [start, end) */
+  size_t *hits;
+  size_t *lens; /* how long each hit is, for a regex */
+  size_t numhits;
+  int done;
+};
+
+struct searchJob {
+  int refs; /* protected by the pool's lock */
+  int cancel;
+  char *query;
+  size_t qlen;
+  struct regex *re; /* if the query is a regex */
+  const char *map;
+  struct saveSpan *spans;
+  size_t *spanstart; /* document offset of each span */
+  size_t numspans;
+  size_t size;
+  struct searchChunk *chunks;
+  size_t numchunks;
+  size_t first;    /* the chunk the search started in */
+  size_t claimed;  /* chunks handed out to workers so far, atomic */
+  size_t finished; /* chunks done, atomic */
+  size_t total;    /* hits so far, atomic */
+  int truncated;   /* a hit didn't fit in memory and was dropped, atomic */
+  size_t settled;  /* chunks before this don't overlap the hits before them */
+  size_t next;     /* where the last hit in those ends */
+  const uint64_t *tri; /* the sidecar's trigram bitmaps, if they apply */
+  size_t triwords;
+  unsigned long version; /* E.version when the snapshot was taken */
+  long long started, ended; /* for the throughput in the profile overlay */
+};
+
+struct searchState {
+  int nthreads;
+  pthread_t threads[KILO_SEARCH_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct searchJob *job; /* the current search, if any */
+  unsigned long serial;  /* bumped for every new job */
+
+  size_t origin; /* where the cursor was when the search started */
+  int found;     /* have we jumped to a hit yet */
+  size_t chunk, hit; /* the hit we're on */
+  size_t matchoff, matchlen; /* highlighted as HL_MATCH while matchlen > 0 */
+  const char *error;  /* why the regex didn't compile */
+  char *replace;      /* replace every hit with this once the search is done */
+};
+
+/*
+ * The line index of a big file is worth keeping. Once it's complete we write
+ * it to a sidecar file in ~/.cache/kilo, and the next time the same file is
+ * opened we mmap() that instead of scanning the file again. Sidecars are
+ * named after the file's device and inode, and only trusted while the size
+ * and mtime they recorded still match.
+ *
+ * Next to the newline offsets a sidecar can have a trigram index for search:
+ * for every three byte string (hashed into KILO_TRIGRAM_BUCKETS) a bitmap of
+ * the search chunks it occurs in. A chunk can only hold a hit if all of the
+ * query's trigrams occur in it or, for a hit running over its end, in the next.
+ */
+struct sidecarHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t wordsize; /* sizeof(size_t), the offsets are stored as is */
+  uint64_t dev, ino, size, mtime, mtime_nsec;
+  uint64_t count; /* newlines */
+  uint64_t nloff; /* where in the sidecar they are */
+  uint64_t trioff, tribytes, trichunk, triwords; /* trioff 0: no trigrams */
+  uint64_t hloff;    /* end state of each row, 0 if there aren't any */
+  uint64_t hlsyntax; /* the HLDB entry they are for, counting from 1 */
+};
+
+struct sidecar {
+  struct sidecarHeader hdr; /* what a sidecar for the open file must say */
+  char *path;
+  void *map; /* the sidecar we loaded, if we did */
+  size_t mapsize;
+  const uint64_t *tri; /* trigram bitmaps, from the sidecar or the writer */
+  size_t triwords;     /* 64 bit words per bucket */
+
+  /* the writer thread */
+  int active;
+  pthread_t thread;
+  int finished;
+  int cancel;
+  uint64_t *built; /* the bitmaps it made */
+};
+
+/*
+ * the swap file, see the journal section: a header naming the file the
+ * changes were made to, then the changes in batches, each a batchHeader and
+ * the records in it
+ */
+struct journalHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t wordsize;
+  uint64_t dev, ino, size, mtime, mtime_nsec; /* all 0 for a new file */
+};
+
+struct journalBatch {
+  uint32_t len; /* bytes of records that follow */
+  uint32_t sum; /* their journalSum() */
+};
+
+struct journal {
+  char *path; /* NULL when changes aren't journaled */
+  int fd;     /* the swap file, locked as long as we have it open */
+  int live;   /* it has hdr, and the changes since, rather than nothing */
+  pthread_t main; /* the only thread that may touch pending */
+  struct journalHeader hdr;
+  int orig;          /* hdr is the file E.map maps */
+  int armed;         /* the flush timer is set */
+  int replaying;     /* don't log what the journal itself replays */
+  struct abuf pending; /* logged since the last batch was handed over */
+  struct abuf saving;  /* logged since the running save took its snapshot */
+
+  /* the writer thread */
+  int started;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; /* there's a batch, or the batch is done */
+  struct abuf batch;   /* being written while busy, or again after error */
+  int busy;
+  int quit;
+  int error; /* errno of the last batch that didn't make it to disk */
+};
+
+/*
+ * the index server, see the server section. The daemon keeps a sidecar for
+ * each file it was asked about; an editor only has the connection it's
+ * waiting for an answer on.
+ */
+enum serverFileState { SERVER_EMPTY, SERVER_BUILDING, SERVER_READY };
+
+struct serverFile {
+  int state;
+  struct sidecarHeader key; /* the version of the file it's for */
+  int fd;                   /* the sidecar, once READY */
+  long long used;
+};
+
+struct indexServer {
+  int fd; /* in the editor: waiting for the server's answer, or -1 */
+  pthread_mutex_t lock;
+  pthread_cond_t built; /* a file is no longer BUILDING */
+  struct serverFile files[KILO_SERVER_FILES];
+};
+
+/* soft wrap, see the soft wrap section */
+struct wrapCache {
+  int enabled;
+  int cols;        /* the width the counts are for */
+  uint32_t *lines; /* screen lines of each row, 0 if not measured yet */
+  size_t *tree;    /* Fenwick tree over lines, 1-based */
+  size_t base, n;  /* the window of rows covered */
+  size_t cap;
+  int stale; /* rows were added or removed, the tree needs rebuilding */
+};
+
+/*
+ * a change in the undo history, see the undo section: len bytes taken out at
+ * pos, or put in, and the pieces they were
+ */
+enum undoKind { UNDO_INSERT, UNDO_DELETE };
+
+struct undoOp {
+  int kind;
+  unsigned long id;  /* the document as this change leaves it, see below */
+  unsigned group;    /* changes with the same group are undone together */
+  size_t cursor;     /* where the cursor was before the group */
+  long long at;      /* when it last grew, see editorUndoInsert() */
+  size_t pos, len;
+  struct piece one;  /* the only piece, or */
+  struct piece *pieces; /* all of them when there's more than one */
+  size_t npieces, cap;
+  size_t *spot;    /* a key typed at a column of cursors, see */
+  size_t *spotlen; /* undoApplySpots() */
+  size_t nspots;
+};
+
+struct undoHistory {
+  struct undoOp *ops;
+  size_t n;    /* changes in the history */
+  size_t next; /* [0, next) are done, [next, n) were undone and can be redone */
+  size_t cap;
+  unsigned group; /* for the next change that doesn't extend the last */
+  int sealed;     /* the last change can't be extended any more */
+  size_t bytes;   /* what the history takes up */
+  size_t limit;
+  unsigned long ids;   /* the last id a change got */
+  unsigned long base;  /* the id of the document before ops[0] */
+  unsigned long saved; /* and of the document last saved */
+};
+
+/*
+ * ^B, a column of cursors: one on every row from anchor to the cursor's, at
+ * the cursor's column. See the cursors section.
+ */
+struct cursorBlock {
+  int active;
+  size_t anchor;
+  size_t *pos, *len; /* where each cursor's edit goes, for one key */
+  size_t cap;
+};
+
+/* edits the row caches hear about as one, see editorBeginBatch() */
+struct rowBatch {
+  int depth;
+  int pending;
+  size_t at, removed, added;
+};
+
+/* the glyphs of a row with non-ASCII text in it, see the utf-8 section */
+struct glyphRow {
+  size_t row;
+  size_t len;          /* of the row when it was decoded */
+  unsigned char *kind; /* editorGlyph of every byte, NULL for a free slot */
+};
+
+/* kilo -f, see the follow section */
+struct follow {
+  int enabled;
+  int fd;           /* inotify or kqueue descriptor, -1 if we have to poll */
+  char *map;        /* our copy of the file, see the follow section */
+  size_t reserve;   /* how much it can hold */
+  size_t committed; /* how much of that is writable so far */
+};
+
+/* a document read from a pipe, see the stream section */
+struct stream {
+  int active; /* the reader is running */
+  int piped;  /* kilo -, in is what stdin was */
+  int in;
+  pid_t child;         /* the decompressor writing to in, if any */
+  const char *command; /* and what it's called */
+  char *name;          /* shown in place of a filename */
+  char *map;           /* the reserved mapping the reader fills */
+  size_t reserve;
+  size_t committed; /* how much of it the reader has made writable */
+
+  /* the reader thread */
+  pthread_t thread;
+  size_t filled; /* bytes in map, updated by the reader */
+  int poked;     /* the reader poked the wake pipe since we last looked */
+  int finished;
+  int error; /* errno of a failed read, or EFBIG when map is full */
+};
+
+/* the row starts of one stretch of kilo -v, see the viewer section */
+struct viewBlock {
+  size_t k;        /* rows k * KILO_VIEW_EVERY and on */
+  size_t limit;    /* how far into the file they were looked for */
+  size_t n;        /* newlines found, so off[0..n] are good */
+  size_t *off;     /* KILO_VIEW_EVERY + 1 entries, NULL for a free slot */
+  unsigned long used;
+};
+
+/* kilo -v, a read-only view in bounded memory, see the viewer section */
+struct viewer {
+  int enabled;
+  int fd;
+  size_t size;
+
+  /* the page cache */
+  char *pages; /* KILO_VIEW_PAGES of KILO_VIEW_PAGE bytes */
+  size_t page[KILO_VIEW_PAGES];    /* which page of the file each slot has */
+  size_t pagelen[KILO_VIEW_PAGES]; /* short for the last one */
+  unsigned long used[KILO_VIEW_PAGES];
+  unsigned long tick;
+  struct viewBlock blocks[KILO_VIEW_BLOCKS];
+  struct abuf row; /* the row editorViewRowChars() returned */
+
+  /*
+   * ckpt[i] is where row i * KILO_VIEW_EVERY starts. The indexer thread
+   * fills it in, publishing nckpt, then lines, the newlines it has counted,
+   * and then scanned, the bytes it has read.
+   */
+  pthread_t thread;
+  size_t *ckpt;
+  size_t cap;
+  size_t nckpt;
+  size_t lines;
+  size_t scanned;
+  size_t rows; /* all of them, good once done is set */
+  int done;
+  int joined;
+  int cancel;
+  int error;
+};
+
+/* state for kilo --bench-keys, see the benchmarks section */
+struct benchRun {
+  FILE *report;
+  off_t script_size;
+  unsigned long keys;
+  long long start;
+};
+
+/* a slot in a language's keyword table, see editorKeyword() */
+struct lexKeyword {
+  const char *word;
+  unsigned char len;
+  unsigned char hl;
+};
+
+/*
+ * A language, as compiled by genlex from its syntax/ file. The lexer is a
+ * DFA: every byte is mapped to a character class, and next[] takes the
+ * current state and the class to the new state, whose color says how to draw
+ * the byte. Keywords are words that started in the ident state, found
+ * through a perfect hash.
+ */
+struct editorSyntax {
+  char *filetype;
+  char **filematch;
+  const unsigned char *cls;   /* byte -> class */
+  const unsigned char *next;  /* state * nclasses + class -> state */
+  const unsigned char *color; /* state -> HL_* */
+  const unsigned char *eol;   /* state -> still in a block comment */
+  const unsigned char *sep;   /* class -> can end a keyword */
+  int nclasses;
+  int start;  /* the state each row starts in */
+  int block;  /* ... or this one, inside a block comment */
+  int ident;  /* a word that might be a keyword */
+  const struct lexKeyword *keywords;
+  unsigned kw_a, kw_b, kw_c, kw_mask;
+};
+
+/*
+ * Highlighting is worked out only for the rows we draw. What we do remember
+ * is the lexer state at the end of every row we've lexed, because that's
+ * what the next row starts from (are we inside a comment?). state[i] is
+ * trusted for i < dirty, and below valid it is at least a good guess: after
+ * an edit we re-lex forward from dirty only until a row ends in the same
+ * state it did before, since from there on nothing can have changed (up to
+ * the next edited row, which is marked LEX_UNKNOWN).
+ */
+struct hlCache {
+  unsigned char *state;
+  size_t cap;
+  size_t valid; /* rows with a cached end state */
+  size_t dirty; /* first row whose cached state might be stale */
+
+  /* the end states of the file on disk, from the index server's sidecar */
+  const unsigned char *shared;
+  size_t sharedrows;
+  struct editorSyntax *sharedsyntax; /* what they were lexed for */
+  unsigned long sharedversion;       /* E.version they are good for */
+};
+
+/*
+ * A background thread works out the end states of the rows below the ones
+ * we've looked at, so that paging down never has to lex its way there. It
+ * lexes a snapshot of the document (like a save, see struct saveSpan) and
+ * publishes what it finds in pages of KILO_HL_PAGE rows.
+ *
+ * Every edit bumps gen, and each page is tagged with the generation its rows
+ * [lo, hi) belong to. The worker fills in a row before moving hi past it, so
+ * the main thread reads a page without locking: anything below hi is good as
+ * long as the page's gen is the current one. Only handing over a new job
+ * takes the lock.
+ */
+struct hlPage {
+  unsigned gen;
+  size_t lo, hi;
+  unsigned char state[KILO_HL_PAGE];
+};
+
+struct hlJob {
+  unsigned gen;
+  struct editorSyntax *syntax;
+  const char *map;
+  struct saveSpan *spans;
+  size_t numspans;
+  size_t skip;  /* bytes before row in the snapshot */
+  size_t row;   /* first row to lex */
+  int state;    /* the state row starts in */
+};
+
+struct hlWorker {
+  int started;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct hlJob job;
+  int pending;     /* job is waiting to be picked up */
+  unsigned gen;    /* bumped on every edit, read by the worker */
+  unsigned posted; /* the generation of the last job we handed over */
+  struct hlPage **pages;
+};
+
 struct editorConfig {
+  size_t cx, cy; /* cursor: byte offset in the row, and row number */
+  size_t rx;     /* cursor column on screen, after expanding tabs */
+  size_t rowoff;
+  size_t rowsub; /* with soft wrap, the first screen line of rowoff shown */
+  size_t coloff;
   int screenrows;
   int screencols;
+  char *filename;
+  int fd;          /* kept open so saves can copy from it */
+  const char *map; /* the whole file, mmap()ed read-only */
+  size_t mapsize;
+  struct lineIndex idx;
+  struct pieceNode *pt;
+  struct addBuffer add;
+  struct abuf rowbuf; /* rows that span several pieces are copied here */
+  struct arena frame;
+  struct pool nodes;
+  struct profile prof;
+  struct inputRing in;
+  int headless; /* run without a terminal, for benchmarks */
+  struct benchRun bench;
+  int dirty;
+  unsigned long version; /* bumped by every change to the document */
+  struct editorSyntax *syntax;
+  struct hlCache hl;
+  struct hlWorker hlw;
+  struct searchState search;
+  struct sidecar sidecar;
+  struct indexServer server;
+  struct follow follow;
+  struct stream stream;
+  struct viewer view;
+  struct wrapCache wrap;
+  struct glyphRow glyphs[KILO_GLYPH_ROWS];
+  struct undoHistory undo;
+  struct cursorBlock block;
+  struct rowBatch batch;
+  struct journal journal;
+  struct saveJob save;
+  struct mapGate gate;
+  int wakepipe[2]; /* background threads poke the main loop through this */
+  char statusmsg[80];
+  struct screenLine *shadow;
+  int shadowrows;
+  size_t shadowoff; /* editorVisualLine() of the first text row drawn */
+  struct terminal term;
+  int redraw; /* set whenever the next loop iteration has to repaint */
+  int resizing; /* the window is being resized, we don't know its size */
+  int sigpipe[2];
+  struct editorTimer timers[EDITOR_MAX_TIMERS];
   struct termios origin_termios;
 };
 
 struct editorConfig E;
 
+/*** filetypes ***/
+
+/* HLDB[] and the lexer tables behind it, generated by genlex from syntax/ */
+#include "syntax.h"
+
+/*** prototypes ***/
+void editorRowsChanged(size_t at, size_t removed, size_t added);
+void ptRefreshTail(void);
+void initEditor(void);
+void editorAddTimer(int ms, void (*fn)(void));
+void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen(void);
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorHandleWakeup(void);
+void editorSaveSidecar(void);
+void editorSnapshotNode(struct pieceNode *t, struct saveSpan *spans, size_t *n);
+size_t editorCountPieces(struct pieceNode *t);
+void editorFollowCheck(void);
+const char *streamSuffix(const char *filename);
+void editorOpen(char *filename);
+void editorInvalidateScreen(void);
+long long editorNow(void);
+int editorNextTimeout(void);
+void editorRunTimers(void);
+void editorHandleResize(void);
+int utf8Decode(const char *s, size_t len, int *cp);
+void editorUndoInsert(size_t pos, const struct piece *p);
+void editorUndoDelete(size_t pos, size_t len, struct pieceNode *cut);
+void editorUndoInsertAt(const size_t *pos, size_t n, const struct piece *p);
+void editorUndoDeleteAt(const size_t *pos, const size_t *len, size_t n,
+                        size_t i, struct pieceNode *cut);
+void editorJournalInsert(size_t pos, const struct piece *p, size_t n);
+void editorJournalDelete(size_t pos, size_t len);
+void editorJournalSync(void);
+void editorJournalOpen(struct stat *st);
+void editorJournalSaved(const char *filename, int ok);
+void editorAskServer(int fd, struct stat *st);
+struct viewBlock *viewBlockFor(size_t k);
+void editorBeginBatch(void);
+void editorEndBatch(void);
+int searchCancelled(struct searchJob *job);
+long long editorNowNs(void);
+void editorReplaceAll(void);
+void editorUndoInsertPieces(size_t pos, const struct piece *p, size_t n);
+char *editorPromptLine(char *prompt, void (*callback)(char *, int),
+                       int empty);
+void editorBenchService(int wait);
+ssize_t editorWrite(const void *buf, size_t len);
+void editorMapEnter(void);
+void editorMapLeave(void);
+
 /*** terminal ***/
 void die(const char *s) {
-  write(STDOUT_FILENO, "\x1b[2j", 4);
+  int saved_errno = errno;
+
+  /* whatever we were doing, the changes made so far can still be saved */
+  editorJournalSync();
+  errno = saved_errno;
+
+  write(STDOUT_FILENO, "\x1b[m\x1b[2J", 7);
   write(STDOUT_FILENO, "\x1b[H", 3);
 
   perror(s);
@@ -29,6 +987,7 @@ void die(const char *s) {
 }
 
 void disableRawMode(void) {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.origin_termios) == -1)
     die("tcsetattr");
 }
@@ -118,8 +1077,8 @@ void enableRawMode(void) {
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
   /**
-   * set a timeout, so that read() returns if it doesn’t get any input for a
-   * certain amount of time.
+   * make read() non-blocking, so that read() returns right away if there is no
+   * input to be read.
    *
    * They are indexes into the c_cc field, which stands for “control
    * characters”, an array of bytes that control various terminal settings.
@@ -129,14 +1088,16 @@ void enableRawMode(void) {
    * is any input to be read.
    *
    * The VTIME value sets the maximum amount of time to wait before read()
-   * returns.
+   * returns. It is in tenths of a second.
    *
-   * It is in tenths of a second, so we set it to 1/10 of a second, or 100
-   * milliseconds. If read() times out, it will return 0, which makes sense
-   * because its usual return value is the number of bytes read.
+   * We used to set VTIME to 1, so read() woke us up every 100 milliseconds
+   * even when nothing happened, and every wake up redrew the screen. Now the
+   * waiting is done by poll() in the main loop (see the events section), which
+   * sleeps until there is actually something to do, so read() doesn't need to
+   * wait at all. If there is nothing to read, it will return 0.
    */
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   /*
    * tcsetattr() method is a POSIX system call that sets terminal
@@ -149,23 +1110,305 @@ void enableRawMode(void) {
    */
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  /*
+   * bracketed paste: the terminal wraps anything pasted in "\x1b[200~" and
+   * "\x1b[201~", so we can insert a paste in one go instead of treating it as
+   * thousands of key presses (see editorPaste())
+   */
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-char editorReadKey(void) {
-  int nread;
-  char c;
+/*
+ * Input is read in big chunks into E.in instead of one byte per read(), so a
+ * paste or a burst of key repeats shows up all at once. The main loop then
+ * handles every key that is already buffered before drawing a single frame.
+ */
+int editorInputPending(void) { return E.in.head != E.in.tail; }
+
+/* read whatever the terminal has for us, returns how many bytes we got */
+int editorReadInput(void) {
+  struct inputRing *in = &E.in;
+  int total = 0;
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) == 1) {
-    if (nread == -1 && errno != EAGAIN)
+  while (in->head - in->tail < KILO_INPUT_RING) {
+    unsigned at = in->head % KILO_INPUT_RING;
+    unsigned room = KILO_INPUT_RING - (in->head - in->tail);
+    int nread;
+
+    if (room > KILO_INPUT_RING - at)
+      room = KILO_INPUT_RING - at;
+
+    nread = read(STDIN_FILENO, in->buf + at, room);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
+    if (nread <= 0)
+      break;
+    in->head += nread;
+    total += nread;
+  }
+  return total;
+}
+
+/* the next buffered byte, reading more if we ran out; 0 if there is none */
+int editorNextByte(char *c) {
+  if (!editorInputPending())
+    editorReadInput();
+  if (!editorInputPending())
+    return 0;
+
+  *c = E.in.buf[E.in.tail++ % KILO_INPUT_RING];
+  return 1;
+}
+
+/*
+ * the next byte of a key whose first byte is in: usually right behind it, but
+ * over ssh or a slow line the rest may come in a later read(), so give it
+ * KILO_SEQ_MS to show up
+ */
+int editorSeqByte(char *c) {
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+  if (editorNextByte(c))
+    return 1;
+  if (E.headless || poll(&pfd, 1, KILO_SEQ_MS) <= 0)
+    return 0;
+  return editorNextByte(c);
+}
+
+int editorReadKey(void) {
+  char c;
+
+  /*
+   * keep trying until we actually got a byte. Since read() doesn't block, wait
+   * in poll() between attempts instead of spinning on the CPU.
+   */
+  if (E.headless)
+    editorBenchService(0);
+  while (!editorNextByte(&c)) {
+    struct pollfd fds[3] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {E.wakepipe[0], POLLIN, 0},
+        {E.sigpipe[0], POLLIN, 0},
+    };
+    if (poll(fds, 3, editorNextTimeout()) == -1 && errno != EINTR)
+      die("poll");
+
+    /*
+     * background work keeps reporting in while we wait here, say in a prompt,
+     * and the window can be resized
+     */
+    if (fds[1].revents & POLLIN)
+      editorHandleWakeup();
+    if (fds[2].revents & POLLIN)
+      editorHandleResize();
+    editorRunTimers();
+    if (E.redraw) {
+      editorRefreshScreen();
+      E.redraw = 0;
+    }
+  }
+
+  /*
+   * arrow keys and friends arrive as escape sequences like "\x1b[A". The rest
+   * of the sequence is written together with the escape byte, so if it isn't
+   * there soon after, the user just pressed Escape.
+   */
+  if (c == '\x1b') {
+    char seq[3];
+
+    if (!editorSeqByte(&seq[0]))
+      return '\x1b';
+    if (!editorSeqByte(&seq[1]))
+      return '\x1b';
+
+    if (seq[0] == '[') {
+      if (seq[1] >= '0' && seq[1] <= '9') {
+        int num = seq[1] - '0';
+
+        /* "\x1b[<number>~", the number is one digit except for pastes */
+        while (1) {
+          if (!editorSeqByte(&seq[2]))
+            return '\x1b';
+          if (seq[2] < '0' || seq[2] > '9' || num > 1000)
+            break;
+          num = num * 10 + (seq[2] - '0');
+        }
+        if (seq[2] == '~') {
+          switch (num) {
+          case 1:
+          case 7:
+            return HOME_KEY;
+          case 3:
+            return DEL_KEY;
+          case 4:
+          case 8:
+            return END_KEY;
+          case 5:
+            return PAGE_UP;
+          case 6:
+            return PAGE_DOWN;
+          case 200:
+            return PASTE_START;
+          }
+        }
+      } else {
+        switch (seq[1]) {
+        case 'A':
+          return ARROW_UP;
+        case 'B':
+          return ARROW_DOWN;
+        case 'C':
+          return ARROW_RIGHT;
+        case 'D':
+          return ARROW_LEFT;
+        case 'H':
+          return HOME_KEY;
+        case 'F':
+          return END_KEY;
+        }
+      }
+    } else if (seq[0] == 'O') {
+      switch (seq[1]) {
+      case 'H':
+        return HOME_KEY;
+      case 'F':
+        return END_KEY;
+      }
+    }
+
+    return '\x1b';
+  }
+
+  /*
+   * a character that isn't ASCII comes in as a UTF-8 sequence, written
+   * together but not always read together. What we hand back is the code
+   * point, or U+FFFD if the bytes don't make one.
+   */
+  if (c & 0x80) {
+    char seq[4];
+    int n = 1, want, cp;
+
+    seq[0] = c;
+    want = (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3
+           : (c & 0xf8) == 0xf0 ? 4 : 1;
+    while (n < want && editorSeqByte(&seq[n])) {
+      if ((seq[n] & 0xc0) != 0x80) {
+        E.in.tail--; /* the start of the next key, put it back */
+        break;
+      }
+      n++;
+    }
+    if (utf8Decode(seq, n, &cp) != n || cp < 0)
+      return 0xfffd;
+    return cp;
   }
 
   return c;
 }
 
+/* put a byte the user typed back in the input ring, if there's room */
+void editorUnreadByte(char c) {
+  if (E.in.head - E.in.tail < KILO_INPUT_RING)
+    E.in.buf[E.in.head++ % KILO_INPUT_RING] = c;
+}
+
+/*
+ * Ask the terminal what it supports. DECRQM ("\x1b[?2026$p") asks about
+ * synchronized output, and DA1 ("\x1b[c") asks what kind of terminal this
+ * is. Every terminal answers DA1, and answers in order, so once its reply is
+ * in we have heard everything we're going to. Anything else that arrives in
+ * the meantime is the user typing, and goes to the input ring as usual.
+ */
+void editorParseProbe(const char *buf, int len) {
+  int i = 0;
+
+  while (i < len) {
+    int params[4] = {0, 0, 0, 0}, n = 0, j = i + 3;
+
+    if (len - i < 3 || memcmp(&buf[i], "\x1b[?", 3) != 0) {
+      editorUnreadByte(buf[i++]);
+      continue;
+    }
+
+    for (; j < len && (isdigit((unsigned char)buf[j]) || buf[j] == ';'); j++) {
+      if (buf[j] == ';')
+        n++;
+      else if (n < 4)
+        params[n] = params[n] * 10 + (buf[j] - '0');
+    }
+
+    if (j + 1 < len && buf[j] == '$' && buf[j + 1] == 'y') {
+      /* "\x1b[?2026;Ps$y", 1 or 2 mean the mode exists */
+      if (params[0] == 2026 && (params[1] == 1 || params[1] == 2))
+        E.term.sync = 1;
+      i = j + 2;
+    } else if (j < len && buf[j] == 'c') {
+      /*
+       * "\x1b[?Pc;...c": a Pc of 1 or 6 is a VT100 or VT102, and 62 and up a
+       * VT220 or better. All of those have scroll regions; the other
+       * classes, the block-mode and graphics terminals, may not.
+       */
+      E.term.scroll = params[0] == 1 || params[0] == 6 || params[0] >= 62;
+      E.term.su = params[0] >= 62;
+      i = j + 1;
+    } else {
+      editorUnreadByte(buf[i++]);
+    }
+  }
+}
+
+/* whether buf holds a whole DA1 reply: "\x1b[?", digits and ';', then 'c' */
+int editorProbeDone(const char *buf, int len) {
+  const char *p = buf, *end = buf + len;
+
+  while ((p = memmem(p, end - p, "\x1b[?", 3)) != NULL) {
+    p += 3;
+    while (p < end && (isdigit((unsigned char)*p) || *p == ';'))
+      p++;
+    if (p < end && *p == 'c')
+      return 1;
+  }
+  return 0;
+}
+
+void editorProbeTerminal(void) {
+  char buf[256];
+  int len = 0;
+  long long deadline = editorNow() + KILO_PROBE_MS;
+
+  if (E.headless || !isatty(STDIN_FILENO))
+    return;
+
+  editorWrite("\x1b[?2026$p\x1b[c", 13);
+  while (len < (int)sizeof(buf)) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    int wait = (int)(deadline - editorNow()), nread;
+
+    if (wait <= 0 || poll(&pfd, 1, wait) <= 0)
+      break;
+    nread = read(STDIN_FILENO, buf + len, sizeof(buf) - len);
+    if (nread <= 0)
+      break;
+    len += nread;
+
+    if (editorProbeDone(buf, len))
+      break;
+  }
+  editorParseProbe(buf, len);
+}
+
 int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
 
+  /* without a terminal, pretend to be KILO_ROWS x KILO_COLS (24x80) */
+  if (E.headless) {
+    const char *r = getenv("KILO_ROWS"), *c = getenv("KILO_COLS");
+    *rows = r ? atoi(r) : 24;
+    *cols = c ? atoi(c) : 80;
+    return *rows > 0 && *cols > 0 ? 0 : -1;
+  }
+
   /*
    * On success, ioctl() will place the number of columns wide and the number of
    * rows high the terminal is into the given winsize struct.
@@ -189,55 +1432,9078 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** output ***/
-void editorDrawRows(void) {
-  int y;
-  for (y = 0; y < E.screenrows; y++) {
-    write(STDOUT_FILENO, "~\r\n", 3);
+/*** allocators ***/
+
+void *arenaAlloc(struct arena *a, size_t size) {
+  struct arenaBlock *b = a->block;
+  void *p;
+
+  /* keep everything we hand out aligned for any type */
+  size = (size + 15) & ~(size_t)15;
+
+  if (b == NULL || b->cap - b->used < size) {
+    size_t cap = KILO_ARENA_BLOCK;
+    while (cap < size)
+      cap *= 2;
+
+    b = malloc(sizeof(struct arenaBlock) + cap);
+    if (b == NULL)
+      die("malloc");
+    b->prev = a->block;
+    b->used = 0;
+    b->cap = cap;
+    a->block = b;
+    a->mallocs++;
   }
+
+  p = b->data + b->used;
+  b->used += size;
+  a->frame_bytes += size;
+  a->allocs++;
+  return p;
 }
 
-void editorRefreshScreen(void) {
-  write(STDOUT_FILENO, "\x1b[2j", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+void arenaReset(struct arena *a) {
+  struct arenaBlock *b = a->block;
 
-  editorDrawRows();
+  if (a->frame_bytes > a->high_water)
+    a->high_water = a->frame_bytes;
 
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  /* last frame didn't fit in one block: swap them all for one that will */
+  if (b && b->prev) {
+    size_t cap = KILO_ARENA_BLOCK;
+    while (cap < a->high_water)
+      cap *= 2;
+
+    while (b) {
+      struct arenaBlock *prev = b->prev;
+      free(b);
+      b = prev;
+    }
+    a->block = NULL;
+    arenaAlloc(a, cap);
+    b = a->block;
+    a->allocs--;
+  }
+
+  if (b)
+    b->used = 0;
+  a->frame_bytes = 0;
+  a->resets++;
 }
 
-/*** input ***/
-void editorProcessKeypress(void) {
-  char c = editorReadKey();
+void *poolAlloc(struct pool *p) {
+  struct poolFree *f;
 
-  switch (c) {
-  case CTRL_KEY('q'):
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
-    break;
+  if (p->free == NULL) {
+    char *slab = malloc(p->size * KILO_POOL_SLAB);
+    int i;
+
+    if (slab == NULL)
+      die("malloc");
+    for (i = KILO_POOL_SLAB - 1; i >= 0; i--) {
+      f = (struct poolFree *)(slab + i * p->size);
+      f->next = p->free;
+      p->free = f;
+    }
+    p->slabs++;
   }
+
+  f = p->free;
+  p->free = f->next;
+  p->live++;
+  p->allocs++;
+  return f;
 }
 
-/*** init ***/
-void initEditor(void) {
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-    die("getWindowSize");
+void poolFree(struct pool *p, void *obj) {
+  struct poolFree *f = obj;
+
+  f->next = p->free;
+  p->free = f;
+  p->live--;
 }
 
-int main(void) {
-  enableRawMode();
-  initEditor();
+/*** append buffer ***/
 
-  /**
-   * read method enable use to read one byte from standard input
-   * into a varibale c
-   * here we add when user press q, it will exit the program
-   */
-  while (1) {
-    editorRefreshScreen();
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 1024;
+    char *new;
 
-    editorProcessKeypress();
+    while (cap < ab->len + len)
+      cap *= 2;
+
+    if (ab->arena) {
+      new = arenaAlloc(ab->arena, cap);
+      if (ab->len)
+        memcpy(new, ab->b, ab->len);
+    } else {
+      new = realloc(ab->b, cap);
+      if (new == NULL)
+        die("realloc");
+    }
+    ab->b = new;
+    ab->cap = cap;
+  }
+
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab) {
+  if (ab->arena == NULL)
+    free(ab->b);
+}
+
+/*** newline scanner ***/
+
+/*
+ * Finding newlines is the first thing we pay for on every file we open, so it
+ * is done 16 or 32 bytes at a time with SIMD where the CPU has it. Each
+ * scanner compares a whole block against '\n', turns the result into a
+ * bitmask with one bit per byte, and pushes the offset of every set bit.
+ *
+ * We only look for '\n': a '\r' in front of it is stripped when the row is
+ * read (see editorRowChars()), so CRLF files need no extra pass.
+ *
+ * Search uses the same trick to find a string: compare one block against the
+ * first byte of the string and the block m - 1 bytes further on against the
+ * last byte, and only memcmp() where both match. Real text rarely gets past
+ * that filter, so this runs close to memchr() speed.
+ *
+ * And measuring a row (how wide it is, which column the cursor is in) wants
+ * to know where its first non-ASCII byte is, since everything before it is a
+ * byte per character and needs no UTF-8 decoding. Non-ASCII bytes all have
+ * the top bit set, which is exactly what movemask collects.
+ */
+static inline void editorIndexPush(struct lineIndex *idx, size_t off) {
+  if (idx->count == idx->cap) {
+    size_t *nl = idx->mapped ? NULL : idx->nl;
+
+    idx->cap = idx->cap ? idx->cap * 2 : 1024;
+    nl = realloc(nl, sizeof(size_t) * idx->cap);
+    if (nl == NULL)
+      die("realloc");
+    /* a mapped index is read-only, so it gets copied the first time it grows */
+    if (idx->mapped)
+      memcpy(nl, idx->nl, sizeof(size_t) * idx->count);
+    idx->nl = nl;
+    idx->mapped = 0;
+  }
+  idx->nl[idx->count++] = off;
+}
+
+/* p[0..len) lives at file offset base */
+void scanNewlinesPortable(struct lineIndex *idx, const char *p, size_t len,
+                          size_t base) {
+  const char *end = p + len;
+  const char *q = p;
+
+  /* libc's memchr() is already word-at-a-time on most systems */
+  while (q < end && (q = memchr(q, '\n', end - q)) != NULL) {
+    editorIndexPush(idx, base + (q - p));
+    q++;
+  }
+}
+
+/* the first q[0..m) in h[0..n), libc's memmem() is a two-way search */
+const char *findPortable(const char *h, size_t n, const char *q, size_t m) {
+  return memmem(h, n, q, m);
+}
+
+/* how many bytes at the start of p[0..len) are ASCII, 8 at a time */
+size_t asciiPortable(const char *p, size_t len) {
+  const uint64_t high = 0x8080808080808080ULL;
+  size_t i = 0;
+  uint64_t w;
+
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    if (w & high)
+      break;
+  }
+  while (i < len && !(p[i] & 0x80))
+    i++;
+  return i;
+}
+
+#ifdef KILO_X86
+void scanNewlinesSSE2(struct lineIndex *idx, const char *p, size_t len,
+                      size_t base) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+    while (mask) {
+      editorIndexPush(idx, base + i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  scanNewlinesPortable(idx, p + i, len - i, base + i);
+}
+
+const char *findSSE2(const char *h, size_t n, const char *q, size_t m) {
+  size_t i = 0;
+
+  if (m < 2 || n < m)
+    return findPortable(h, n, q, m);
+
+  const __m128i first = _mm_set1_epi8(q[0]);
+  const __m128i last = _mm_set1_epi8(q[m - 1]);
+
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+    while (mask) {
+      size_t j = i + __builtin_ctz(mask);
+      if (memcmp(h + j + 1, q + 1, m - 2) == 0)
+        return h + j;
+      mask &= mask - 1;
+    }
+  }
+  return findPortable(h + i, n - i, q, m);
+}
+
+size_t asciiSSE2(const char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    unsigned mask =
+        _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + asciiPortable(p + i, len - i);
+}
+
+__attribute__((target("avx2"))) void
+scanNewlinesAVX2(struct lineIndex *idx, const char *p, size_t len,
+                 size_t base) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+    while (mask) {
+      editorIndexPush(idx, base + i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  scanNewlinesPortable(idx, p + i, len - i, base + i);
+}
+
+__attribute__((target("avx2"))) const char *
+findAVX2(const char *h, size_t n, const char *q, size_t m) {
+  size_t i = 0;
+
+  if (m < 2 || n < m)
+    return findPortable(h, n, q, m);
+
+  const __m256i first = _mm256_set1_epi8(q[0]);
+  const __m256i last = _mm256_set1_epi8(q[m - 1]);
+
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + m - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+    while (mask) {
+      size_t j = i + __builtin_ctz(mask);
+      if (memcmp(h + j + 1, q + 1, m - 2) == 0)
+        return h + j;
+      mask &= mask - 1;
+    }
+  }
+  return findPortable(h + i, n - i, q, m);
+}
+
+__attribute__((target("avx2"))) size_t asciiAVX2(const char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+        _mm256_loadu_si256((const __m256i *)(p + i)));
+
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + asciiSSE2(p + i, len - i);
+}
+#endif
+
+#ifdef KILO_NEON
+void scanNewlinesNEON(struct lineIndex *idx, const char *p, size_t len,
+                      size_t base) {
+  const uint8x16_t nl = vdupq_n_u8('\n');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)(p + i)), nl);
+
+    /*
+     * NEON has no movemask, so narrow every matching 0xff byte to a 4 bit
+     * nibble instead: byte j of the block becomes bits 4j..4j+3 of mask
+     */
+    uint64_t mask = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+    while (mask) {
+      int bit = __builtin_ctzll(mask);
+      editorIndexPush(idx, base + i + (bit >> 2));
+      mask &= ~(0xfULL << (bit & ~3));
+    }
+  }
+  scanNewlinesPortable(idx, p + i, len - i, base + i);
+}
+
+const char *findNEON(const char *h, size_t n, const char *q, size_t m) {
+  size_t i = 0;
+
+  if (m < 2 || n < m)
+    return findPortable(h, n, q, m);
+
+  const uint8x16_t first = vdupq_n_u8(q[0]);
+  const uint8x16_t last = vdupq_n_u8(q[m - 1]);
+
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    uint8x16_t a = vceqq_u8(vld1q_u8((const uint8_t *)(h + i)), first);
+    uint8x16_t b = vceqq_u8(vld1q_u8((const uint8_t *)(h + i + m - 1)), last);
+    uint64_t mask = vget_lane_u64(
+        vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(a, b)), 4)),
+        0);
+
+    while (mask) {
+      int bit = __builtin_ctzll(mask);
+      size_t j = i + (bit >> 2);
+      if (memcmp(h + j + 1, q + 1, m - 2) == 0)
+        return h + j;
+      mask &= ~(0xfULL << (bit & ~3));
+    }
+  }
+  return findPortable(h + i, n - i, q, m);
+}
+
+size_t asciiNEON(const char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(p + i));
+
+    /* the largest byte only has its top bit set if some byte does */
+    if (vmaxvq_u8(v) & 0x80)
+      break;
+  }
+  return i + asciiPortable(p + i, len - i);
+}
+#endif
+
+struct newlineScanner {
+  const char *name;
+  void (*scan)(struct lineIndex *idx, const char *p, size_t len, size_t base);
+  const char *(*find)(const char *h, size_t n, const char *q, size_t m);
+  size_t (*ascii)(const char *p, size_t len);
+};
+
+/* fastest first; editorInitScanner() picks the first one the CPU can run */
+struct newlineScanner scanners[] = {
+#ifdef KILO_X86
+    {"avx2", scanNewlinesAVX2, findAVX2, asciiAVX2},
+    {"sse2", scanNewlinesSSE2, findSSE2, asciiSSE2},
+#endif
+#ifdef KILO_NEON
+    {"neon", scanNewlinesNEON, findNEON, asciiNEON},
+#endif
+    {"portable", scanNewlinesPortable, findPortable, asciiPortable},
+};
+
+#define KILO_NSCANNERS ((int)(sizeof(scanners) / sizeof(scanners[0])))
+
+int editorScannerSupported(struct newlineScanner *sc) {
+#ifdef KILO_X86
+  if (sc->scan == scanNewlinesAVX2)
+    return __builtin_cpu_supports("avx2");
+#ifdef __i386__
+  if (sc->scan == scanNewlinesSSE2)
+    return __builtin_cpu_supports("sse2");
+#endif
+#endif
+  (void)sc;
+  return 1;
+}
+
+struct newlineScanner *scanner = &scanners[KILO_NSCANNERS - 1];
+
+/* KILO_SCANNER=<name> forces a specific scanner, handy for comparisons */
+void editorInitScanner(void) {
+  const char *want = getenv("KILO_SCANNER");
+  int i;
+
+  for (i = 0; i < KILO_NSCANNERS; i++) {
+    if (!editorScannerSupported(&scanners[i]))
+      continue;
+    if (want == NULL || strcmp(want, scanners[i].name) == 0) {
+      scanner = &scanners[i];
+      return;
+    }
+  }
+}
+
+/*** line index ***/
+
+/*
+ * Rows are never copied out of the file. All we keep is the array of newline
+ * offsets, which we grow lazily with editorIndexRows().
+ */
+void editorIndexChunk(void) {
+  struct lineIndex *idx = &E.idx;
+  size_t end = idx->scanned + KILO_INDEX_CHUNK;
+
+  if (end > E.mapsize)
+    end = E.mapsize;
+
+  scanner->scan(idx, E.map + idx->scanned, end - idx->scanned, idx->scanned);
+  idx->scanned = end;
+  ptRefreshTail();
+
+  if (idx->scanned == E.mapsize)
+    editorSaveSidecar();
+}
+
+int editorIndexComplete(void) { return E.idx.scanned == E.mapsize; }
+
+/* the first entry in idx that is at or after off */
+size_t idxLowerBound(struct lineIndex *idx, size_t off) {
+  size_t lo = 0, hi = idx->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->nl[mid] < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*** piece table ***/
+
+struct lineIndex *pieceIndex(const struct piece *p) {
+  return p->buf == PIECE_ORIG ? &E.idx : &E.add.idx;
+}
+
+/*
+ * count the newlines in a span using the index of its buffer. For the
+ * original file that's only as far as we have indexed, which is why the last
+ * piece gets refreshed as the index grows (see ptRefreshTail()).
+ */
+size_t pieceCountLF(int buf, size_t off, size_t len) {
+  struct piece p = {buf, off, len, 0};
+  struct lineIndex *idx = pieceIndex(&p);
+  size_t end = off + len;
+
+  if (end > idx->scanned)
+    end = idx->scanned;
+  if (end <= off)
+    return 0;
+  return idxLowerBound(idx, end) - idxLowerBound(idx, off);
+}
+
+/* the add buffer chunk holding offset off */
+int addChunkAt(size_t off) {
+  int lo = 0, hi = E.add.numchunks - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (E.add.chunks[mid].base <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+const char *pieceText(const struct piece *p) {
+  struct addChunk *c;
+
+  if (p->buf == PIECE_ORIG)
+    return E.map + p->off;
+
+  /* pieces never straddle two chunks */
+  c = &E.add.chunks[addChunkAt(p->off)];
+  return c->data + (p->off - c->base);
+}
+
+/* copy s into the add buffer, returning its offset there */
+size_t addAppend(const char *s, size_t len) {
+  struct addBuffer *add = &E.add;
+  struct addChunk *c = add->numchunks ? &add->chunks[add->numchunks - 1] : NULL;
+  size_t off;
+
+  if (c == NULL || c->cap - c->len < len) {
+    size_t base = c ? c->base + c->cap : 0;
+
+    add->chunks =
+        realloc(add->chunks, sizeof(struct addChunk) * (add->numchunks + 1));
+    if (add->chunks == NULL)
+      die("realloc");
+    c = &add->chunks[add->numchunks++];
+    c->base = base;
+    c->len = 0;
+    c->cap = len > KILO_ADD_CHUNK ? len : KILO_ADD_CHUNK;
+    c->dead = 0;
+    /* mapped rather than malloc()ed, so editorAddReclaim() can drop it */
+    c->data = mmap(NULL, c->cap, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c->data == MAP_FAILED)
+      die("mmap");
+  }
+
+  off = c->base + c->len;
+  memcpy(c->data + c->len, s, len);
+  c->len += len;
+
+  scanner->scan(&add->idx, c->data + (off - c->base), len, off);
+  add->idx.scanned = off + len;
+  return off;
+}
+
+unsigned ptRand(void) {
+  static unsigned x = 2463534242u;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+size_t ptLen(struct pieceNode *t) { return t ? t->len : 0; }
+size_t ptLF(struct pieceNode *t) { return t ? t->lf : 0; }
+
+void ptUpdate(struct pieceNode *t) {
+  t->len = ptLen(t->left) + t->p.len + ptLen(t->right);
+  t->lf = ptLF(t->left) + t->p.lf + ptLF(t->right);
+}
+
+struct pieceNode *ptNewNode(int buf, size_t off, size_t len) {
+  struct pieceNode *t = poolAlloc(&E.nodes);
+
+  t->p.buf = buf;
+  t->p.off = off;
+  t->p.len = len;
+  t->p.lf = pieceCountLF(buf, off, len);
+  t->left = t->right = NULL;
+  t->prio = ptRand();
+  ptUpdate(t);
+  return t;
+}
+
+void ptFree(struct pieceNode *t) {
+  if (t == NULL)
+    return;
+  ptFree(t->left);
+  ptFree(t->right);
+  poolFree(&E.nodes, t);
+}
+
+struct pieceNode *ptMerge(struct pieceNode *a, struct pieceNode *b) {
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (a->prio > b->prio) {
+    a->right = ptMerge(a->right, b);
+    ptUpdate(a);
+    return a;
+  }
+  b->left = ptMerge(a, b->left);
+  ptUpdate(b);
+  return b;
+}
+
+/* split t into the first pos bytes and the rest, cutting a piece if needed */
+void ptSplit(struct pieceNode *t, size_t pos, struct pieceNode **l,
+             struct pieceNode **r) {
+  size_t ll;
+
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+
+  ll = ptLen(t->left);
+  if (pos <= ll) {
+    ptSplit(t->left, pos, l, &t->left);
+    ptUpdate(t);
+    *r = t;
+  } else if (pos >= ll + t->p.len) {
+    ptSplit(t->right, pos - ll - t->p.len, &t->right, r);
+    ptUpdate(t);
+    *l = t;
+  } else {
+    size_t k = pos - ll;
+    struct pieceNode *tail =
+        ptNewNode(t->p.buf, t->p.off + k, t->p.len - k);
+
+    *r = ptMerge(tail, t->right);
+    t->right = NULL;
+    t->p.len = k;
+    t->p.lf = pieceCountLF(t->p.buf, t->p.off, k);
+    ptUpdate(t);
+    *l = t;
+  }
+}
+
+/*
+ * The original file is indexed lazily, so the newline count of a piece of it
+ * may still be growing. Edits only ever happen in the indexed part, which
+ * means only the piece running to the end of the file can be affected, and
+ * nothing can be inserted after a position we haven't indexed yet, so that
+ * piece is always the rightmost one.
+ */
+void ptRefreshNode(struct pieceNode *t) {
+  if (t->right) {
+    ptRefreshNode(t->right);
+  } else if (t->p.buf == PIECE_ORIG && t->p.off + t->p.len == E.mapsize) {
+    t->p.lf = pieceCountLF(t->p.buf, t->p.off, t->p.len);
+  }
+  ptUpdate(t);
+}
+
+void ptRefreshTail(void) {
+  if (E.pt)
+    ptRefreshNode(E.pt);
+}
+
+size_t ptSize(void) { return ptLen(E.pt); }
+
+/* the piece holding byte pos, and where pos lands inside it */
+struct piece *ptFind(size_t pos, size_t *within) {
+  struct pieceNode *t = E.pt;
+
+  while (t) {
+    size_t ll = ptLen(t->left);
+    if (pos < ll) {
+      t = t->left;
+    } else if (pos < ll + t->p.len) {
+      *within = pos - ll;
+      return &t->p;
+    } else {
+      pos -= ll + t->p.len;
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+int ptByte(size_t pos) {
+  size_t within;
+  struct piece *p = ptFind(pos, &within);
+
+  return p ? (unsigned char)pieceText(p)[within] : -1;
+}
+
+/* the document offset of newline number k (counting from 0) */
+size_t ptNewlineOffset(size_t k) {
+  struct pieceNode *t = E.pt;
+  size_t base = 0;
+
+  while (t) {
+    size_t ll = ptLF(t->left);
+    if (k < ll) {
+      t = t->left;
+      continue;
+    }
+    k -= ll;
+    base += ptLen(t->left);
+
+    if (k < t->p.lf) {
+      struct lineIndex *idx = pieceIndex(&t->p);
+      size_t i = idxLowerBound(idx, t->p.off) + k;
+      return base + (idx->nl[i] - t->p.off);
+    }
+    k -= t->p.lf;
+    base += t->p.len;
+    t = t->right;
+  }
+  return ptSize();
+}
+
+/* append the bytes [start, end) of the document to ab */
+void ptCopyNode(struct pieceNode *t, size_t base, size_t start, size_t end,
+                struct abuf *ab) {
+  size_t ll, from, to;
+
+  if (t == NULL || end <= base || start >= base + t->len)
+    return;
+
+  ll = ptLen(t->left);
+  ptCopyNode(t->left, base, start, end, ab);
+
+  from = base + ll;
+  to = from + t->p.len;
+  if (start > from)
+    from = start;
+  if (end < to)
+    to = end;
+  if (from < to)
+    abAppend(ab, pieceText(&t->p) + (from - base - ll), to - from);
+
+  ptCopyNode(t->right, base + ll + t->p.len, start, end, ab);
+}
+
+/* the row byte pos is on: how many newlines come before it */
+size_t ptRowAt(size_t pos) {
+  struct pieceNode *t = E.pt;
+  size_t row = 0;
+
+  while (t) {
+    size_t ll = ptLen(t->left);
+    if (pos < ll) {
+      t = t->left;
+    } else if (pos < ll + t->p.len) {
+      return row + ptLF(t->left) +
+             pieceCountLF(t->p.buf, t->p.off, pos - ll);
+    } else {
+      row += ptLF(t->left) + t->p.lf;
+      pos -= ll + t->p.len;
+      t = t->right;
+    }
+  }
+  return row;
+}
+
+/*
+ * Every change to the text goes through ptInsertPieces() and ptCut(), which
+ * tell the caches keyed by row number what happened with editorRowsChanged()
+ * and log the change in the crash journal. The editor calls them through
+ * ptInsert() and ptDelete(), which also keep the undo history; undo itself
+ * calls them directly.
+ */
+/*
+ * make the piece ending at pos longer by p, if p's text comes right after its
+ * own in the same buffer. That's what typing does, and it keeps a row typed
+ * into (at one cursor or at thousands) from turning into a node per key.
+ */
+int ptExtendAt(struct pieceNode *t, size_t pos, const struct piece *p) {
+  size_t ll;
+  int ok = 0;
+
+  if (t == NULL)
+    return 0;
+  ll = ptLen(t->left);
+  if (pos <= ll) {
+    ok = ptExtendAt(t->left, pos, p);
+  } else if (pos > ll + t->p.len) {
+    ok = ptExtendAt(t->right, pos - ll - t->p.len, p);
+  } else if (pos == ll + t->p.len && t->p.buf == p->buf &&
+             t->p.off + t->p.len == p->off) {
+    t->p.len += p->len;
+    t->p.lf += p->lf;
+    ok = 1;
+  }
+  if (ok)
+    ptUpdate(t);
+  return ok;
+}
+
+/*
+ * a treap of the pieces p, in order, in one pass rather than n merges: the
+ * nodes down its right edge wait on a stack, and each new node takes the ones
+ * with a lower priority off it as its left subtree. Replacing every hit in a
+ * file can mean millions of pieces.
+ */
+struct pieceNode *ptBuild(const struct piece *p, size_t n) {
+  struct pieceNode *small[64], **stack = small, *t, *last;
+  size_t top = 0, i;
+
+  if (n > 64 && (stack = malloc(sizeof(*stack) * n)) == NULL)
+    die("malloc");
+  for (i = 0; i < n; i++) {
+    t = poolAlloc(&E.nodes);
+    t->p = p[i];
+    t->prio = ptRand();
+    t->right = NULL;
+
+    last = NULL;
+    while (top > 0 && stack[top - 1]->prio < t->prio) {
+      last = stack[--top];
+      ptUpdate(last);
+    }
+    t->left = last;
+    if (top > 0)
+      stack[top - 1]->right = t;
+    stack[top++] = t;
+  }
+  while (top > 1)
+    ptUpdate(stack[--top]);
+  t = NULL;
+  if (top) {
+    t = stack[0];
+    ptUpdate(t);
+  }
+  if (stack != small)
+    free(stack);
+  return t;
+}
+
+void ptInsertPieces(size_t pos, const struct piece *p, size_t n) {
+  struct pieceNode *l, *r, *m;
+  size_t i, lf = 0;
+
+  if (n == 0)
+    return;
+  for (i = 0; i < n; i++)
+    lf += p[i].lf;
+  E.version++;
+  editorRowsChanged(ptRowAt(pos), 0, lf);
+  editorJournalInsert(pos, p, n);
+  if (n == 1 && ptExtendAt(E.pt, pos, p))
+    return;
+
+  m = ptBuild(p, n);
+  ptSplit(E.pt, pos, &l, &r);
+  E.pt = ptMerge(ptMerge(l, m), r);
+}
+
+/* take bytes [pos, pos + len) out of the document, and hand back their nodes */
+struct pieceNode *ptCut(size_t pos, size_t len) {
+  struct pieceNode *l, *m, *r;
+
+  ptSplit(E.pt, pos, &l, &m);
+  ptSplit(m, len, &m, &r);
+  E.version++;
+  editorRowsChanged(ptLF(l), ptLF(m), 0);
+  editorJournalDelete(pos, len);
+  E.pt = ptMerge(l, r);
+  return m;
+}
+
+void ptInsert(size_t pos, const char *s, size_t len) {
+  struct piece p = {PIECE_ADD, 0, len, 0};
+
+  if (len == 0)
+    return;
+
+  p.off = addAppend(s, len);
+  p.lf = pieceCountLF(PIECE_ADD, p.off, len);
+  editorUndoInsert(pos, &p);
+  ptInsertPieces(pos, &p, 1);
+}
+
+/* grow the last piece by len bytes if it ends where the file used to */
+int ptExtendNode(struct pieceNode *t, size_t old, size_t len) {
+  int ok = 0;
+
+  if (t->right) {
+    ok = ptExtendNode(t->right, old, len);
+  } else if (t->p.buf == PIECE_ORIG && t->p.off + t->p.len == old) {
+    t->p.len += len;
+    t->p.lf = pieceCountLF(t->p.buf, t->p.off, t->p.len);
+    ok = 1;
+  }
+  ptUpdate(t);
+  return ok;
+}
+
+/*
+ * The file grew from old bytes by len more (see the follow section), and
+ * E.mapsize already says so: add them to the end of the document. Usually
+ * that just makes the last piece longer, which also keeps it the one piece
+ * that can run past the indexed part of the file.
+ */
+void ptAppendOrig(size_t old, size_t len) {
+  if (len == 0)
+    return;
+
+  E.version++;
+  editorRowsChanged(ptLF(E.pt), 0, pieceCountLF(PIECE_ORIG, old, len));
+  if (E.pt == NULL || !ptExtendNode(E.pt, old, len))
+    E.pt = ptMerge(E.pt, ptNewNode(PIECE_ORIG, old, len));
+}
+
+void ptDelete(size_t pos, size_t len) {
+  struct pieceNode *m;
+
+  if (len == 0)
+    return;
+
+  m = ptCut(pos, len);
+  editorUndoDelete(pos, len, m);
+  ptFree(m);
+}
+
+/*
+ * the same text at each of the n positions in pos, which are in order and
+ * say where they are now. It goes into the add buffer once, and everything
+ * else sees n inserts made from the back, which leaves the positions in
+ * front of each one as they were.
+ */
+void ptInsertAt(const size_t *pos, size_t n, const char *s, size_t len) {
+  struct piece p = {PIECE_ADD, 0, len, 0};
+  size_t i;
+
+  if (len == 0 || n == 0)
+    return;
+  p.off = addAppend(s, len);
+  p.lf = pieceCountLF(PIECE_ADD, p.off, len);
+
+  editorBeginBatch();
+  editorUndoInsertAt(pos, n, &p);
+  for (i = n; i-- > 0;)
+    ptInsertPieces(pos[i], &p, 1);
+  editorEndBatch();
+}
+
+/*
+ * and take out [pos[i], pos[i] + len[i]) for each i. These go from the front,
+ * so the history gets what was cut in order; each position is then short by
+ * what the ones before it took out.
+ */
+void ptDeleteAt(const size_t *pos, const size_t *len, size_t n) {
+  size_t i, gone = 0;
+
+  editorBeginBatch();
+  for (i = 0; i < n; gone += len[i++]) {
+    struct pieceNode *m = ptCut(pos[i] - gone, len[i]);
+
+    editorUndoDeleteAt(pos, len, n, i, m);
+    ptFree(m);
+  }
+  editorEndBatch();
+}
+
+/*** viewer ***/
+
+/*
+ * kilo -v FILE views a file without mapping it, in memory that stays the same
+ * however big the file is. Instead of the offset of every newline the index
+ * only has a checkpoint every KILO_VIEW_EVERY rows, and the file is read with
+ * pread() into an LRU cache of KILO_VIEW_PAGES pages. A thread builds the
+ * checkpoints reading the file front to back, and throws each block away as
+ * soon as it has counted the newlines in it.
+ *
+ * To find a row we go to the checkpoint before it and count newlines from
+ * there, which is never more than KILO_VIEW_EVERY rows of reading. Since the
+ * rows drawn right after are nearly always in the same stretch, the row starts
+ * found on the way are kept, for the last few stretches asked about.
+ *
+ * The row functions ask the viewer instead of the piece table when it's on,
+ * which is all the editor needs; the view is read-only, so everything that
+ * changes the document (or searches it) is turned off.
+ */
+void *viewIndexer(void *arg) {
+  struct viewer *v = arg;
+  char *buf = malloc(KILO_VIEW_SCAN);
+  size_t off = 0, lf = 0, n = 1, poked = 0;
+  int last = '\n';
+
+  if (buf == NULL) {
+    v->error = ENOMEM;
+    goto done;
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(v->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  while (off < v->size) {
+    size_t want = v->size - off < KILO_VIEW_SCAN ? v->size - off
+                                                 : KILO_VIEW_SCAN;
+    ssize_t got = pread(v->fd, buf, want, off);
+    const char *p, *end;
+
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      v->error = got == 0 ? EIO : errno;
+      break;
+    }
+    if (__atomic_load_n(&v->cancel, __ATOMIC_RELAXED))
+      break;
+
+    for (p = buf, end = buf + got; (p = memchr(p, '\n', end - p)); p++) {
+      if (++lf % KILO_VIEW_EVERY == 0 && n < v->cap) {
+        v->ckpt[n] = off + (p - buf) + 1;
+        __atomic_store_n(&v->nckpt, ++n, __ATOMIC_RELEASE);
+      }
+    }
+    last = (unsigned char)buf[got - 1];
+    off += got;
+    __atomic_store_n(&v->lines, lf, __ATOMIC_RELEASE);
+    __atomic_store_n(&v->scanned, off, __ATOMIC_RELEASE);
+
+    /* let the status bar catch up every now and then */
+    if (off - poked >= KILO_VIEW_POKE) {
+      poked = off;
+      write(E.wakepipe[1], "v", 1);
+    }
+  }
+
+  /* a last line without a trailing newline is still a row */
+  v->rows = lf + (off > 0 && last != '\n');
+done:
+  free(buf);
+  __atomic_store_n(&v->done, 1, __ATOMIC_RELEASE);
+  write(E.wakepipe[1], "v", 1);
+  return NULL;
+}
+
+/* the page of the file holding off, read in if it isn't cached */
+const char *viewPage(size_t off, size_t *avail) {
+  struct viewer *v = &E.view;
+  size_t page = off / KILO_VIEW_PAGE, i, slot = 0;
+  ssize_t got;
+
+  for (i = 0; i < KILO_VIEW_PAGES; i++) {
+    if (v->page[i] == page && v->pagelen[i] > off % KILO_VIEW_PAGE)
+      break;
+    if (v->used[i] < v->used[slot])
+      slot = i;
+  }
+
+  if (i == KILO_VIEW_PAGES) {
+    i = slot;
+    do {
+      got = pread(v->fd, v->pages + i * KILO_VIEW_PAGE, KILO_VIEW_PAGE,
+                  page * KILO_VIEW_PAGE);
+    } while (got == -1 && errno == EINTR);
+    v->page[i] = page;
+    v->pagelen[i] = got > 0 ? got : 0;
+    if (v->pagelen[i] <= off % KILO_VIEW_PAGE) {
+      /* the file shrank under us: that's as far as it goes */
+      v->used[i] = 0;
+      *avail = 0;
+      return NULL;
+    }
+  }
+
+  v->used[i] = ++v->tick;
+  *avail = v->pagelen[i] - off % KILO_VIEW_PAGE;
+  return v->pages + i * KILO_VIEW_PAGE + off % KILO_VIEW_PAGE;
+}
+
+/*
+ * The rows of the file that have been indexed, a lower bound until done. This
+ * is asked several times a frame, so it goes by the indexer's own count and
+ * never reads the file: every row up to the last newline counted can be found,
+ * as long as it's no further than a stretch past the last checkpoint.
+ */
+size_t viewIndexedRows(void) {
+  struct viewer *v = &E.view;
+  size_t n = __atomic_load_n(&v->nckpt, __ATOMIC_ACQUIRE);
+  size_t lines = __atomic_load_n(&v->lines, __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&v->done, __ATOMIC_ACQUIRE))
+    return v->rows;
+  return lines < n * KILO_VIEW_EVERY ? lines : n * KILO_VIEW_EVERY;
+}
+
+/*
+ * The row starts of stretch k, rows k * KILO_VIEW_EVERY and on. Only the last
+ * stretch can still grow while the indexer runs, and it gets counted again
+ * when it has.
+ */
+struct viewBlock *viewBlockFor(size_t k) {
+  struct viewer *v = &E.view;
+  struct viewBlock *b = NULL;
+  size_t nckpt = __atomic_load_n(&v->nckpt, __ATOMIC_ACQUIRE);
+  size_t limit, off, i;
+  int done = __atomic_load_n(&v->done, __ATOMIC_ACQUIRE);
+
+  limit = k + 1 < nckpt ? v->ckpt[k + 1]
+          : done        ? v->size
+                        : __atomic_load_n(&v->scanned, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < KILO_VIEW_BLOCKS; i++) {
+    if (v->blocks[i].k == k && v->blocks[i].off) {
+      b = &v->blocks[i];
+      break;
+    }
+    if (b == NULL || v->blocks[i].used < b->used)
+      b = &v->blocks[i];
+  }
+  b->used = ++v->tick;
+  if (b->k == k && b->off && b->limit == limit)
+    return b;
+
+  b->k = k;
+  b->limit = limit;
+  b->n = 0;
+  if (b->off == NULL) {
+    b->off = malloc(sizeof(size_t) * (KILO_VIEW_EVERY + 1));
+    if (b->off == NULL)
+      die("malloc");
+  }
+  b->off[0] = off = v->ckpt[k];
+  while (off < limit && b->n < KILO_VIEW_EVERY) {
+    size_t avail;
+    const char *p = viewPage(off, &avail), *nl;
+
+    if (p == NULL)
+      break;
+    if (avail > limit - off)
+      avail = limit - off;
+    nl = memchr(p, '\n', avail);
+    if (nl == NULL) {
+      off += avail;
+      continue;
+    }
+    off += nl - p + 1;
+    b->off[++b->n] = off;
+  }
+  return b;
+}
+
+size_t editorViewNumRows(void) { return viewIndexedRows(); }
+
+/* where row at starts, or the end of the file */
+size_t editorViewRowOffset(size_t at) {
+  struct viewBlock *b;
+
+  if (at >= viewIndexedRows())
+    return E.view.size;
+  b = viewBlockFor(at / KILO_VIEW_EVERY);
+  return b->off[at % KILO_VIEW_EVERY];
+}
+
+/* the bytes of row at, in E.view.row and so only good until the next call */
+const char *editorViewRowChars(size_t at, size_t *len) {
+  struct viewer *v = &E.view;
+  struct viewBlock *b;
+  size_t i, start, end;
+
+  *len = 0;
+  if (at >= viewIndexedRows())
+    return "";
+  b = viewBlockFor(at / KILO_VIEW_EVERY);
+  i = at % KILO_VIEW_EVERY;
+  start = b->off[i];
+  end = i < b->n ? b->off[i + 1] - 1 : v->size;
+
+  /* a row longer than that is shown cut short, to keep to the budget */
+  if (end - start > KILO_VIEW_ROW_MAX)
+    end = start + KILO_VIEW_ROW_MAX;
+
+  v->row.len = 0;
+  while (start < end) {
+    size_t avail;
+    const char *p = viewPage(start, &avail);
+
+    if (p == NULL)
+      break;
+    if (avail > end - start)
+      avail = end - start;
+    abAppend(&v->row, p, avail);
+    start += avail;
+  }
+
+  *len = v->row.len;
+  if (*len > 0 && v->row.b[*len - 1] == '\r')
+    (*len)--;
+  return *len ? v->row.b : "";
+}
+
+int editorViewComplete(void) {
+  return __atomic_load_n(&E.view.done, __ATOMIC_ACQUIRE);
+}
+
+int editorViewPercent(void) {
+  size_t scanned = __atomic_load_n(&E.view.scanned, __ATOMIC_ACQUIRE);
+
+  return E.view.size ? (int)(scanned * 100 / E.view.size) : 100;
+}
+
+/* the row byte off is in, if the index got that far; -1 if it didn't */
+long long editorViewRowAt(size_t off) {
+  struct viewer *v = &E.view;
+  size_t n = __atomic_load_n(&v->nckpt, __ATOMIC_ACQUIRE);
+  size_t lo = 0, hi = n, rows = viewIndexedRows();
+  struct viewBlock *b;
+
+  if (!editorViewComplete() &&
+      off >= __atomic_load_n(&v->scanned, __ATOMIC_ACQUIRE))
+    return -1;
+
+  /* the last checkpoint at or before off, then the row in its stretch */
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (v->ckpt[mid] <= off)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  b = viewBlockFor(lo);
+  for (hi = 0; hi < b->n && b->off[hi + 1] <= off; hi++)
+    ;
+  if (lo * KILO_VIEW_EVERY + hi >= rows)
+    return rows ? rows - 1 : 0;
+  return lo * KILO_VIEW_EVERY + hi;
+}
+
+/* kilo -v FILE */
+void editorOpenView(char *filename) {
+  struct viewer *v = &E.view;
+  struct stat st;
+  void *ckpt;
+  size_t i;
+
+  free(E.filename);
+  E.filename = strdup(filename);
+  if ((v->fd = open(filename, O_RDONLY)) == -1)
+    die(filename);
+  if (fstat(v->fd, &st) == -1)
+    die("fstat");
+  v->size = st.st_size;
+
+  /* at most one per KILO_VIEW_EVERY bytes, and untouched pages cost nothing */
+  v->cap = v->size / KILO_VIEW_EVERY + 2;
+  ckpt = mmap(NULL, v->cap * sizeof(size_t), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  v->pages = malloc((size_t)KILO_VIEW_PAGES * KILO_VIEW_PAGE);
+  if (ckpt == MAP_FAILED || v->pages == NULL)
+    die("view");
+  v->ckpt = ckpt;
+  v->ckpt[0] = 0;
+  v->nckpt = 1;
+  for (i = 0; i < KILO_VIEW_PAGES; i++)
+    v->page[i] = (size_t)-1;
+
+  if (pthread_create(&v->thread, NULL, viewIndexer, v) != 0)
+    die("pthread_create");
+  v->enabled = 1;
+  editorSetStatusMessage("Read only | ^G = go to line or N%% | ^Q = quit");
+}
+
+/* the indexer has news */
+void editorCheckView(void) {
+  struct viewer *v = &E.view;
+
+  if (!v->enabled || v->joined)
+    return;
+  E.redraw = 1;
+  if (!editorViewComplete())
+    return;
+  pthread_join(v->thread, NULL);
+  v->joined = 1;
+  if (v->error)
+    editorSetStatusMessage("Can't read %s: %s", E.filename,
+                           strerror(v->error));
+}
+
+/* keys that would change the document, or need it in memory */
+int editorViewRefuses(int c) {
+  switch (c) {
+  case '\r':
+  case CTRL_KEY('s'):
+  case CTRL_KEY('f'):
+  case CTRL_KEY('r'):
+  case CTRL_KEY('b'):
+  case CTRL_KEY('z'):
+  case CTRL_KEY('y'):
+  case PASTE_START:
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    break;
+  default:
+    if (c > 0x10ffff || (c != '\t' && c < 0x80 && iscntrl(c)))
+      return 0;
+  }
+  editorSetStatusMessage("Read only");
+  return 1;
+}
+
+/*** row operations ***/
+
+/*
+ * The rest of the editor only sees rows through the functions below. Row i
+ * starts right after newline i - 1 (row 0 starts at offset 0) and ends at
+ * newline i, both of which the piece table can find in O(log n). In kilo -v
+ * the viewer answers instead.
+ */
+
+/* make sure rows 0..want are indexed, or the whole file if it's shorter */
+void editorIndexRows(size_t want) {
+  if (E.view.enabled)
+    return;
+  while (ptLF(E.pt) <= want && !editorIndexComplete())
+    editorIndexChunk();
+}
+
+/*
+ * the number of rows we know about. That's all of them once the whole file
+ * has been indexed, a lower bound before that.
+ */
+size_t editorNumRows(void) {
+  size_t n;
+
+  if (E.view.enabled)
+    return editorViewNumRows();
+  n = ptLF(E.pt);
+
+  /* a last line without a trailing newline is still a row */
+  if (editorIndexComplete() && ptSize() > 0 && ptByte(ptSize() - 1) != '\n')
+    n++;
+  return n;
+}
+
+int editorRowExists(size_t at) {
+  editorIndexRows(at);
+  return at < editorNumRows();
+}
+
+/*
+ * the cursor may also sit on the empty row just past the end of the file,
+ * which is how new rows get added at the end
+ */
+int editorCursorRowOk(size_t at) {
+  return editorRowExists(at) || at == editorNumRows();
+}
+
+/* document offset where row at starts (or the end of the document) */
+size_t editorRowOffset(size_t at) {
+  if (E.view.enabled)
+    return editorViewRowOffset(at);
+  if (at == 0)
+    return 0;
+  editorIndexRows(at - 1);
+  if (at - 1 < ptLF(E.pt))
+    return ptNewlineOffset(at - 1) + 1;
+  return ptSize();
+}
+
+/*
+ * the bytes of row at, without the newline. When the row sits inside a single
+ * piece this points straight into the file or the add buffer; otherwise the
+ * row gets copied into E.rowbuf, so the result is only good until the next
+ * call.
+ */
+const char *editorRowChars(size_t at, size_t *len) {
+  size_t start, end, within;
+  struct piece *p;
+
+  if (E.view.enabled)
+    return editorViewRowChars(at, len);
+  if (!editorRowExists(at)) {
+    *len = 0;
+    return "";
+  }
+
+  start = editorRowOffset(at);
+  end = at < ptLF(E.pt) ? ptNewlineOffset(at) : ptSize();
+
+  /* show CRLF files without a stray '\r' on every line */
+  if (end > start && ptByte(end - 1) == '\r')
+    end--;
+
+  *len = end - start;
+  if (*len == 0)
+    return "";
+
+  p = ptFind(start, &within);
+  if (within + *len <= p->len)
+    return pieceText(p) + within;
+
+  E.rowbuf.len = 0;
+  ptCopyNode(E.pt, 0, start, end, &E.rowbuf);
+  return E.rowbuf.b;
+}
+
+/*** utf-8 ***/
+
+/*
+ * Rows are stored as whatever bytes the file has, and shown as UTF-8. Most of
+ * what anyone edits is ASCII though, where a byte is a character is a column,
+ * so nothing gets decoded before the first byte with its top bit set. When
+ * measuring a row the scanner finds that byte 16 or 32 at a time (see the
+ * newline scanner section); drawing looks at every byte anyway, and checks
+ * as it goes.
+ *
+ * What's past that point gets cut into glyphs: a character together with the
+ * combining marks, variation selectors and zero width joiners that follow it,
+ * which the terminal draws in one or two cells. Working that out for every row
+ * on every frame would be wasteful, so the kind of every byte is cached for
+ * the KILO_GLYPH_ROWS rows we looked at last that have non-ASCII text in them.
+ */
+struct codeRange {
+  int lo, hi;
+};
+
+/* characters that take no column of their own: combining marks and the like */
+static const struct codeRange zeroWidth[] = {
+    {0x0300, 0x036f},   {0x0483, 0x0489},   {0x0591, 0x05bd},
+    {0x05bf, 0x05bf},   {0x05c1, 0x05c2},   {0x05c4, 0x05c5},
+    {0x05c7, 0x05c7},   {0x0610, 0x061a},   {0x064b, 0x065f},
+    {0x0670, 0x0670},   {0x06d6, 0x06dc},   {0x06df, 0x06e4},
+    {0x06e7, 0x06e8},   {0x06ea, 0x06ed},   {0x0711, 0x0711},
+    {0x0730, 0x074a},   {0x07a6, 0x07b0},   {0x07eb, 0x07f3},
+    {0x0816, 0x0819},   {0x081b, 0x0823},   {0x0825, 0x0827},
+    {0x0829, 0x082d},   {0x0859, 0x085b},   {0x08d3, 0x08e1},
+    {0x08e3, 0x0902},   {0x093a, 0x093a},   {0x093c, 0x093c},
+    {0x0941, 0x0948},   {0x094d, 0x094d},   {0x0951, 0x0957},
+    {0x0962, 0x0963},   {0x0981, 0x0981},   {0x09bc, 0x09bc},
+    {0x09c1, 0x09c4},   {0x09cd, 0x09cd},   {0x09e2, 0x09e3},
+    {0x0a01, 0x0a02},   {0x0a3c, 0x0a3c},   {0x0a41, 0x0a51},
+    {0x0a70, 0x0a71},   {0x0a75, 0x0a75},   {0x0a81, 0x0a82},
+    {0x0abc, 0x0abc},   {0x0ac1, 0x0ac8},   {0x0acd, 0x0acd},
+    {0x0ae2, 0x0ae3},   {0x0b01, 0x0b01},   {0x0b3c, 0x0b3c},
+    {0x0b3f, 0x0b3f},   {0x0b41, 0x0b44},   {0x0b4d, 0x0b4d},
+    {0x0b56, 0x0b56},   {0x0b62, 0x0b63},   {0x0b82, 0x0b82},
+    {0x0bc0, 0x0bc0},   {0x0bcd, 0x0bcd},   {0x0c00, 0x0c00},
+    {0x0c3e, 0x0c40},   {0x0c46, 0x0c56},   {0x0c62, 0x0c63},
+    {0x0cbc, 0x0cbc},   {0x0ccc, 0x0ccd},   {0x0ce2, 0x0ce3},
+    {0x0d00, 0x0d01},   {0x0d41, 0x0d44},   {0x0d4d, 0x0d4d},
+    {0x0d62, 0x0d63},   {0x0dca, 0x0dca},   {0x0dd2, 0x0dd6},
+    {0x0e31, 0x0e31},   {0x0e34, 0x0e3a},   {0x0e47, 0x0e4e},
+    {0x0eb1, 0x0eb1},   {0x0eb4, 0x0ebc},   {0x0ec8, 0x0ecd},
+    {0x0f18, 0x0f19},   {0x0f35, 0x0f35},   {0x0f37, 0x0f37},
+    {0x0f39, 0x0f39},   {0x0f71, 0x0f7e},   {0x0f80, 0x0f84},
+    {0x0f86, 0x0f87},   {0x0f8d, 0x0fbc},   {0x0fc6, 0x0fc6},
+    {0x102d, 0x1030},   {0x1032, 0x1037},   {0x1039, 0x103a},
+    {0x103d, 0x103e},   {0x1058, 0x1059},   {0x105e, 0x1060},
+    {0x1071, 0x1074},   {0x1082, 0x1082},   {0x1085, 0x1086},
+    {0x108d, 0x108d},   {0x109d, 0x109d},   {0x1160, 0x11ff},
+    {0x135d, 0x135f},   {0x1712, 0x1714},   {0x1732, 0x1734},
+    {0x1752, 0x1753},   {0x1772, 0x1773},   {0x17b4, 0x17b5},
+    {0x17b7, 0x17bd},   {0x17c6, 0x17c6},   {0x17c9, 0x17d3},
+    {0x17dd, 0x17dd},   {0x180b, 0x180f},   {0x1885, 0x1886},
+    {0x18a9, 0x18a9},   {0x1920, 0x1922},   {0x1927, 0x1928},
+    {0x1932, 0x1932},   {0x1939, 0x193b},   {0x1a17, 0x1a18},
+    {0x1a1b, 0x1a1b},   {0x1a56, 0x1a56},   {0x1a58, 0x1a60},
+    {0x1a62, 0x1a62},   {0x1a65, 0x1a6c},   {0x1a73, 0x1a7f},
+    {0x1ab0, 0x1aff},   {0x1b00, 0x1b03},   {0x1b34, 0x1b34},
+    {0x1b36, 0x1b3a},   {0x1b3c, 0x1b3c},   {0x1b42, 0x1b42},
+    {0x1b6b, 0x1b73},   {0x1b80, 0x1b81},   {0x1ba2, 0x1ba5},
+    {0x1ba8, 0x1ba9},   {0x1bab, 0x1bad},   {0x1be6, 0x1be6},
+    {0x1be8, 0x1be9},   {0x1bed, 0x1bed},   {0x1bef, 0x1bf1},
+    {0x1c2c, 0x1c33},   {0x1c36, 0x1c37},   {0x1cd0, 0x1cd2},
+    {0x1cd4, 0x1ce0},   {0x1ce2, 0x1ce8},   {0x1ced, 0x1ced},
+    {0x1cf4, 0x1cf4},   {0x1cf8, 0x1cf9},   {0x1dc0, 0x1dff},
+    {0x200b, 0x200f},   {0x202a, 0x202e},   {0x2060, 0x2064},
+    {0x20d0, 0x20f0},   {0x2cef, 0x2cf1},   {0x2d7f, 0x2d7f},
+    {0x2de0, 0x2dff},   {0x302a, 0x302d},   {0x3099, 0x309a},
+    {0xa66f, 0xa672},   {0xa674, 0xa67d},   {0xa69e, 0xa69f},
+    {0xa6f0, 0xa6f1},   {0xa802, 0xa802},   {0xa806, 0xa806},
+    {0xa80b, 0xa80b},   {0xa825, 0xa826},   {0xa8c4, 0xa8c5},
+    {0xa8e0, 0xa8f1},   {0xa926, 0xa92d},   {0xa947, 0xa951},
+    {0xa980, 0xa982},   {0xa9b3, 0xa9b3},   {0xa9b6, 0xa9b9},
+    {0xa9bc, 0xa9bd},   {0xaa29, 0xaa2e},   {0xaa31, 0xaa32},
+    {0xaa35, 0xaa36},   {0xaa43, 0xaa43},   {0xaa4c, 0xaa4c},
+    {0xaab0, 0xaab0},   {0xaab2, 0xaab4},   {0xaab7, 0xaab8},
+    {0xaabe, 0xaabf},   {0xaac1, 0xaac1},   {0xaaec, 0xaaed},
+    {0xaaf6, 0xaaf6},   {0xabe5, 0xabe5},   {0xabe8, 0xabe8},
+    {0xabed, 0xabed},   {0xfb1e, 0xfb1e},   {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f},   {0xfeff, 0xfeff},   {0x101fd, 0x101fd},
+    {0x10a01, 0x10a0f}, {0x10a38, 0x10a3f}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x1107f, 0x11081}, {0x110b3, 0x110b6},
+    {0x110b9, 0x110ba}, {0x11100, 0x11102}, {0x11127, 0x1112b},
+    {0x1112d, 0x11134}, {0x1d167, 0x1d169}, {0x1d17b, 0x1d182},
+    {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0x1e8d0, 0x1e8d6},
+    {0x1e944, 0x1e94a}, {0x1f3fb, 0x1f3ff}, {0xe0001, 0xe0001},
+    {0xe0020, 0xe007f}, {0xe0100, 0xe01ef},
+};
+
+/* and the ones that take two: East Asian wide and fullwidth, and emoji */
+static const struct codeRange doubleWidth[] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},
+    {0x23e9, 0x23ec},   {0x23f0, 0x23f0},   {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267f, 0x267f},   {0x2693, 0x2693},   {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3},   {0x26f5, 0x26f5},   {0x26fa, 0x26fa},
+    {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},
+    {0x2728, 0x2728},   {0x274c, 0x274c},   {0x274e, 0x274e},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},
+    {0x2b50, 0x2b50},   {0x2b55, 0x2b55},   {0x2e80, 0x303e},
+    {0x3041, 0x33ff},   {0x3400, 0x4dbf},   {0x4e00, 0x9fff},
+    {0xa000, 0xa4cf},   {0xa960, 0xa97f},   {0xac00, 0xd7a3},
+    {0xf900, 0xfaff},   {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},
+    {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4},
+    {0x17000, 0x18aff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a},
+    {0x1f200, 0x1f202}, {0x1f210, 0x1f23b}, {0x1f240, 0x1f248},
+    {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f320},
+    {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393},
+    {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0},
+    {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f3fa}, {0x1f400, 0x1f43e},
+    {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d},
+    {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a},
+    {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f},
+    {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2},
+    {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc},
+    {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945},
+    {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd},
+};
+
+#define KILO_NRANGES(t) (sizeof(t) / sizeof((t)[0]))
+
+int codeInRanges(int cp, const struct codeRange *r, size_t n) {
+  size_t lo = 0, hi = n;
+
+  if (cp < r[0].lo || cp > r[n - 1].hi)
+    return 0;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (cp > r[mid].hi)
+      lo = mid + 1;
+    else if (cp < r[mid].lo)
+      hi = mid;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+/* how many columns the character cp takes by itself: 0, 1 or 2 */
+int editorCodeWidth(int cp) {
+  if (cp < 0x300)
+    return 1;
+  if (codeInRanges(cp, zeroWidth, KILO_NRANGES(zeroWidth)))
+    return 0;
+  return codeInRanges(cp, doubleWidth, KILO_NRANGES(doubleWidth)) ? 2 : 1;
+}
+
+/*
+ * decode the character at s[0..len) into *cp and return its length in bytes.
+ * Anything that isn't the shortest encoding of a real code point, or is cut
+ * off by the end of s, decodes one byte at a time to -1.
+ */
+int utf8Decode(const char *s, size_t len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c, min, i;
+
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if ((u[0] & 0xe0) == 0xc0) {
+    n = 2, c = u[0] & 0x1f, min = 0x80;
+  } else if ((u[0] & 0xf0) == 0xe0) {
+    n = 3, c = u[0] & 0x0f, min = 0x800;
+  } else if ((u[0] & 0xf8) == 0xf0) {
+    n = 4, c = u[0] & 0x07, min = 0x10000;
+  } else {
+    *cp = -1;
+    return 1;
+  }
+
+  if ((size_t)n > len) {
+    *cp = -1;
+    return 1;
+  }
+  for (i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      *cp = -1;
+      return 1;
+    }
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+  if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+    *cp = -1;
+    return 1;
+  }
+  *cp = c;
+  return n;
+}
+
+/* the UTF-8 for cp in buf, which has room for 4 bytes; returns the length */
+int utf8Encode(int cp, char *buf) {
+  if (cp < 0x80) {
+    buf[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    buf[0] = 0xc0 | (cp >> 6);
+    buf[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    buf[0] = 0xe0 | (cp >> 12);
+    buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+    buf[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  buf[0] = 0xf0 | (cp >> 18);
+  buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+  buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+  buf[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+#define IS_REGIONAL(cp) ((cp) >= 0x1f1e6 && (cp) <= 0x1f1ff)
+
+/*
+ * the glyph at the start of s[0..len): returns its length in bytes and sets
+ * *kind. It runs on over every zero width character that follows, and over
+ * whatever comes after a zero width joiner (which is how "family" emoji are
+ * built), and two regional indicators make a flag. An ASCII byte always
+ * starts a glyph of its own, which is what lets the ASCII prefix of a row
+ * skip all of this.
+ */
+size_t editorUtf8Glyph(const char *s, size_t len, int *kind) {
+  int cp, next, prev, width, paired = 0;
+  size_t n = utf8Decode(s, len, &cp), k;
+
+  if (cp < 0 || (cp < 0x20 && cp != '\t') || (cp >= 0x7f && cp < 0xa0)) {
+    *kind = GLYPH_BAD;
+    return n;
+  }
+  width = editorCodeWidth(cp);
+  *kind = width == 2 ? GLYPH_WIDE : width == 1 ? GLYPH_NARROW : GLYPH_MARK;
+
+  prev = cp;
+  while (n < len && (unsigned char)s[n] >= 0x80) {
+    k = utf8Decode(s + n, len - n, &next);
+    if (next < 0)
+      break;
+    if (IS_REGIONAL(cp) && IS_REGIONAL(next) && !paired) {
+      *kind = GLYPH_WIDE;
+      paired = 1;
+    } else if (prev != 0x200d && editorCodeWidth(next) != 0) {
+      break;
+    }
+    prev = next;
+    n += k;
+  }
+  return n;
+}
+
+/*
+ * the kind of every byte of row at, from the cache or decoded now. Rows too
+ * long to be worth keeping get NULL, and editorGlyphNext() decodes as it goes.
+ */
+const unsigned char *editorRowGlyphs(size_t at, const char *chars,
+                                     size_t len) {
+  struct glyphRow *g = &E.glyphs[at & (KILO_GLYPH_ROWS - 1)];
+  unsigned char *kind;
+  size_t j, n;
+  int k;
+
+  if (len > KILO_GLYPH_ROW_MAX)
+    return NULL;
+  if (g->kind && g->row == at && g->len == len)
+    return g->kind;
+
+  kind = realloc(g->kind, len ? len : 1);
+  if (kind == NULL)
+    die("realloc");
+  for (j = 0; j < len; j += n) {
+    n = editorUtf8Glyph(chars + j, len - j, &k);
+    kind[j] = k;
+    memset(&kind[j + 1], GLYPH_CONT, n - 1);
+  }
+  g->kind = kind;
+  g->row = at;
+  g->len = len;
+  return kind;
+}
+
+/* where the glyph starting at chars[j] ends, setting *kind to what it is */
+static inline size_t editorGlyphNext(const unsigned char *kinds,
+                                     const char *chars, size_t len, size_t j,
+                                     int *kind) {
+  if (kinds == NULL)
+    return j + editorUtf8Glyph(chars + j, len - j, kind);
+  *kind = kinds[j];
+  for (j++; j < len && kinds[j] == GLYPH_CONT; j++)
+    ;
+  return j;
+}
+
+/*
+ * how far chars[0..n) can be taken a byte at a time. The last ASCII byte is
+ * left out when more follows, in case a combining mark is about to land on it.
+ */
+size_t editorAsciiPrefix(const char *chars, size_t n) {
+  size_t ascii = scanner->ascii(chars, n);
+
+  return ascii < n && ascii > 0 ? ascii - 1 : ascii;
+}
+
+/* rows [at, at + removed] are now [at, at + added], see editorRowsChanged */
+void editorGlyphRowsChanged(size_t at, size_t removed, size_t added) {
+  int i;
+
+  for (i = 0; i < KILO_GLYPH_ROWS; i++) {
+    struct glyphRow *g = &E.glyphs[i];
+
+    /*
+     * rows that moved would be in the wrong slot now, and decoding the few we
+     * show again is cheap
+     */
+    if (g->kind && g->row >= at &&
+        (g->row <= at + removed || removed != added)) {
+      free(g->kind);
+      g->kind = NULL;
+    }
+  }
+}
+
+/* where the glyph that byte cx of row at is part of starts */
+size_t editorGlyphStart(size_t at, size_t cx) {
+  size_t len, j, next;
+  const char *chars = editorRowChars(at, &len);
+  const unsigned char *kinds;
+  int kind;
+
+  if (cx >= len)
+    return len;
+  if (!(chars[cx] & 0x80))
+    return cx;
+
+  kinds = editorRowGlyphs(at, chars, len);
+  if (kinds) {
+    while (cx > 0 && kinds[cx] == GLYPH_CONT)
+      cx--;
+    return cx;
+  }
+
+  /* without the cache, find an ASCII byte to decode forward from */
+  for (j = cx; j > 0 && (chars[j] & 0x80); j--)
+    ;
+  while ((next = editorGlyphNext(NULL, chars, len, j, &kind)) <= cx)
+    j = next;
+  return j;
+}
+
+/* and where the glyph starting at byte cx of row at ends */
+size_t editorGlyphEnd(size_t at, size_t cx) {
+  size_t len;
+  const char *chars = editorRowChars(at, &len);
+  int kind;
+
+  if (cx >= len)
+    return len;
+  if (cx + 1 == len || !(chars[cx + 1] & 0x80))
+    return cx + 1;
+  return editorGlyphNext(editorRowGlyphs(at, chars, len), chars, len, cx,
+                         &kind);
+}
+
+size_t editorRowCxToRx(size_t at, const char *chars, size_t len, size_t cx) {
+  size_t ascii = editorAsciiPrefix(chars, cx);
+  const unsigned char *kinds;
+  size_t rx = 0;
+  size_t j;
+  int kind;
+
+  /* a run without tabs is as wide as it is long, only tabs need a look */
+  for (j = 0; j < ascii; j++) {
+    const char *tab = memchr(chars + j, '\t', ascii - j);
+    size_t run = tab ? (size_t)(tab - (chars + j)) : ascii - j;
+
+    rx += run;
+    j += run;
+    if (tab)
+      rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+  }
+  if (ascii == cx)
+    return rx;
+  j = ascii;
+
+  kinds = editorRowGlyphs(at, chars, len);
+  while (j < cx) {
+    if (chars[j] == '\t')
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    j = editorGlyphNext(kinds, chars, len, j, &kind);
+    rx += kind == GLYPH_WIDE ? 2 : 1;
+  }
+  return rx;
+}
+
+/* the byte of row at drawn at column rx, or -1 if the row doesn't get there */
+size_t editorRowRxToCx(size_t at, const char *chars, size_t len, size_t rx) {
+  const unsigned char *kinds = NULL;
+  size_t cur = 0, j = 0, next, width;
+  int kind;
+
+  while (j < len) {
+    if (chars[j] == '\t') {
+      width = KILO_TAB_STOP - (cur % KILO_TAB_STOP);
+      next = j + 1;
+    } else if (!(chars[j] & 0x80) &&
+               (j + 1 == len || !(chars[j + 1] & 0x80))) {
+      width = 1;
+      next = j + 1;
+    } else {
+      if (kinds == NULL)
+        kinds = editorRowGlyphs(at, chars, len);
+      next = editorGlyphNext(kinds, chars, len, j, &kind);
+      width = kind == GLYPH_WIDE ? 2 : 1;
+    }
+    if (cur + width > rx)
+      return j;
+    cur += width;
+    j = next;
+  }
+  return cur == rx ? len : (size_t)-1;
+}
+
+/*** soft wrap ***/
+
+/*
+ * With soft wrap on (Ctrl-W), a row wider than the screen carries on over as
+ * many screen lines as it needs instead of scrolling sideways, and the view
+ * starts at screen line E.rowsub of row E.rowoff.
+ *
+ * Scrolling needs to know how many screen lines lie between two rows, so
+ * E.wrap caches how many each row takes, and keeps a Fenwick tree over those
+ * counts for their prefix sums in O(log n), as well as the reverse: which row
+ * a given screen line belongs to. Editing a row only changes its own entry.
+ *
+ * Only rows near the view ever get measured, which in a huge file is a tiny
+ * part of it, so the cache covers a window of rows [base, base + n) and every
+ * row outside it, or not measured yet, counts as one line. Sums are only ever
+ * compared between rows that are close together, where they're exact.
+ */
+size_t wrapValue(struct wrapCache *w, size_t i) {
+  return w->lines[i] ? w->lines[i] : 1;
+}
+
+/* the tree rebuilt from scratch, in O(n), after rows were added or removed */
+void wrapRebuild(struct wrapCache *w) {
+  size_t i, j;
+
+  for (i = 1; i <= w->n; i++)
+    w->tree[i] = wrapValue(w, i - 1);
+  for (i = 1; i <= w->n; i++) {
+    j = i + (i & -i);
+    if (j <= w->n)
+      w->tree[j] += w->tree[i];
+  }
+  w->stale = 0;
+}
+
+/* the screen lines of the first i rows of the window */
+size_t wrapSum(struct wrapCache *w, size_t i) {
+  size_t sum = 0;
+
+  if (w->stale)
+    wrapRebuild(w);
+  for (; i > 0; i -= i & -i)
+    sum += w->tree[i];
+  return sum;
+}
+
+void wrapReserve(struct wrapCache *w, size_t n) {
+  if (n <= w->cap)
+    return;
+  while (w->cap < n)
+    w->cap = w->cap ? w->cap * 2 : 1024;
+  w->lines = realloc(w->lines, sizeof(*w->lines) * w->cap);
+  w->tree = realloc(w->tree, sizeof(*w->tree) * (w->cap + 1));
+  if (w->lines == NULL || w->tree == NULL)
+    die("realloc");
+}
+
+/* add another row to the end of the window, not measured yet */
+void wrapAppend(struct wrapCache *w) {
+  size_t i = w->n + 1;
+
+  wrapReserve(w, w->n + 1);
+  if (w->stale)
+    wrapRebuild(w);
+
+  /* tree[i] sums the rows (i - lowbit(i), i], of which all but i are in */
+  w->lines[w->n] = 0;
+  w->tree[i] = 1 + wrapSum(w, i - 1) - wrapSum(w, i - (i & -i));
+  w->n++;
+}
+
+/* make sure rows lo..hi are in the window, starting over if they're far off */
+void wrapCover(size_t lo, size_t hi) {
+  struct wrapCache *w = &E.wrap;
+
+  if (w->cols != E.screencols) {
+    /* a new width changes every count, but only the ones we need get redone */
+    w->n = 0;
+    w->cols = E.screencols;
+  }
+  if (w->n == 0 || lo < w->base || hi - w->base >= KILO_WRAP_WINDOW ||
+      hi > w->base + w->n + KILO_WRAP_GAP) {
+    w->base = lo;
+    w->n = 0;
+    w->stale = 0;
+  }
+  while (w->base + w->n <= hi)
+    wrapAppend(w);
+}
+
+/*
+ * how many screen lines row at takes. A row that fills its last line exactly
+ * gets another, empty one: that's where the cursor goes at its end.
+ */
+size_t editorWrapLines(size_t at) {
+  struct wrapCache *w = &E.wrap;
+  size_t len, width, v, i;
+  const char *chars;
+
+  if (at >= w->base && at - w->base < w->n && w->lines[at - w->base] &&
+      w->cols == E.screencols)
+    return w->lines[at - w->base];
+
+  chars = editorRowChars(at, &len);
+  width = editorRowCxToRx(at, chars, len, len);
+  v = width / E.screencols + 1;
+
+  if (at >= w->base && at - w->base < w->n && w->cols == E.screencols) {
+    i = at - w->base;
+    w->lines[i] = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+    if (!w->stale)
+      for (i++; i <= w->n; i += i & -i)
+        w->tree[i] += w->lines[at - w->base] - 1;
+  }
+  return v;
+}
+
+/* which screen line of row at the cursor is on, when it's at column rx */
+size_t editorWrapSub(size_t at, size_t rx) {
+  size_t lines = editorRowExists(at) ? editorWrapLines(at) : 1;
+  size_t sub = rx / E.screencols;
+
+  return sub < lines ? sub : lines - 1;
+}
+
+/*
+ * screen line sub of row at, counted from the top of the document. The number
+ * itself is only meaningful compared to another one close by.
+ */
+size_t editorVisualLine(size_t at, size_t sub) {
+  struct wrapCache *w = &E.wrap;
+
+  if (!E.wrap.enabled || w->n == 0 || at <= w->base)
+    return at + sub;
+  if (at - w->base <= w->n)
+    return w->base + wrapSum(w, at - w->base) + sub;
+  return w->base + wrapSum(w, w->n) + (at - w->base - w->n) + sub;
+}
+
+/* the other way around: which row, and which of its screen lines, is v */
+void editorWrapFind(size_t v, size_t *at, size_t *sub) {
+  struct wrapCache *w = &E.wrap;
+  size_t pos = 0, step = 1, total;
+
+  if (w->n == 0 || v < w->base) {
+    *at = v;
+    *sub = 0;
+    return;
+  }
+  v -= w->base;
+  total = wrapSum(w, w->n);
+  if (v >= total) {
+    *at = w->base + w->n + (v - total);
+    *sub = 0;
+    return;
+  }
+
+  /* walk down the tree, taking every subtree that still fits in v */
+  while (step * 2 <= w->n)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= w->n && w->tree[pos + step] <= v) {
+      pos += step;
+      v -= w->tree[pos];
+    }
+  }
+  *at = w->base + pos;
+  *sub = v;
+}
+
+/* rows [at, at + removed] are now [at, at + added], see editorRowsChanged */
+void editorWrapRowsChanged(size_t at, size_t removed, size_t added) {
+  struct wrapCache *w = &E.wrap;
+  size_t i, tail;
+
+  if (w->n == 0)
+    return;
+
+  /* all of the window just moves */
+  if (at + removed < w->base) {
+    w->base = w->base + added - removed;
+    return;
+  }
+  if (at < w->base) {
+    w->n = 0;
+    return;
+  }
+  i = at - w->base;
+  if (i >= w->n)
+    return;
+
+  if (removed == 0 && added == 0) {
+    /* an edit inside one row, which is back to counting as one line */
+    if (w->lines[i] && !w->stale) {
+      size_t k;
+
+      for (k = i + 1; k <= w->n; k += k & -k)
+        w->tree[k] -= w->lines[i] - 1;
+    }
+    w->lines[i] = 0;
+  } else if (i + removed + 1 >= w->n) {
+    /* the tree's entries for the rows before i don't depend on the rest */
+    w->n = i;
+  } else {
+    tail = w->n - (i + removed + 1);
+    wrapReserve(w, w->n - removed + added);
+    memmove(&w->lines[i + added + 1], &w->lines[i + removed + 1],
+            sizeof(*w->lines) * tail);
+    memset(&w->lines[i], 0, sizeof(*w->lines) * (added + 1));
+    w->n = i + added + 1 + tail;
+    w->stale = 1;
+  }
+}
+
+void editorToggleWrap(void) {
+  E.wrap.enabled = !E.wrap.enabled;
+  E.wrap.n = 0;
+  E.rowsub = 0;
+  E.coloff = 0;
+  editorSetStatusMessage("Soft wrap %s", E.wrap.enabled ? "on" : "off");
+}
+
+/*** syntax highlighting ***/
+
+/* this has to match keywordHash() in genlex.c */
+unsigned editorKeywordHash(const char *s, size_t len,
+                           struct editorSyntax *syn) {
+  return ((unsigned char)s[0] * syn->kw_a +
+          (unsigned char)s[len / 2] * syn->kw_b +
+          (unsigned char)s[len - 1] * syn->kw_c + (unsigned)len) &
+         syn->kw_mask;
+}
+
+/* the HL_KEYWORD* color of a word, or HL_NORMAL if it isn't a keyword */
+int editorKeyword(const char *s, size_t len, struct editorSyntax *syn) {
+  const struct lexKeyword *k = &syn->keywords[editorKeywordHash(s, len, syn)];
+
+  if (k->len == len && !memcmp(s, k->word, len))
+    return k->hl;
+  return HL_NORMAL;
+}
+
+/*
+ * The DFA state a row starts in when the row before ended in state (LEX_NORMAL
+ * or LEX_MLCOMMENT), the one byte c takes state s to, and what a row ending
+ * in s hands on to the next. Everything that lexes goes through these, so the
+ * editor, the highlight worker and the index server can't disagree.
+ */
+static inline int lexRowStart(const struct editorSyntax *syn, int state) {
+  return state == LEX_MLCOMMENT ? syn->block : syn->start;
+}
+
+static inline int lexStep(const struct editorSyntax *syn, int s,
+                          unsigned char c) {
+  return syn->next[s * syn->nclasses + syn->cls[c]] & ~LEX_RECOLOR;
+}
+
+static inline int lexRowEnd(const struct editorSyntax *syn, int s) {
+  return syn->eol[s] ? LEX_MLCOMMENT : LEX_NORMAL;
+}
+
+/*
+ * Lex one row starting in state, filling in hl (one entry per byte) if it's
+ * not NULL, and return the state at the end of the row. Without hl this is
+ * the cheap pass used to walk forward to the rows we actually draw: one
+ * table lookup per byte and nothing else.
+ *
+ * With hl, words that started in the ident state are looked up when they
+ * end, if what ends them is a separator (or the end of the row). And a
+ * transition with LEX_RECOLOR set has just found out the byte before was
+ * the start of a comment.
+ */
+int editorLexRow(const char *chars, size_t len, int state, unsigned char *hl) {
+  struct editorSyntax *syn = E.syntax;
+  const unsigned char *cls = syn->cls, *next = syn->next;
+  int s = lexRowStart(syn, state);
+  size_t word = 0;
+  size_t i;
+
+  if (hl == NULL) {
+    for (i = 0; i < len; i++)
+      s = lexStep(syn, s, chars[i]);
+    return lexRowEnd(syn, s);
+  }
+
+  for (i = 0; i < len; i++) {
+    int cl = cls[(unsigned char)chars[i]];
+    int t = next[s * syn->nclasses + cl];
+
+    if (t & LEX_RECOLOR) {
+      t &= ~LEX_RECOLOR;
+      hl[i - 1] = syn->color[t];
+    }
+    if (s == syn->ident && t != syn->ident && syn->sep[cl])
+      memset(&hl[word], editorKeyword(&chars[word], i - word, syn), i - word);
+    else if (t == syn->ident && s != syn->ident)
+      word = i;
+    hl[i] = syn->color[t];
+    s = t;
+  }
+  if (s == syn->ident)
+    memset(&hl[word], editorKeyword(&chars[word], len - word, syn), len - word);
+
+  return lexRowEnd(syn, s);
+}
+
+void editorHlReserve(size_t rows) {
+  struct hlCache *hl = &E.hl;
+
+  if (rows <= hl->cap)
+    return;
+  while (hl->cap < rows)
+    hl->cap = hl->cap ? hl->cap * 2 : 1024;
+  hl->state = realloc(hl->state, hl->cap);
+  if (hl->state == NULL)
+    die("realloc");
+}
+
+int editorHlLexState(size_t at, int state) {
+  size_t len;
+  const char *chars = editorRowChars(at, &len);
+
+  return editorLexRow(chars, len, state, NULL);
+}
+
+/*
+ * Whether the end states the index server sent are any good: they are for the
+ * rows of the file as it is on disk, so only until the first edit.
+ */
+int editorHlShared(void) {
+  return E.hl.shared && E.hl.sharedsyntax == E.syntax &&
+         E.hl.sharedversion == E.version;
+}
+
+/*
+ * The end state of every row that ends in the len bytes at p, in states[*row]
+ * on, lexing for syn from DFA state *s. The index server does this, a piece of
+ * the file at a time, the same way hlWorkerRun() goes through a snapshot.
+ */
+void hlLexStates(struct editorSyntax *syn, const char *p, size_t len, int *s,
+                 unsigned char *states, size_t *row) {
+  int t = *s, st;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (p[i] != '\n') {
+      t = lexStep(syn, t, p[i]);
+      continue;
+    }
+    st = lexRowEnd(syn, t);
+    states[(*row)++] = st;
+    t = lexRowStart(syn, st);
+  }
+  *s = t;
+}
+
+/* the page row belongs to, NULL if the worker hasn't published any of it */
+struct hlPage *editorHlPage(size_t row) {
+  struct hlPage *pg;
+
+  if (E.hlw.pages == NULL || row / KILO_HL_PAGE >= KILO_HL_PAGES)
+    return NULL;
+  pg = __atomic_load_n(&E.hlw.pages[row / KILO_HL_PAGE], __ATOMIC_ACQUIRE);
+  if (pg == NULL || __atomic_load_n(&pg->gen, __ATOMIC_ACQUIRE) != E.hlw.gen)
+    return NULL;
+  return pg;
+}
+
+/*
+ * Copy the end states of up to max rows from row on into out, as far as the
+ * worker has got with them. Returns how many rows it copied.
+ */
+size_t editorHlFetch(size_t row, size_t max, unsigned char *out) {
+  struct hlPage *pg;
+  size_t i = row % KILO_HL_PAGE, lo, hi;
+
+  if (editorHlShared()) {
+    if (row >= E.hl.sharedrows)
+      return 0;
+    if (max > E.hl.sharedrows - row)
+      max = E.hl.sharedrows - row;
+    memcpy(out, &E.hl.shared[row], max);
+    return max;
+  }
+
+  pg = editorHlPage(row);
+  if (pg == NULL)
+    return 0;
+  lo = __atomic_load_n(&pg->lo, __ATOMIC_RELAXED);
+  hi = __atomic_load_n(&pg->hi, __ATOMIC_ACQUIRE);
+  if (i < lo || i >= hi)
+    return 0;
+  if (max > hi - i)
+    max = hi - i;
+  memcpy(out, &pg->state[i], max);
+  return max;
+}
+
+/* get the page for row ready for the rows of this generation, from row on */
+struct hlPage *hlWorkerPage(struct hlWorker *w, unsigned gen, size_t row) {
+  struct hlPage **slot = &w->pages[row / KILO_HL_PAGE];
+  struct hlPage *pg = *slot;
+
+  if (pg == NULL) {
+    pg = malloc(sizeof(struct hlPage));
+    if (pg == NULL)
+      return NULL;
+    pg->gen = gen - 1;
+  }
+  __atomic_store_n(&pg->hi, row % KILO_HL_PAGE, __ATOMIC_RELAXED);
+  __atomic_store_n(&pg->lo, row % KILO_HL_PAGE, __ATOMIC_RELAXED);
+  __atomic_store_n(&pg->gen, gen, __ATOMIC_RELEASE);
+  __atomic_store_n(slot, pg, __ATOMIC_RELEASE);
+  return pg;
+}
+
+/*
+ * Lex the snapshot to the end of the document, publishing the end state of
+ * every row. This is the same loop as editorLexRow() without hl, except it
+ * finds the row boundaries itself. A trailing '\r' can't change the state a
+ * row ends in, so there's no need to strip it here.
+ */
+void hlWorkerRun(struct hlWorker *w, struct hlJob *job) {
+  struct editorSyntax *syn = job->syntax;
+  int s = lexRowStart(syn, job->state);
+  size_t row = job->row, skip = job->skip, i, j;
+  struct hlPage *pg = hlWorkerPage(w, job->gen, row);
+
+  for (i = 0; i < job->numspans && pg; i++) {
+    struct saveSpan *sp = &job->spans[i];
+    const char *text = sp->text ? sp->text : job->map + sp->off;
+
+    if (skip >= sp->len) {
+      skip -= sp->len;
+      continue;
+    }
+    for (j = skip; j < sp->len; j++) {
+      unsigned char c = text[j];
+      int st;
+
+      if (c != '\n') {
+        s = lexStep(syn, s, c);
+        continue;
+      }
+
+      st = lexRowEnd(syn, s);
+      pg->state[row % KILO_HL_PAGE] = st;
+      __atomic_store_n(&pg->hi, row % KILO_HL_PAGE + 1, __ATOMIC_RELEASE);
+      s = lexRowStart(syn, st);
+      row++;
+
+      /* an edit makes all of this stale, stop and wait for the next job */
+      if (__atomic_load_n(&w->gen, __ATOMIC_RELAXED) != job->gen)
+        return;
+      if (row % KILO_HL_PAGE == 0) {
+        if (row / KILO_HL_PAGE == KILO_HL_PAGES)
+          return;
+        /* let the main thread move the mapping, if it's waiting to */
+        editorMapLeave();
+        editorMapEnter();
+        pg = hlWorkerPage(w, job->gen, row);
+        if (pg == NULL)
+          return;
+      }
+    }
+    skip = 0;
+  }
+}
+
+void *hlWorkerMain(void *arg) {
+  struct hlWorker *w = arg;
+  struct hlJob job;
+
+#ifdef SCHED_IDLE
+  /* only use CPU time nobody else wants */
+  struct sched_param sp = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->pending)
+      pthread_cond_wait(&w->wake, &w->lock);
+    job = w->job;
+    w->pending = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    editorMapEnter();
+    hlWorkerRun(w, &job);
+    editorMapLeave();
+    free(job.spans);
+  }
+  return NULL;
+}
+
+/*
+ * Hand the worker the rows below the last one our own cache trusts. Lexer
+ * state only flows down the file, so that's always where the next useful
+ * work is. After an edit this runs as a timer, a little while after the last
+ * key, so typing doesn't restart the worker on every keystroke.
+ */
+void editorHlStartWorker(void) {
+  struct hlWorker *w = &E.hlw;
+  struct hlJob job;
+
+  if (E.syntax == NULL || w->posted == w->gen || editorHlShared())
+    return;
+
+  if (!w->started) {
+    pthread_attr_t attr;
+
+    w->pages = calloc(KILO_HL_PAGES, sizeof(struct hlPage *));
+    if (w->pages == NULL)
+      die("calloc");
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&w->thread, &attr, hlWorkerMain, w) != 0)
+      die("pthread_create");
+    pthread_attr_destroy(&attr);
+    w->started = 1;
+  }
+
+  job.gen = w->gen;
+  job.syntax = E.syntax;
+  job.map = E.map;
+  job.row = E.hl.dirty;
+  job.state = job.row ? E.hl.state[job.row - 1] : LEX_NORMAL;
+  job.skip = editorRowOffset(job.row);
+  job.numspans = 0;
+  job.spans = malloc(sizeof(struct saveSpan) * (editorCountPieces(E.pt) + 1));
+  if (job.spans == NULL)
+    die("malloc");
+  editorSnapshotNode(E.pt, job.spans, &job.numspans);
+
+  pthread_mutex_lock(&w->lock);
+  if (w->pending)
+    free(w->job.spans);
+  w->job = job;
+  w->pending = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  w->posted = job.gen;
+}
+
+/* whatever the worker has published so far is stale now */
+void editorHlInvalidateWorker(void) {
+  __atomic_store_n(&E.hlw.gen, E.hlw.gen + 1, __ATOMIC_RELAXED);
+}
+
+/* forget every cached state, after opening a file or changing its syntax */
+void editorHlReset(void) {
+  E.hl.valid = E.hl.dirty = 0;
+  editorHlInvalidateWorker();
+  editorHlStartWorker();
+}
+
+/* the lexer state at the end of row at, lexing forward as little as we can */
+int editorHlEndState(size_t at) {
+  struct hlCache *hl = &E.hl;
+
+  /* catch up on rows an edit may have changed, until they converge */
+  while (hl->dirty <= at && hl->dirty < hl->valid) {
+    int prev = hl->dirty ? hl->state[hl->dirty - 1] : LEX_NORMAL;
+    unsigned char st;
+
+    if (editorHlFetch(hl->dirty, 1, &st) == 0)
+      st = editorHlLexState(hl->dirty, prev);
+
+    if (st == hl->state[hl->dirty]) {
+      /* converged; skip ahead to the next row some other edit touched */
+      unsigned char *next = memchr(&hl->state[hl->dirty], LEX_UNKNOWN,
+                                   hl->valid - hl->dirty);
+      hl->dirty = next ? (size_t)(next - hl->state) : hl->valid;
+      continue;
+    }
+    hl->state[hl->dirty++] = st;
+  }
+
+  /* and rows we've never looked at, unless the worker got there first */
+  while (hl->valid <= at) {
+    int prev = hl->valid ? hl->state[hl->valid - 1] : LEX_NORMAL;
+    size_t n;
+
+    editorHlReserve(at + 1);
+    n = editorHlFetch(hl->valid, at + 1 - hl->valid, &hl->state[hl->valid]);
+    if (n == 0) {
+      hl->state[hl->valid] = editorHlLexState(hl->valid, prev);
+      n = 1;
+    }
+    hl->valid += n;
+    hl->dirty = hl->valid;
+  }
+  return hl->state[at];
+}
+
+int editorHlStartState(size_t at) {
+  return at == 0 ? LEX_NORMAL : editorHlEndState(at - 1);
+}
+
+/*
+ * rows [at, at + removed] were replaced by rows [at, at + added]. Keep the
+ * cached states of the rows after them, shifted to their new row numbers, and
+ * mark everything from at on as needing a check.
+ */
+void editorHlRowsChanged(size_t at, size_t removed, size_t added) {
+  struct hlCache *hl = &E.hl;
+  size_t tail, i;
+
+  editorHlInvalidateWorker();
+  editorAddTimer(KILO_HL_IDLE_MS, editorHlStartWorker);
+  if (at >= hl->valid)
+    return;
+
+  /*
+   * a catch-up that stopped short of converging leaves hl->dirty on a row
+   * nobody has checked yet. Mark it, or catching up from at could converge
+   * first and skip straight past it.
+   */
+  if (at < hl->dirty && hl->dirty < hl->valid)
+    hl->state[hl->dirty] = LEX_UNKNOWN;
+
+  if (at + removed + 1 >= hl->valid) {
+    hl->valid = at;
+  } else {
+    tail = hl->valid - (at + removed + 1);
+    editorHlReserve(hl->valid - removed + added);
+    memmove(&hl->state[at + added + 1], &hl->state[at + removed + 1], tail);
+    hl->valid = hl->valid - removed + added;
+    for (i = at; i <= at + added; i++)
+      hl->state[i] = LEX_UNKNOWN;
+  }
+  if (hl->dirty > at)
+    hl->dirty = at;
+  if (hl->dirty > hl->valid)
+    hl->dirty = hl->valid;
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  case HL_KEYWORD1:
+    return 33;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_STRING:
+    return 35;
+  case HL_NUMBER:
+    return 31;
+  case HL_MATCH:
+    return 34;
+  default:
+    return 37;
+  }
+}
+
+void editorSelectSyntaxHighlight(void) {
+  unsigned int j;
+
+  E.syntax = NULL;
+  if (E.filename == NULL)
+    return;
+
+  char *ext = strrchr(E.filename, '.');
+
+  for (j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        E.syntax = s;
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*
+ * Everything that caches something per row hears about edits here. Rows
+ * [at, at + removed] were replaced by rows [at, at + added].
+ *
+ * Between editorBeginBatch() and editorEndBatch() that only happens once, for
+ * rows covering all of the edits: a key typed at ten thousand cursors costs
+ * the caches no more than one typed at a single cursor, and no less.
+ */
+void editorRowsChanged(size_t at, size_t removed, size_t added) {
+  struct rowBatch *b = &E.batch;
+
+  if (b->depth && !b->pending) {
+    b->at = at;
+    b->removed = removed;
+    b->added = added;
+    b->pending = 1;
+    return;
+  }
+  if (b->depth) {
+    /* [lo, hi] as the rows are now, before this edit */
+    size_t lo = at < b->at ? at : b->at;
+    size_t hi = at + removed > b->at + b->added ? at + removed
+                                                : b->at + b->added;
+
+    b->removed = hi - b->added + b->removed - lo;
+    b->added = hi + added - removed - lo;
+    b->at = lo;
+    return;
+  }
+
+  editorHlRowsChanged(at, removed, added);
+  editorGlyphRowsChanged(at, removed, added);
+  editorWrapRowsChanged(at, removed, added);
+}
+
+void editorBeginBatch(void) { E.batch.depth++; }
+
+void editorEndBatch(void) {
+  struct rowBatch *b = &E.batch;
+
+  if (--b->depth > 0 || !b->pending)
+    return;
+  b->pending = 0;
+  editorRowsChanged(b->at, b->removed, b->added);
+}
+
+/*** editor operations ***/
+
+/* where the cursor is, as an offset into the document */
+size_t editorCursorOffset(void) { return editorRowOffset(E.cy) + E.cx; }
+
+void editorInsertText(const char *s, size_t len) {
+  size_t pos;
+
+  /* typing on the row past the end needs the last row to be terminated */
+  if (E.cy == editorNumRows() && ptSize() > 0 &&
+      ptByte(ptSize() - 1) != '\n')
+    ptInsert(ptSize(), "\n", 1);
+
+  pos = editorCursorOffset();
+  ptInsert(pos, s, len);
+  E.dirty++;
+}
+
+/* c is a code point, see editorReadKey() */
+void editorInsertChar(int c) {
+  char buf[4];
+  int n = utf8Encode(c, buf);
+
+  editorInsertText(buf, n);
+  E.cx += n;
+}
+
+void editorInsertNewline(void) {
+  editorInsertText("\n", 1);
+  E.cy++;
+  E.cx = 0;
+}
+
+/*
+ * insert a whole block of text at the cursor as a single piece, leaving the
+ * cursor after it
+ */
+void editorInsertBlock(char *s, size_t len) {
+  size_t i, lf = 0, last = 0;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == '\n') {
+      lf++;
+      last = i + 1;
+    }
+  }
+
+  editorInsertText(s, len);
+  if (lf) {
+    E.cy += lf;
+    E.cx = len - last;
+  } else {
+    E.cx += len;
+  }
+}
+
+void editorDelChar(void) {
+  size_t pos, len;
+
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  if (E.cy == editorNumRows() && E.cx == 0) {
+    E.cy--;
+    editorRowChars(E.cy, &E.cx);
+    return;
+  }
+
+  pos = editorCursorOffset();
+  if (E.cx > 0) {
+    /* a character and the marks on it go together */
+    len = E.cx - editorGlyphStart(E.cy, E.cx - 1);
+    ptDelete(pos - len, len);
+    E.cx -= len;
+  } else {
+    /* join with the row above by deleting its line ending */
+    len = pos >= 2 && ptByte(pos - 2) == '\r' ? 2 : 1;
+    E.cy--;
+    editorRowChars(E.cy, &E.cx);
+    ptDelete(pos - len, len);
+  }
+  E.dirty++;
+}
+
+/*
+ * ^G asks for a line number, or for a point in the file as a percentage. The
+ * rows are O(log n) to find either way, or O(1) and a short scan in kilo -v,
+ * as long as the index has got that far.
+ */
+void editorGoTo(void) {
+  char *query = editorPrompt("Go to: %s (line or N%%, ESC to cancel)", NULL);
+  char *end;
+  unsigned long long n;
+  size_t row, size;
+
+  if (query == NULL)
+    return;
+  n = strtoull(query, &end, 10);
+  if (end == query || (*end != '\0' && strcmp(end, "%") != 0)) {
+    editorSetStatusMessage("Not a line number or a percentage: %s", query);
+    free(query);
+    return;
+  }
+
+  if (*end == '%') {
+    size = E.view.enabled ? E.view.size : ptSize();
+    if (n > 100)
+      n = 100;
+    /* the last byte's row for 100%, not the empty one after it */
+    size = n * (size / 100) + n * (size % 100) / 100 - (n == 100 && size);
+    if (E.view.enabled) {
+      long long at = editorViewRowAt(size);
+
+      if (at < 0) {
+        editorSetStatusMessage("Only %d%% of the file is indexed so far",
+                               editorViewPercent());
+        free(query);
+        return;
+      }
+      row = at;
+    } else {
+      while (!editorIndexComplete() && E.idx.scanned <= size)
+        editorIndexChunk();
+      row = ptRowAt(size);
+    }
+  } else {
+    row = n ? n - 1 : 0;
+    editorIndexRows(row);
+    if (row >= editorNumRows() && E.view.enabled && !editorViewComplete()) {
+      editorSetStatusMessage("Only %zu rows are indexed so far",
+                             editorNumRows());
+      free(query);
+      return;
+    }
+  }
+  free(query);
+
+  if (row >= editorNumRows())
+    row = editorNumRows() ? editorNumRows() - 1 : 0;
+  E.cy = row;
+  E.cx = 0;
+  E.rowoff = E.cy + 1; /* have editorScroll() put it at the top */
+}
+
+/*** undo ***/
+
+/*
+ * Undo never copies any text. The buffers pieces point into don't change once
+ * written (the file is mapped read-only and the add buffer only grows), so an
+ * edit is undone by taking out the pieces it put in and putting back the ones
+ * it took out. All the history keeps of a change is where it happened and
+ * those piece descriptors: an insert is always a single piece, and a delete is
+ * as many pieces as it cut through, usually one or two.
+ *
+ * Typing doesn't even take a new change per key. A character typed right
+ * after the last one also lands in the add buffer right after it, so the
+ * insert's piece just gets longer; backspacing or deleting over and over does
+ * the same with the last delete. A run ends at a newline, or at a pause of
+ * KILO_UNDO_RUN_MS.
+ *
+ * Changes made by the same key (a paste, joining two lines) form a group that
+ * is undone in one go. Once the history takes up more than its limit, the
+ * oldest groups are dropped; KILO_UNDO_MB=<n> sets the limit in megabytes.
+ * Text only they still pointed at is then given back, see editorAddReclaim().
+ *
+ * Every change gets an id, and the document as a change leaves it is known by
+ * that id (by base before the first change we still have). Undoing back to the
+ * id that was saved is undoing back to what's on disk, so the buffer isn't
+ * modified any more. A change that was saved is sealed, so typing on doesn't
+ * make it into a different document under the same id.
+ */
+const struct piece *undoPieces(const struct undoOp *op) {
+  return op->pieces ? op->pieces : &op->one;
+}
+
+size_t undoOpBytes(const struct undoOp *op) {
+  return sizeof(*op) + op->cap * sizeof(struct piece) +
+         op->nspots * sizeof(size_t) * (op->spotlen ? 2 : 1);
+}
+
+void editorUndoInit(void) {
+  const char *mb = getenv("KILO_UNDO_MB");
+  long n = mb ? atol(mb) : KILO_UNDO_MB;
+
+  E.undo.limit = (size_t)(n > 0 ? n : KILO_UNDO_MB) << 20;
+}
+
+/* forget the changes [from, to) of the history */
+void undoDrop(size_t from, size_t to) {
+  struct undoHistory *u = &E.undo;
+  size_t i;
+
+  for (i = from; i < to; i++) {
+    u->bytes -= undoOpBytes(&u->ops[i]);
+    free(u->ops[i].pieces);
+    free(u->ops[i].spot);
+  }
+  if (from == 0 && to > 0)
+    u->base = u->ops[to - 1].id;
+  if (to < u->n)
+    memmove(&u->ops[from], &u->ops[to], sizeof(*u->ops) * (u->n - to));
+  u->n -= to - from;
+  if (u->next > to)
+    u->next -= to - from;
+  else if (u->next > from)
+    u->next = from;
+}
+
+/* mark the add buffer chunks that pieces in t point into */
+void addMarkTree(struct pieceNode *t, unsigned char *live) {
+  for (; t; t = t->right) {
+    addMarkTree(t->left, live);
+    if (t->p.buf == PIECE_ADD && t->p.len)
+      live[addChunkAt(t->p.off)] = 1;
+  }
+}
+
+/*
+ * The add buffer only ever grows, since the document and the history point
+ * into it. But text that neither of them points at any more (what was typed
+ * and deleted again, and dropped from the history since) can't come back, so
+ * the chunks holding only that kind of text give their memory back to the
+ * system. Their addresses stay mapped: a background job still reading an old
+ * snapshot reads zeros there, and throws away what it found anyway. A save
+ * can't be allowed to, so this waits for the next drop when one is running.
+ */
+void editorAddReclaim(void) {
+  struct addBuffer *add = &E.add;
+  struct undoHistory *u = &E.undo;
+  unsigned char *live;
+  size_t i, k;
+  int c;
+
+  if (E.save.active || add->numchunks < 2)
+    return;
+  live = calloc(add->numchunks, 1);
+  if (live == NULL)
+    return;
+
+  /* the last chunk is still being added to */
+  live[add->numchunks - 1] = 1;
+  addMarkTree(E.pt, live);
+  for (i = 0; i < u->n; i++) {
+    const struct piece *ps = undoPieces(&u->ops[i]);
+
+    for (k = 0; k < u->ops[i].npieces; k++)
+      if (ps[k].buf == PIECE_ADD && ps[k].len)
+        live[addChunkAt(ps[k].off)] = 1;
+  }
+
+  for (c = 0; c < add->numchunks; c++) {
+    struct addChunk *ch = &add->chunks[c];
+
+    if (!live[c] && !ch->dead) {
+      madvise(ch->data, ch->cap, MADV_DONTNEED);
+      ch->dead = 1;
+    }
+  }
+  free(live);
+}
+
+void editorUndoClear(void) {
+  undoDrop(0, E.undo.n);
+  E.undo.sealed = 1;
+  editorAddReclaim();
+}
+
+/* the id of the document as it is */
+unsigned long editorUndoState(void) {
+  struct undoHistory *u = &E.undo;
+
+  return u->next ? u->ops[u->next - 1].id : u->base;
+}
+
+/* the document as it is was just saved, or opened */
+void editorUndoSaved(unsigned long state) {
+  E.undo.saved = state;
+  E.undo.sealed = 1;
+}
+
+/* after an undo or redo: modified, unless it's back to what was saved */
+void undoUpdateDirty(void) {
+  E.dirty = editorUndoState() == E.undo.saved ? 0 : E.dirty + 1;
+}
+
+/* a new change, at the end of what's done; anything undone is gone for good */
+struct undoOp *undoPush(int kind, size_t pos, size_t len) {
+  struct undoHistory *u = &E.undo;
+  struct undoOp *op;
+  size_t drop;
+
+  /* what was undone can't be redone now, nor its text come back */
+  if (u->next < u->n) {
+    undoDrop(u->next, u->n);
+    editorAddReclaim();
+  }
+
+  /* over the limit: throw away the oldest groups, a quarter at a time */
+  if (u->bytes > u->limit) {
+    size_t bytes = u->bytes;
+
+    for (drop = 0; drop < u->n && bytes > u->limit / 4 * 3;) {
+      unsigned g = u->ops[drop].group;
+
+      /* the group in progress stays, however big it is */
+      if (g == u->group)
+        break;
+      while (drop < u->n && u->ops[drop].group == g)
+        bytes -= undoOpBytes(&u->ops[drop++]);
+    }
+    undoDrop(0, drop);
+    editorAddReclaim();
+  }
+
+  if (u->n == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    u->ops = realloc(u->ops, sizeof(*u->ops) * u->cap);
+    if (u->ops == NULL)
+      die("realloc");
+  }
+  op = &u->ops[u->n++];
+  u->next = u->n;
+  memset(op, 0, sizeof(*op));
+  op->kind = kind;
+  op->id = ++u->ids;
+  op->group = u->group;
+  op->pos = pos;
+  op->len = len;
+  op->at = editorNow();
+  u->sealed = 0;
+
+  /* the first change of a group remembers where the cursor was */
+  if (u->n >= 2 && u->ops[u->n - 2].group == op->group)
+    op->cursor = u->ops[u->n - 2].cursor;
+  else
+    op->cursor = editorCursorOffset();
+  u->bytes += undoOpBytes(op);
+  return op;
+}
+
+/*
+ * the last change, if the next one could still become part of it: the same
+ * kind, at as many cursors (0 for just the one)
+ */
+struct undoOp *undoLast(int kind, size_t nspots) {
+  struct undoHistory *u = &E.undo;
+  struct undoOp *op;
+
+  if (u->sealed || u->next == 0 || u->next != u->n)
+    return NULL;
+  op = &u->ops[u->n - 1];
+  if (op->kind != kind || op->nspots != nspots ||
+      editorNow() - op->at >= KILO_UNDO_RUN_MS)
+    return NULL;
+  return op;
+}
+
+/* add p to op's pieces, in front or at the back, merging the two if it can */
+void undoAddPiece(struct undoOp *op, const struct piece *p, int front) {
+  struct undoHistory *u = &E.undo;
+  struct piece *ps;
+  size_t n = op->npieces;
+
+  if (n == 0) {
+    op->one = *p;
+    op->npieces = 1;
+    return;
+  }
+
+  ps = op->pieces ? op->pieces : &op->one;
+  if (front && ps[0].buf == p->buf && p->off + p->len == ps[0].off) {
+    ps[0].off = p->off;
+    ps[0].len += p->len;
+    ps[0].lf += p->lf;
+    return;
+  }
+  if (!front && ps[n - 1].buf == p->buf &&
+      ps[n - 1].off + ps[n - 1].len == p->off) {
+    ps[n - 1].len += p->len;
+    ps[n - 1].lf += p->lf;
+    return;
+  }
+
+  if (n + 1 > op->cap) {
+    size_t cap = op->cap ? op->cap * 2 : 4;
+
+    ps = realloc(op->pieces, sizeof(*ps) * cap);
+    if (ps == NULL)
+      die("realloc");
+    if (op->pieces == NULL)
+      ps[0] = op->one;
+    op->pieces = ps;
+    u->bytes += (cap - op->cap) * sizeof(*ps);
+    op->cap = cap;
+  }
+  if (front) {
+    memmove(&op->pieces[1], &op->pieces[0], sizeof(*ps) * n);
+    op->pieces[0] = *p;
+  } else {
+    op->pieces[n] = *p;
+  }
+  op->npieces++;
+}
+
+/* called by ptInsert(), just before piece p goes in at pos */
+void editorUndoInsert(size_t pos, const struct piece *p) {
+  struct undoOp *op = undoLast(UNDO_INSERT, 0);
+
+  if (op && op->npieces == 1 && op->one.lf == 0 &&
+      op->pos + op->len == pos && op->one.buf == p->buf &&
+      op->one.off + op->one.len == p->off) {
+    op->one.len += p->len;
+    op->one.lf += p->lf;
+    op->len += p->len;
+    op->at = editorNow();
+  } else {
+    op = undoPush(UNDO_INSERT, pos, p->len);
+    undoAddPiece(op, p, 0);
+  }
+  if (p->lf)
+    E.undo.sealed = 1;
+}
+
+/* called before the n pieces p go in at pos in one go, by a replace-all */
+void editorUndoInsertPieces(size_t pos, const struct piece *p, size_t n) {
+  struct undoOp *op;
+  size_t i, len = 0;
+
+  for (i = 0; i < n; i++)
+    len += p[i].len;
+  op = undoPush(UNDO_INSERT, pos, len);
+  for (i = 0; i < n; i++)
+    undoAddPiece(op, &p[i], 0);
+  E.undo.sealed = 1;
+}
+
+/* add the pieces of t in order, or in reverse order in front */
+void undoCollect(struct undoOp *op, struct pieceNode *t, int front) {
+  if (t == NULL)
+    return;
+  undoCollect(op, front ? t->right : t->left, front);
+  undoAddPiece(op, &t->p, front);
+  undoCollect(op, front ? t->left : t->right, front);
+}
+
+/* called by ptDelete(), with the nodes it cut out from pos */
+void editorUndoDelete(size_t pos, size_t len, struct pieceNode *cut) {
+  struct undoOp *op = undoLast(UNDO_DELETE, 0);
+
+  if (op && cut->lf == 0 && pos + len == op->pos) {
+    /* backspace: what's cut goes in front */
+    op->pos = pos;
+    op->len += len;
+    op->at = editorNow();
+    undoCollect(op, cut, 1);
+  } else if (op && cut->lf == 0 && pos == op->pos) {
+    /* delete: and here behind */
+    op->len += len;
+    op->at = editorNow();
+    undoCollect(op, cut, 0);
+  } else {
+    op = undoPush(UNDO_DELETE, pos, len);
+    undoCollect(op, cut, 0);
+  }
+  if (cut->lf)
+    E.undo.sealed = 1;
+}
+
+/* op is a change at the n cursors of a column, which are at pos */
+void undoSpots(struct undoOp *op, const size_t *pos, const size_t *len,
+               size_t n) {
+  size_t each = len ? 2 : 1;
+
+  op->spot = malloc(sizeof(size_t) * n * each);
+  if (op->spot == NULL)
+    die("malloc");
+  memcpy(op->spot, pos, sizeof(size_t) * n);
+  if (len) {
+    op->spotlen = op->spot + n;
+    memcpy(op->spotlen, len, sizeof(size_t) * n);
+  }
+  op->nspots = n;
+  E.undo.bytes += sizeof(size_t) * n * each;
+}
+
+/*
+ * called by ptInsertAt(), just before piece p goes in at each of the n pos;
+ * typing on at the same cursors makes the text at every one of them longer
+ */
+void editorUndoInsertAt(const size_t *pos, size_t n, const struct piece *p) {
+  struct undoOp *op = undoLast(UNDO_INSERT, n);
+  size_t i = 0;
+
+  if (op && op->npieces == 1 && op->one.lf == 0 && op->one.buf == p->buf &&
+      op->one.off + op->one.len == p->off) {
+    while (i < n && pos[i] == op->spot[i] + (i + 1) * op->len)
+      i++;
+  }
+  if (op && i == n) {
+    op->one.len += p->len;
+    op->one.lf += p->lf;
+    op->len += p->len;
+    op->at = editorNow();
+  } else {
+    op = undoPush(UNDO_INSERT, pos[0], p->len);
+    undoSpots(op, pos, NULL, n);
+    undoAddPiece(op, p, 0);
+  }
+  if (p->lf)
+    E.undo.sealed = 1;
+}
+
+/*
+ * called by ptDeleteAt() with the nodes it cut out at cursor i of the n at
+ * pos, front to back, which all go in the one change
+ */
+void editorUndoDeleteAt(const size_t *pos, const size_t *len, size_t n,
+                        size_t i, struct pieceNode *cut) {
+  struct undoHistory *u = &E.undo;
+  struct undoOp *op;
+  size_t k, total = 0;
+
+  if (i == 0) {
+    for (k = 0; k < n; k++)
+      total += len[k];
+    op = undoPush(UNDO_DELETE, pos[0], total);
+    undoSpots(op, pos, len, n);
+    u->sealed = 1;
+  }
+  undoCollect(&u->ops[u->n - 1], cut, 0);
+}
+
+/*
+ * Do or take back a change at a column of cursors. spot[i] is where cursor
+ * i's text starts in the document before the change: for an insert that's
+ * without any of the text, which is the same len bytes at each, and for a
+ * delete it's with all of it, spotlen[i] bytes at each, one after the other in
+ * the pieces.
+ */
+void undoApplySpots(const struct undoOp *op, int insert) {
+  const struct piece *ps = undoPieces(op);
+  struct piece *run;
+  size_t i, k = 0, skip = 0, m;
+
+  if (!insert) {
+    for (i = op->nspots; i-- > 0;)
+      ptFree(op->spotlen ? ptCut(op->spot[i], op->spotlen[i])
+                         : ptCut(op->spot[i] + i * op->len, op->len));
+    return;
+  }
+  if (op->spotlen == NULL) {
+    for (i = op->nspots; i-- > 0;)
+      ptInsertPieces(op->spot[i], ps, op->npieces);
+    return;
+  }
+
+  /* the pieces can run on from one cursor's text into the next one's */
+  run = malloc(sizeof(*run) * op->npieces);
+  if (run == NULL)
+    die("malloc");
+  for (i = 0; i < op->nspots; i++) {
+    size_t want = op->spotlen[i];
+
+    for (m = 0; want > 0; m++) {
+      run[m] = ps[k];
+      run[m].off += skip;
+      run[m].len -= skip;
+      if (run[m].len > want)
+        run[m].len = want;
+      if (run[m].len != ps[k].len)
+        run[m].lf = pieceCountLF(run[m].buf, run[m].off, run[m].len);
+      want -= run[m].len;
+      skip += run[m].len;
+      if (skip == ps[k].len) {
+        k++;
+        skip = 0;
+      }
+    }
+    ptInsertPieces(op->spot[i], run, m);
+  }
+  free(run);
+}
+
+/* put the cursor at document offset off */
+void editorCursorTo(size_t off) {
+  E.cy = ptRowAt(off);
+  E.cx = off - editorRowOffset(E.cy);
+}
+
+/* do op over again, or take it back */
+void undoApply(const struct undoOp *op, int undo) {
+  int insert = (op->kind == UNDO_INSERT) != undo;
+
+  if (op->nspots)
+    undoApplySpots(op, insert);
+  else if (insert)
+    ptInsertPieces(op->pos, undoPieces(op), op->npieces);
+  else
+    ptFree(ptCut(op->pos, op->len));
+}
+
+void editorUndo(void) {
+  struct undoHistory *u = &E.undo;
+  unsigned g;
+
+  if (u->next == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  g = u->ops[u->next - 1].group;
+  editorBeginBatch();
+  while (u->next > 0 && u->ops[u->next - 1].group == g)
+    undoApply(&u->ops[--u->next], 1);
+  editorEndBatch();
+  editorCursorTo(u->ops[u->next].cursor);
+  u->sealed = 1;
+  undoUpdateDirty();
+}
+
+void editorRedo(void) {
+  struct undoHistory *u = &E.undo;
+  const struct undoOp *op = NULL;
+  unsigned g;
+
+  if (u->next == u->n) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  g = u->ops[u->next].group;
+  editorBeginBatch();
+  while (u->next < u->n && u->ops[u->next].group == g) {
+    op = &u->ops[u->next++];
+    undoApply(op, 0);
+  }
+  editorEndBatch();
+  editorCursorTo(op->kind == UNDO_INSERT ? op->pos + op->len : op->pos);
+  u->sealed = 1;
+  undoUpdateDirty();
+}
+
+/* every key starts a new group, unless it just extends the last change */
+void editorUndoBreak(void) { E.undo.group++; }
+
+/*** cursors ***/
+
+/*
+ * ^B starts a column of cursors on the cursor's row, and moving up or down
+ * from there puts one on every row in between, all in the cursor's column.
+ * What's typed then goes in at all of them, and backspace and delete take out
+ * the character before or after each one. Rows too short to reach the column
+ * don't get a cursor, nor do rows where it falls inside a tab or a wide
+ * character. Any other edit, or ESC, puts the column away.
+ *
+ * However many cursors there are, a key is one change to the piece table: a
+ * single piece of text in the add buffer and a single batch for the row
+ * caches (see ptInsertAt()), and a single change in the undo history.
+ */
+void editorBlockToggle(void) {
+  E.block.active = !E.block.active;
+  E.block.anchor = E.cy;
+  if (E.block.active)
+    editorSetStatusMessage("Column: up and down add cursors, ESC to stop");
+  else
+    editorSetStatusMessage("");
+}
+
+void editorBlockStop(void) { E.block.active = 0; }
+
+/* rows first..last have a cursor, if they reach its column */
+void editorBlockRows(size_t *first, size_t *last) {
+  *first = E.block.anchor < E.cy ? E.block.anchor : E.cy;
+  *last = E.block.anchor < E.cy ? E.cy : E.block.anchor;
+}
+
+/* the column the cursors are in, which is the cursor's */
+size_t editorBlockColumn(void) {
+  size_t len;
+  const char *chars = editorRowChars(E.cy, &len);
+
+  return editorRowCxToRx(E.cy, chars, len, E.cx < len ? E.cx : len);
+}
+
+/*
+ * fill E.block.pos with where each cursor is in the document, and E.block.len
+ * with the length of the character before it (dir < 0) or after it (dir > 0)
+ * if that's what the edit takes out. Returns how many cursors there are.
+ */
+size_t editorBlockCollect(int dir) {
+  struct cursorBlock *b = &E.block;
+  size_t first, last, row, n = 0, rx = editorBlockColumn();
+
+  editorBlockRows(&first, &last);
+  if (last - first + 1 > b->cap) {
+    b->cap = last - first + 1;
+    b->pos = realloc(b->pos, sizeof(size_t) * b->cap);
+    b->len = realloc(b->len, sizeof(size_t) * b->cap);
+    if (b->pos == NULL || b->len == NULL)
+      die("realloc");
+  }
+
+  for (row = first; row <= last && editorRowExists(row); row++) {
+    size_t len, cx, start = editorRowOffset(row);
+    const char *chars = editorRowChars(row, &len);
+
+    cx = row == E.cy ? E.cx : editorRowRxToCx(row, chars, len, rx);
+    if (cx == (size_t)-1)
+      continue;
+    /* the column falls inside a tab or a wide character here */
+    if (row != E.cy && editorRowCxToRx(row, chars, len, cx) != rx)
+      continue;
+    if (dir < 0 && cx == 0)
+      continue;
+    if (dir > 0 && cx == len)
+      continue;
+
+    /* ASCII around the cursor is one byte a character, like everywhere */
+    b->pos[n] = start + cx;
+    b->len[n] = 0;
+    if (dir < 0) {
+      b->len[n] = !(chars[cx - 1] & 0x80) ? 1
+                                          : cx - editorGlyphStart(row, cx - 1);
+      b->pos[n] -= b->len[n];
+    } else if (dir > 0) {
+      b->len[n] = cx + 1 == len || !(chars[cx + 1] & 0x80)
+                      ? 1
+                      : editorGlyphEnd(row, cx) - cx;
+    }
+    n++;
+  }
+  return n;
+}
+
+/* s goes in at every cursor */
+void editorBlockInsert(const char *s, size_t len) {
+  size_t n = editorBlockCollect(0);
+
+  if (n == 0)
+    return;
+  ptInsertAt(E.block.pos, n, s, len);
+  E.cx += len;
+  E.dirty++;
+}
+
+/* backspace (dir < 0) or delete (dir > 0) at every cursor */
+void editorBlockDelete(int dir) {
+  size_t n, i, start = editorRowOffset(E.cy);
+
+  n = editorBlockCollect(dir);
+  if (n == 0)
+    return;
+
+  /* the cursor moves back over what it deleted, if it had anything to */
+  for (i = 0; i < n; i++) {
+    if (dir < 0 && E.block.pos[i] + E.block.len[i] == start + E.cx)
+      E.cx -= E.block.len[i];
+  }
+  ptDeleteAt(E.block.pos, E.block.len, n);
+  E.dirty++;
+}
+
+/* what a key does to the column; 0 if editorProcessKeypress() has to see it */
+int editorBlockKey(int c) {
+  char buf[4];
+
+  switch (c) {
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+    editorBlockDelete(-1);
+    return 1;
+  case DEL_KEY:
+    editorBlockDelete(1);
+    return 1;
+  case '\x1b':
+    editorBlockStop();
+    editorSetStatusMessage("");
+    return 1;
+
+  /* moving about keeps the column, and so does ^B, which puts it away */
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case PAGE_UP:
+  case PAGE_DOWN:
+  case HOME_KEY:
+  case END_KEY:
+  case CTRL_KEY('b'):
+  case CTRL_KEY('g'):
+  case CTRL_KEY('l'):
+  case CTRL_KEY('q'):
+  case CTRL_KEY('w'):
+    return 0;
+
+  default:
+    if (c <= 0x10ffff && (c == '\t' || c >= 0x80 || !iscntrl(c))) {
+      editorBlockInsert(buf, utf8Encode(c, buf));
+      return 1;
+    }
+    editorBlockStop();
+    return 0;
+  }
+}
+
+/*** file i/o ***/
+
+/* name in ~/.cache/kilo, creating that if need be */
+char *editorCachePath(const char *name) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[4096], *path;
+
+  if (cache && cache[0])
+    snprintf(dir, sizeof(dir), "%s/kilo", cache);
+  else if (home && home[0])
+    snprintf(dir, sizeof(dir), "%s/.cache/kilo", home);
+  else
+    return NULL;
+
+  /* the parent of a $XDG_CACHE_HOME/kilo may be missing too */
+  if (mkdir(dir, 0700) == -1 && errno == ENOENT) {
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+    mkdir(dir, 0700);
+  }
+
+  path = malloc(strlen(dir) + strlen(name) + 2);
+  if (path == NULL)
+    die("malloc");
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+/* the sidecar for the file st describes */
+char *sidecarPath(struct stat *st) {
+  char name[64];
+
+  snprintf(name, sizeof(name), "%llx-%llx.idx",
+           (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+  return editorCachePath(name);
+}
+
+long statMtimeNsec(struct stat *st) {
+#ifdef __APPLE__
+  return st->st_mtimespec.tv_nsec;
+#else
+  return st->st_mtim.tv_nsec;
+#endif
+}
+
+/* fill in what a sidecar for the file st describes has to say about it */
+void sidecarKey(struct sidecarHeader *h, struct stat *st) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "KILOIDX", 8);
+  h->version = 2;
+  h->wordsize = sizeof(size_t);
+  h->dev = st->st_dev;
+  h->ino = st->st_ino;
+  h->size = st->st_size;
+  h->mtime = st->st_mtime;
+  h->mtime_nsec = statMtimeNsec(st);
+}
+
+/* the same for the open file, and where its sidecar is */
+void editorSidecarKey(struct stat *st) {
+  sidecarKey(&E.sidecar.hdr, st);
+
+  free(E.sidecar.path);
+  E.sidecar.path = NULL;
+
+  /* a file we follow keeps changing under the index */
+  if (st->st_size >= KILO_SIDECAR_MIN && !E.follow.enabled)
+    E.sidecar.path = sidecarPath(st);
+}
+
+/*
+ * Newline offsets that aren't in order, or point past the end of the file,
+ * would send every lookup in the index astray.
+ */
+int sidecarCheckOffsets(const size_t *nl, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (nl[i] >= E.mapsize || (i && nl[i] <= nl[i - 1]))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * the 64 bit words in each bucket's bitmap, for a file of size bytes: one
+ * bit per search chunk. 0 if it has too many chunks to index.
+ */
+size_t sidecarTriWords(size_t size) {
+  size_t chunks = (size + KILO_SEARCH_CHUNK - 1) / KILO_SEARCH_CHUNK;
+
+  return chunks > KILO_TRIGRAM_MAX_CHUNKS ? 0 : (chunks + 63) / 64;
+}
+
+/*
+ * Use the sidecar open on fd if it's about this version of the open file,
+ * whether it's ours (see below) or the index server's. Either may have been
+ * left corrupt or been put there by someone else, so everything in it is
+ * checked before we go by it: every offset, and that the bitmaps are the
+ * size this file's would be.
+ */
+int editorMapSidecar(int fd) {
+  struct sidecar *sc = &E.sidecar;
+  struct sidecarHeader *want = &sc->hdr, *h;
+  struct stat st;
+  void *map;
+  int syntax = E.syntax ? (int)(E.syntax - HLDB) + 1 : 0;
+
+  uint64_t size, words = sidecarTriWords(E.mapsize);
+
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*h))
+    return 0;
+  size = st.st_size;
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return 0;
+
+  h = map;
+  if (memcmp(h->magic, want->magic, 8) || h->version != want->version ||
+      h->wordsize != want->wordsize || h->dev != want->dev ||
+      h->ino != want->ino || h->size != want->size ||
+      h->mtime != want->mtime || h->mtime_nsec != want->mtime_nsec ||
+      h->nloff % 8 || h->nloff > size ||
+      h->count > (size - h->nloff) / sizeof(size_t) ||
+      (h->trioff &&
+       (h->trioff % 8 || h->trioff > size ||
+        h->trichunk != KILO_SEARCH_CHUNK || words == 0 ||
+        h->triwords != words ||
+        h->tribytes != (uint64_t)KILO_TRIGRAM_BUCKETS * words * 8 ||
+        h->tribytes > size - h->trioff)) ||
+      (h->hloff && (h->hloff > size || h->count > size - h->hloff)) ||
+      !sidecarCheckOffsets((const size_t *)((char *)map + h->nloff),
+                           h->count)) {
+    munmap(map, size);
+    return 0;
+  }
+
+  if (!E.idx.mapped)
+    free(E.idx.nl);
+  E.idx.nl = (size_t *)((char *)map + h->nloff);
+  E.idx.count = E.idx.cap = h->count;
+  E.idx.scanned = E.mapsize;
+  E.idx.mapped = 1;
+
+  sc->map = map;
+  sc->mapsize = size;
+  if (h->trioff) {
+    sc->tri = (const uint64_t *)((char *)map + h->trioff);
+    sc->triwords = h->triwords;
+  }
+
+  /* row end states are only any use while the document is the whole file */
+  if (h->hloff && h->hlsyntax == (uint64_t)syntax && syntax && E.pt &&
+      !E.pt->left && !E.pt->right && E.pt->p.buf == PIECE_ORIG &&
+      E.pt->p.off == 0 && E.pt->p.len == E.mapsize) {
+    E.hl.shared = (const unsigned char *)map + h->hloff;
+    E.hl.sharedrows = h->count;
+    E.hl.sharedsyntax = E.syntax;
+    E.hl.sharedversion = E.version;
+  }
+  return 1;
+}
+
+/*
+ * Use the sidecar of the file we just opened if there is one and it's still
+ * about this version of the file. Anything wrong with it and we just index
+ * the file the normal way, and write a new one when that's done.
+ */
+int editorLoadSidecar(void) {
+  int fd, ok;
+
+  if (E.sidecar.path == NULL || (fd = open(E.sidecar.path, O_RDONLY)) == -1)
+    return 0;
+  ok = editorMapSidecar(fd);
+  close(fd);
+  return ok;
+}
+
+/* which of the KILO_TRIGRAM_BUCKETS the three bytes at p go in */
+static inline unsigned trigramBucket(const char *p) {
+  uint32_t t = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 |
+               (unsigned char)p[2];
+  return (t * 2654435761u) >> 16;
+}
+
+int sidecarWriteAll(FILE *fp, const void *p, size_t len) {
+  return fwrite(p, 1, len, fp) == len ? 0 : -1;
+}
+
+/*
+ * Room for the trigram bitmaps of a file of size bytes, *words 64 bit words
+ * for each bucket. NULL if the file has too many chunks for them.
+ */
+uint64_t *sidecarTrigramsAlloc(size_t size, size_t *words) {
+  if ((*words = sidecarTriWords(size)) == 0)
+    return NULL;
+  return calloc((size_t)KILO_TRIGRAM_BUCKETS * *words, sizeof(uint64_t));
+}
+
+/*
+ * Set the bit of its chunk for every trigram that starts in the len bytes at
+ * p, which are at base in the file. The last two bytes only end trigrams, so
+ * going through a file a piece at a time, each piece has to run two bytes
+ * into the next. -1 if *cancel got set.
+ */
+int sidecarTrigrams(uint64_t *tri, size_t words, const char *p, size_t len,
+                    size_t base, const int *cancel) {
+  size_t i;
+
+  for (i = 0; i + 2 < len; i++) {
+    size_t c = (base + i) / KILO_SEARCH_CHUNK;
+
+    if ((base + i) % (1 << 20) == 0 &&
+        __atomic_load_n(cancel, __ATOMIC_RELAXED))
+      return -1;
+    tri[trigramBucket(p + i) * words + c / 64] |= 1ULL << (c % 64);
+  }
+  return 0;
+}
+
+/* write len bytes at p to fp at off, padding with zeros from *at up to it */
+int sidecarWriteAt(FILE *fp, uint64_t *at, uint64_t off, const void *p,
+                   size_t len) {
+  static const char zeros[8];
+
+  if (off - *at > sizeof(zeros) ||
+      sidecarWriteAll(fp, zeros, off - *at) == -1 ||
+      sidecarWriteAll(fp, p, len) == -1)
+    return -1;
+  *at = off + len;
+  return 0;
+}
+
+/*
+ * Write a sidecar to fp: *hp with the offsets filled in, the count newline
+ * offsets at nl, then the trigram bitmaps if tri isn't NULL (words to a
+ * bucket), then the end state of every row if hl isn't NULL.
+ */
+int sidecarWrite(FILE *fp, struct sidecarHeader *hp, const size_t *nl,
+                 size_t count, const uint64_t *tri, size_t words,
+                 const unsigned char *hl) {
+  struct sidecarHeader h = *hp;
+  uint64_t at = 0, end;
+
+  /* the offsets are size_t, the bitmaps after them 64 bit words */
+  h.count = count;
+  h.nloff = (sizeof(h) + 7) & ~7ULL;
+  end = h.nloff + h.count * sizeof(size_t);
+  h.trioff = h.tribytes = h.triwords = h.trichunk = 0;
+  if (tri) {
+    h.triwords = words;
+    h.trichunk = KILO_SEARCH_CHUNK;
+    h.tribytes = (uint64_t)KILO_TRIGRAM_BUCKETS * words * 8;
+    h.trioff = (end + 7) & ~7ULL;
+    end = h.trioff + h.tribytes;
+  }
+  h.hloff = hl ? end : 0;
+  if (hl == NULL)
+    h.hlsyntax = 0;
+
+  *hp = h;
+  if (sidecarWriteAt(fp, &at, 0, &h, sizeof(h)) == -1 ||
+      sidecarWriteAt(fp, &at, h.nloff, nl, h.count * sizeof(size_t)) == -1 ||
+      (tri && sidecarWriteAt(fp, &at, h.trioff, tri, h.tribytes) == -1) ||
+      (hl && sidecarWriteAt(fp, &at, h.hloff, hl, h.count) == -1))
+    return -1;
+  return 0;
+}
+
+/*
+ * Runs on its own thread once the index is complete. The newline offsets
+ * don't change any more, and the mapping only moves behind the gate, so it
+ * can read both without copying them first.
+ */
+void *sidecarWriter(void *arg) {
+  struct sidecar *sc = arg;
+  struct sidecarHeader h = sc->hdr;
+  char *tmpname = malloc(strlen(sc->path) + 16);
+  uint64_t *tri = NULL;
+  size_t words = 0, off;
+  FILE *fp = NULL;
+  int fd = -1;
+
+  if (tmpname == NULL)
+    goto done;
+  sprintf(tmpname, "%s.XXXXXX", sc->path);
+
+  if ((fd = mkstemp(tmpname)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+    goto done;
+  tri = sidecarTrigramsAlloc(E.mapsize, &words);
+  for (off = 0; tri && off < E.mapsize; off += KILO_SEARCH_CHUNK) {
+    size_t len = E.mapsize - off < KILO_SEARCH_CHUNK + 2
+                     ? E.mapsize - off
+                     : KILO_SEARCH_CHUNK + 2;
+    int cancelled;
+
+    /* a chunk at a time, so a save can move the mapping in between */
+    editorMapEnter();
+    cancelled = sidecarTrigrams(tri, words, E.map + off, len, off,
+                                &sc->cancel);
+    editorMapLeave();
+    if (cancelled) {
+      free(tri);
+      tri = NULL;
+      goto done;
+    }
+  }
+  if (sidecarWrite(fp, &h, E.idx.nl, E.idx.count, tri, words, NULL) == -1)
+    goto done;
+  if (fclose(fp) == 0 && rename(tmpname, sc->path) == 0)
+    fd = -1;
+  fp = NULL;
+
+done:
+  if (fp)
+    fclose(fp);
+  else if (fd != -1)
+    close(fd);
+  if (fd != -1)
+    unlink(tmpname);
+  free(tmpname);
+  sc->built = tri;
+  sc->triwords = tri ? words : 0;
+  __atomic_store_n(&sc->finished, 1, __ATOMIC_RELEASE);
+  write(E.wakepipe[1], "i", 1);
+  return NULL;
+}
+
+/* called when the index is complete, to save it for next time */
+void editorSaveSidecar(void) {
+  struct sidecar *sc = &E.sidecar;
+
+  if (sc->path == NULL || sc->map != NULL || sc->active || E.headless)
+    return;
+  sc->finished = 0;
+  sc->cancel = 0;
+  if (pthread_create(&sc->thread, NULL, sidecarWriter, sc) == 0)
+    sc->active = 1;
+}
+
+void editorCheckSidecar(void) {
+  struct sidecar *sc = &E.sidecar;
+
+  if (!sc->active || !__atomic_load_n(&sc->finished, __ATOMIC_ACQUIRE))
+    return;
+  pthread_join(sc->thread, NULL);
+  sc->active = 0;
+  sc->tri = sc->built;
+}
+
+/* on the way out: a sidecar that isn't finished isn't worth waiting for */
+void editorStopSidecar(void) {
+  if (!E.sidecar.active)
+    return;
+  __atomic_store_n(&E.sidecar.cancel, 1, __ATOMIC_RELAXED);
+  pthread_join(E.sidecar.thread, NULL);
+  E.sidecar.active = 0;
+}
+
+/*
+ * Opening a file just maps it into memory; the kernel pages it in as we touch
+ * it. Together with the lazy line index this keeps the time to the first frame
+ * the same whether the file is 1 KB or 10 GB.
+ */
+void editorOpen(char *filename) {
+  struct stat st;
+  int fd;
+
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  E.mapsize = 0;
+  E.fd = -1;
+
+  /* a file that doesn't exist yet is just an empty document */
+  fd = open(filename, O_RDONLY);
+  if (fd == -1 && errno != ENOENT)
+    die("open");
+  if (fd != -1) {
+    if (fstat(fd, &st) == -1)
+      die("fstat");
+
+    E.mapsize = st.st_size;
+    if (E.follow.enabled) {
+      /* editorFollowStart() reads it in */
+      E.mapsize = 0;
+    } else if (E.mapsize > 0) {
+      void *map = mmap(NULL, E.mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+        die("mmap");
+      E.map = map;
+    }
+
+    /*
+     * keep the descriptor: saving copies unchanged spans from it, and even
+     * after a save renames a new file over this one, it (and the mapping)
+     * still refers to the text our pieces point at
+     */
+    E.fd = fd;
+  }
+
+  E.idx.count = 0;
+  E.idx.scanned = 0;
+  editorSelectSyntaxHighlight();
+  if (fd != -1) {
+    editorSidecarKey(&st);
+    if (!editorLoadSidecar())
+      editorAskServer(fd, &st);
+  }
+
+  /* the document starts out as one piece: the whole file */
+  ptFree(E.pt);
+  E.pt = E.mapsize ? ptNewNode(PIECE_ORIG, 0, E.mapsize) : NULL;
+  E.dirty = 0;
+  editorUndoClear();
+  editorUndoSaved(editorUndoState());
+
+  editorHlReset();
+  editorJournalOpen(fd != -1 ? &st : NULL);
+}
+
+/* take the snapshot a save writes out: every piece, in document order */
+void editorSnapshotNode(struct pieceNode *t, struct saveSpan *spans,
+                        size_t *n) {
+  struct saveSpan *sp;
+
+  if (t == NULL)
+    return;
+  editorSnapshotNode(t->left, spans, n);
+
+  sp = &spans[(*n)++];
+  sp->len = t->p.len;
+  if (t->p.buf == PIECE_ORIG) {
+    sp->text = NULL;
+    sp->off = t->p.off;
+  } else {
+    sp->text = pieceText(&t->p);
+    sp->off = 0;
+  }
+
+  editorSnapshotNode(t->right, spans, n);
+}
+
+size_t editorCountPieces(struct pieceNode *t) {
+  return t ? 1 + editorCountPieces(t->left) + editorCountPieces(t->right) : 0;
+}
+
+void saveProgress(struct saveJob *job, size_t n) {
+  size_t before = __atomic_load_n(&job->done, __ATOMIC_RELAXED);
+  size_t after = before + n;
+
+  __atomic_store_n(&job->done, after, __ATOMIC_RELAXED);
+
+  /* wake the main loop every so often so the status bar can move */
+  if (before / KILO_SAVE_PROGRESS != after / KILO_SAVE_PROGRESS)
+    write(E.wakepipe[1], "s", 1);
+}
+
+int saveWriteAll(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Copy a span of the original file. On Linux copy_file_range() lets the
+ * kernel do it without the data passing through us at all (and on some
+ * filesystems without copying the blocks either). Everywhere else, or if
+ * the kernel won't do it for these two files, we go through the staging
+ * buffer with pread().
+ */
+int saveCopyOrig(struct saveJob *job, int in, int out, char *stage, off_t off,
+                 size_t len) {
+#ifdef __linux__
+  loff_t in_off = off;
+
+  while (len > 0) {
+    ssize_t n = copy_file_range(in, &in_off, out, NULL, len, 0);
+    if (n <= 0)
+      break;
+    len -= n;
+    if (job)
+      saveProgress(job, n);
+  }
+  if (len == 0)
+    return 0;
+  off = in_off;
+#endif
+
+  while (len > 0) {
+    size_t chunk = len < KILO_SAVE_BUF ? len : KILO_SAVE_BUF;
+    ssize_t n = pread(in, stage, chunk, off);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0 || saveWriteAll(out, stage, n) == -1)
+      return -1;
+    off += n;
+    len -= n;
+    if (job)
+      saveProgress(job, n);
+  }
+  return 0;
+}
+
+/* whether the file has an access ACL, which a new file wouldn't get */
+int saveHasAcl(const char *path) {
+#ifdef __linux__
+  return getxattr(path, "system.posix_acl_access", NULL, 0) > 0;
+#else
+  (void)path;
+  return 0;
+#endif
+}
+
+/*
+ * The gate in front of E.map and E.fd, see struct mapGate. Background readers
+ * go in with editorMapEnter() and out with editorMapLeave(); only the main
+ * thread closes it.
+ */
+void editorMapEnter(void) {
+  struct mapGate *g = &E.gate;
+
+  pthread_mutex_lock(&g->lock);
+  while (g->closed)
+    pthread_cond_wait(&g->cond, &g->lock);
+  g->readers++;
+  pthread_mutex_unlock(&g->lock);
+}
+
+void editorMapLeave(void) {
+  struct mapGate *g = &E.gate;
+
+  pthread_mutex_lock(&g->lock);
+  if (--g->readers == 0 && g->closed)
+    pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+}
+
+void editorMapClose(void) {
+  struct mapGate *g = &E.gate;
+
+  pthread_mutex_lock(&g->lock);
+  g->closed = 1;
+  while (g->readers)
+    pthread_cond_wait(&g->cond, &g->lock);
+  pthread_mutex_unlock(&g->lock);
+}
+
+void editorMapOpen(void) {
+  struct mapGate *g = &E.gate;
+
+  pthread_mutex_lock(&g->lock);
+  g->closed = 0;
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+}
+
+/* after a rename, fsync() the directory too, or the rename may not last */
+int saveSyncDir(const char *path) {
+  char *dir = strdup(path), *slash;
+  int fd, ret = -1, err;
+
+  if (dir == NULL)
+    return -1;
+  slash = strrchr(dir, '/');
+  if (slash == dir)
+    slash[1] = '\0';
+  else if (slash)
+    *slash = '\0';
+  else
+    strcpy(dir, ".");
+
+  if ((fd = open(dir, O_RDONLY)) != -1) {
+    /* some filesystems can't fsync() a directory, and don't need to */
+    ret = fsync(fd) == -1 && errno != EINVAL ? -1 : 0;
+    err = errno;
+    close(fd);
+    errno = err;
+  }
+  free(dir);
+  return ret;
+}
+
+/*
+ * The first phase of a save: write the snapshot to tmpname, next to the
+ * target, and fsync() it. It gets the old file's mode, and its owner and group
+ * if we can give it those; if we can't, it will be copied into the old file
+ * rather than renamed over it.
+ */
+int saveWriteNew(struct saveJob *job, char *stage) {
+  size_t staged = 0, i;
+  int out;
+
+  if ((out = job->staged = mkstemp(job->tmpname)) == -1)
+    return -1;
+  if (job->exists && !job->inplace && !job->pinned &&
+      fchown(out, job->uid, job->gid) == -1)
+    job->inplace = 1;
+
+  for (i = 0; i < job->numspans; i++) {
+    struct saveSpan *sp = &job->spans[i];
+
+    if (sp->text == NULL) {
+      if (staged && saveWriteAll(out, stage, staged) == -1)
+        return -1;
+      saveProgress(job, staged);
+      staged = 0;
+      if (saveCopyOrig(job, job->srcfd, out, stage, sp->off, sp->len) == -1)
+        return -1;
+      continue;
+    }
+
+    const char *p = sp->text;
+    size_t len = sp->len;
+    while (len > 0) {
+      size_t n = KILO_SAVE_BUF - staged;
+      if (n > len)
+        n = len;
+      memcpy(stage + staged, p, n);
+      staged += n;
+      p += n;
+      len -= n;
+
+      if (staged == KILO_SAVE_BUF) {
+        if (saveWriteAll(out, stage, staged) == -1)
+          return -1;
+        saveProgress(job, staged);
+        staged = 0;
+      }
+    }
+  }
+  if (staged && saveWriteAll(out, stage, staged) == -1)
+    return -1;
+  saveProgress(job, staged);
+
+  return fchmod(out, job->mode) == -1 || fsync(out) == -1 ? -1 : 0;
+}
+
+/*
+ * Before the old file is overwritten, the text our pieces point at has to be
+ * somewhere else. If it's in that very file, it's copied aside, to a file
+ * that's unlinked straight away, for the main thread to move E.map and E.fd
+ * over to (see editorSaveMoveMap()).
+ */
+int saveSetAside(struct saveJob *job, char *stage) {
+  struct stat src, dst;
+  char *name;
+  int err;
+
+  if (job->srcfd == -1 || fstat(job->srcfd, &src) == -1 ||
+      stat(job->target, &dst) == -1 || src.st_dev != dst.st_dev ||
+      src.st_ino != dst.st_ino)
+    return 0;
+
+  if ((name = malloc(strlen(job->target) + 16)) == NULL)
+    return -1;
+  sprintf(name, "%s.kilo-XXXXXX", job->target);
+  if ((job->aside = mkstemp(name)) == -1) {
+    err = errno;
+    free(name);
+    errno = err;
+    return -1;
+  }
+  unlink(name);
+  free(name);
+  return saveCopyOrig(NULL, job->srcfd, job->aside, stage, 0, job->mapsize);
+}
+
+/*
+ * The second phase: copy the new file into the old one. Once the old one is
+ * truncated, tmpname has the only whole copy of the text, so if anything
+ * goes wrong from there on it's left where it is (kept), and we say so.
+ */
+int saveCopyIn(struct saveJob *job, char *stage) {
+  int out, err;
+
+  if ((out = open(job->target, O_WRONLY | O_TRUNC)) == -1)
+    return -1;
+  job->kept = 1;
+  if (saveCopyOrig(job, job->staged, out, stage, 0, job->total) == -1 ||
+      fsync(out) == -1) {
+    err = errno;
+    close(out);
+    errno = err;
+    return -1;
+  }
+  if (close(out) == -1)
+    return -1;
+  job->kept = 0;
+  unlink(job->tmpname);
+  return 0;
+}
+
+void *saveWorker(void *arg) {
+  struct saveJob *job = arg;
+  char *stage = NULL;
+
+  /*
+   * text typed since the file was opened is small and scattered, so gather it
+   * into a page aligned staging buffer and write it out a megabyte at a time
+   */
+  if (posix_memalign((void **)&stage, 4096, KILO_SAVE_BUF) != 0) {
+    stage = NULL;
+    errno = ENOMEM;
+    goto fail;
+  }
+
+  if (job->phase == 0) {
+    if (saveWriteNew(job, stage) == -1)
+      goto fail;
+
+    /* only replace the old file once the new one is safely on disk */
+    if (!job->inplace) {
+      if (rename(job->tmpname, job->target) == -1 ||
+          saveSyncDir(job->target) == -1)
+        goto fail;
+      goto done;
+    }
+
+    if (saveSetAside(job, stage) == -1)
+      goto fail;
+    /* the main thread moves E.map off the old file, then starts phase 1 */
+    if (job->aside != -1)
+      goto done;
+    job->phase = 1;
+  }
+  if (saveCopyIn(job, stage) == -1)
+    goto fail;
+  goto done;
+
+fail:
+  job->error = errno;
+done:
+  free(stage);
+  __atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+  write(E.wakepipe[1], "s", 1);
+  return NULL;
+}
+
+void editorSave(void) {
+  struct saveJob *job = &E.save;
+  struct stat st;
+
+  if (job->active) {
+    editorSetStatusMessage("Still saving, try again when it's done");
+    return;
+  }
+
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    /* we only write plain text, which mustn't take a compressed file's place */
+    if (streamSuffix(E.filename)) {
+      editorSetStatusMessage("Not saving plain text as a %s file, pick "
+                             "another name",
+                             streamSuffix(E.filename));
+      free(E.filename);
+      E.filename = NULL;
+      return;
+    }
+    editorSelectSyntaxHighlight();
+    editorHlReset();
+  }
+
+  /*
+   * through a symlink, save to the file it points at, not over the link. The
+   * new file goes next to that, so renaming it over stays on one filesystem.
+   */
+  job->filename = strdup(E.filename);
+  job->target = realpath(E.filename, NULL);
+  if (job->target == NULL)
+    job->target = strdup(E.filename);
+  job->tmpname = job->target ? malloc(strlen(job->target) + 16) : NULL;
+  if (job->filename == NULL || job->tmpname == NULL)
+    die("malloc");
+  sprintf(job->tmpname, "%s.kilo-XXXXXX", job->target);
+
+  /*
+   * a rename would take the old file's other hard links and its ACL away
+   * from it, so those are copied into instead. (A file being followed always
+   * gets the rename: copying into it would look like a rewrite to us.)
+   */
+  job->exists = stat(job->target, &st) == 0;
+  job->mode = job->exists ? st.st_mode & 07777 : 0644;
+  job->uid = job->exists ? st.st_uid : 0;
+  job->gid = job->exists ? st.st_gid : 0;
+  job->pinned = E.follow.enabled;
+  job->inplace = job->exists && !job->pinned &&
+                 (st.st_nlink > 1 || saveHasAcl(job->target));
+  job->srcfd = E.follow.enabled ? -1 : E.fd;
+  job->map = E.map;
+  job->mapsize = E.mapsize;
+  job->staged = job->aside = -1;
+  job->phase = 0;
+  job->kept = 0;
+  job->numspans = 0;
+  job->spans = malloc(sizeof(struct saveSpan) * (editorCountPieces(E.pt) + 1));
+  if (job->spans == NULL)
+    die("malloc");
+  editorSnapshotNode(E.pt, job->spans, &job->numspans);
+
+  /*
+   * a stream's text has no file to be copied from, only the mapping, and a
+   * followed file's may not be in the file any more
+   */
+  if (job->srcfd == -1) {
+    size_t i;
+
+    for (i = 0; i < job->numspans; i++) {
+      if (job->spans[i].text == NULL)
+        job->spans[i].text = E.map + job->spans[i].off;
+    }
+  }
+
+  job->total = ptSize();
+  job->done = 0;
+  job->finished = 0;
+  job->error = 0;
+  job->dirty = E.dirty;
+  job->undostate = editorUndoState();
+  E.undo.sealed = 1;
+
+  if ((errno = pthread_create(&job->thread, NULL, saveWorker, job)) != 0) {
+    editorSetStatusMessage("Can't save! thread: %s", strerror(errno));
+    free(job->spans);
+    free(job->filename);
+    free(job->target);
+    free(job->tmpname);
+    return;
+  }
+  job->active = 1;
+  E.redraw = 1;
+}
+
+/*
+ * Move E.map and E.fd over to the copy of the old file the writer set aside,
+ * so nothing reads the old file while it's overwritten. The copy has the same
+ * bytes, and the gate keeps background readers out while they move.
+ */
+int editorSaveMoveMap(struct saveJob *job) {
+  int ret = 0;
+
+  editorMapClose();
+  if ((job->mapsize &&
+       mmap((void *)job->map, job->mapsize, PROT_READ,
+            MAP_PRIVATE | MAP_FIXED, job->aside, 0) == MAP_FAILED) ||
+      dup2(job->aside, job->srcfd) == -1)
+    ret = -1;
+  editorMapOpen();
+  return ret;
+}
+
+/* called from the main loop when the writer says something happened */
+void editorCheckSave(void) {
+  struct saveJob *job = &E.save;
+
+  if (!job->active)
+    return;
+
+  E.redraw = 1;
+  if (!__atomic_load_n(&job->finished, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_join(job->thread, NULL);
+
+  /* the new file is safely on disk: move off the old one, then copy it in */
+  if (!job->error && job->aside != -1) {
+    if (editorSaveMoveMap(job) == -1) {
+      job->error = errno;
+    } else {
+      close(job->aside);
+      job->aside = -1;
+      job->phase = 1;
+      job->done = 0;
+      job->finished = 0;
+      job->error = pthread_create(&job->thread, NULL, saveWorker, job);
+      if (job->error == 0)
+        return;
+    }
+  }
+  job->active = 0;
+
+  if (job->staged != -1)
+    close(job->staged);
+  if (job->aside != -1)
+    close(job->aside);
+  if (job->error && !job->kept)
+    unlink(job->tmpname);
+
+  if (job->kept) {
+    editorSetStatusMessage("Can't save! %s, the text is in %s",
+                           strerror(job->error), job->tmpname);
+  } else if (job->error) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->error));
+  } else {
+    editorSetStatusMessage("%zu bytes written to disk", job->total);
+    /* edits made while saving still need another save */
+    editorUndoSaved(job->undostate);
+    if (editorUndoState() == job->undostate)
+      E.dirty = 0;
+    else
+      E.dirty = E.dirty > job->dirty ? E.dirty - job->dirty : 1;
+  }
+  editorJournalSaved(job->filename, job->error == 0);
+
+  free(job->spans);
+  free(job->filename);
+  free(job->target);
+  free(job->tmpname);
+}
+
+/* on the way out: let a running save finish, both of its phases */
+void editorFinishSave(void) {
+  while (E.save.active) {
+    if (!__atomic_load_n(&E.save.finished, __ATOMIC_ACQUIRE))
+      poll(NULL, 0, 10);
+    editorCheckSave();
+  }
+}
+
+/* the percentage shown in the status bar while a save is running */
+int editorSavePercent(void) {
+  size_t done = __atomic_load_n(&E.save.done, __ATOMIC_RELAXED);
+
+  return E.save.total ? (int)(done * 100 / E.save.total) : 100;
+}
+
+/*** journal ***/
+
+/*
+ * So that a dropped connection doesn't take the changes since the last save
+ * with it, every change is also logged to a swap file in ~/.cache/kilo, named
+ * after the file's full path. Logging only appends a record to a buffer; a
+ * timer hands what piled up over KILO_JOURNAL_MS to a writer thread, which
+ * appends it as one batch and fdatasync()s once for all of it. While it does,
+ * the next batch piles up behind it, so neither typing nor the disk ever
+ * waits for the other.
+ *
+ * A record is an insert, a delete, or an insert of a piece of the original
+ * file, which only needs its offset: undoing the deletion of a gigabyte
+ * doesn't write a gigabyte. Each batch carries a checksum, so a batch the
+ * crash cut short is simply where the replay stops.
+ *
+ * Opening a file with a swap file that was written against this very version
+ * of it (same inode, size and mtime) replays the changes onto the mapping,
+ * and they're back, unsaved. A swap file for some other version is moved
+ * aside rather than thrown away, in case it's the only copy of someone's
+ * work. A save starts the swap file over against the new file, with just the
+ * changes made while it was being written; quitting removes it. Files that
+ * are followed, and benchmarks, aren't journaled.
+ *
+ * The swap file is flock()ed for as long as the file is open, so a second
+ * kilo editing the same file neither replays the first one's changes nor
+ * writes its own in between them: it just goes without a swap file.
+ */
+struct journalRecord {
+  char op; /* 'i'nsert text, 'o'riginal file piece, 'd'elete */
+  uint64_t pos, len, off; /* off is where in the original file, for 'o' */
+};
+
+#define JOURNAL_RECORD 25 /* bytes a record takes before its text */
+
+/* FNV-1a, enough to tell a torn write */
+uint32_t journalSum(const char *p, size_t len) {
+  uint32_t h = 2166136261u;
+
+  while (len--)
+    h = (h ^ (unsigned char)*p++) * 16777619u;
+  return h;
+}
+
+/* what the swap file for a file st describes (NULL: a new one) must say */
+void journalKey(struct journalHeader *h, struct stat *st) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "KILOSWP", 8);
+  h->version = 1;
+  h->wordsize = sizeof(size_t);
+  if (st) {
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime = st->st_mtime;
+    h->mtime_nsec = statMtimeNsec(st);
+  }
+}
+
+/* the swap file of filename, named after its full path */
+char *journalPath(const char *filename) {
+  char cwd[4096], name[32];
+  uint64_t h = 14695981039346656037ULL;
+  const char *p;
+
+  if (filename[0] != '/') {
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+      return NULL;
+    for (p = cwd; *p; p++)
+      h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ '/') * 1099511628211ULL;
+  }
+  for (p = filename; *p; p++)
+    h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+
+  snprintf(name, sizeof(name), "%016llx.swp", (unsigned long long)h);
+  return editorCachePath(name);
+}
+
+int journalWriteAll(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int journalWriteBatch(int fd, const struct abuf *ab) {
+  struct journalBatch b;
+
+  b.len = ab->len;
+  b.sum = journalSum(ab->b, ab->len);
+  if (journalWriteAll(fd, (const char *)&b, sizeof(b)) == -1)
+    return -1;
+  return journalWriteAll(fd, ab->b, ab->len);
+}
+
+/*
+ * write a batch and sync it, or leave the swap file as it was: a batch cut
+ * short would end the replay there, and drop every batch after it too
+ */
+int journalAppend(int fd, const struct abuf *ab) {
+  off_t end = lseek(fd, 0, SEEK_CUR);
+  int saved_errno;
+
+  if (journalWriteBatch(fd, ab) == 0 && fdatasync(fd) == 0)
+    return 0;
+  saved_errno = errno;
+  if (end != -1 && ftruncate(fd, end) == 0)
+    lseek(fd, end, SEEK_SET);
+  errno = saved_errno;
+  return -1;
+}
+
+/* group commit: every batch that piled up goes out with a single sync */
+void *journalWriter(void *arg) {
+  struct journal *j = arg;
+
+  pthread_mutex_lock(&j->lock);
+  for (;;) {
+    int fd, error = 0;
+
+    while (!j->busy && !j->quit)
+      pthread_cond_wait(&j->wake, &j->lock);
+    if (!j->busy)
+      break;
+    fd = j->fd;
+    pthread_mutex_unlock(&j->lock);
+
+    /* a batch that didn't make it stays, to go out with the next one */
+    if (journalAppend(fd, &j->batch) == -1)
+      error = errno;
+
+    pthread_mutex_lock(&j->lock);
+    if (!error)
+      j->batch.len = 0;
+    j->error = error;
+    j->busy = 0;
+    pthread_cond_broadcast(&j->wake);
+  }
+  pthread_mutex_unlock(&j->lock);
+  return NULL;
+}
+
+void journalStartWriter(struct journal *j) {
+  if (j->started)
+    return;
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->wake, NULL);
+  j->busy = j->quit = 0;
+  if (pthread_create(&j->thread, NULL, journalWriter, j) != 0)
+    die("pthread_create");
+  j->started = 1;
+}
+
+/* wait for the batch being written, if any; the file is ours after that */
+void journalIdle(struct journal *j) {
+  if (!j->started)
+    return;
+  pthread_mutex_lock(&j->lock);
+  while (j->busy)
+    pthread_cond_wait(&j->wake, &j->lock);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void journalStopWriter(struct journal *j) {
+  if (!j->started)
+    return;
+  pthread_mutex_lock(&j->lock);
+  j->quit = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+  pthread_mutex_destroy(&j->lock);
+  pthread_cond_destroy(&j->wake);
+  j->started = 0;
+}
+
+/* the timer: hand what's pending to the writer, unless it's still busy */
+void editorJournalFlush(void) {
+  struct journal *j = &E.journal;
+  struct abuf t;
+  int error;
+
+  j->armed = 0;
+  if (!j->live)
+    return;
+
+  pthread_mutex_lock(&j->lock);
+  if (j->busy || (j->pending.len == 0 && j->batch.len == 0)) {
+    pthread_mutex_unlock(&j->lock);
+    if (j->busy) {
+      j->armed = 1;
+      editorAddTimer(KILO_JOURNAL_MS, editorJournalFlush);
+    }
+    return;
+  }
+  error = j->error;
+  if (error) {
+    /* the last batch is still here: it goes again, with what came since */
+    editorSetStatusMessage("Can't write swap file: %s", strerror(j->error));
+    abAppend(&j->batch, j->pending.b, j->pending.len);
+    j->pending.len = 0;
+  } else {
+    t = j->batch;
+    j->batch = j->pending;
+    j->pending = t;
+  }
+  j->busy = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+
+  /* and if it fails again, try again in a while without waiting for keys */
+  j->armed = 1;
+  editorAddTimer(error ? KILO_JOURNAL_RETRY_MS : KILO_JOURNAL_MS,
+                 editorJournalFlush);
+}
+
+/*
+ * open the swap file at path, creating it if need be, and lock it. -1 with
+ * errno EWOULDBLOCK if another kilo has it.
+ */
+int journalLock(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600), saved_errno;
+
+  if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == 0)
+    return fd;
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+/* give up on journaling, telling the user why */
+void journalFail(struct journal *j, const char *fmt, const char *what) {
+  editorSetStatusMessage(fmt, what);
+  if (j->fd != -1)
+    close(j->fd);
+  j->fd = -1;
+  j->live = 0;
+  free(j->path);
+  j->path = NULL;
+}
+
+/* the first change since opening or saving starts the swap file over */
+int journalStart(struct journal *j) {
+  if (j->live)
+    return 0;
+
+  if (ftruncate(j->fd, 0) == -1 || lseek(j->fd, 0, SEEK_SET) == -1 ||
+      journalWriteAll(j->fd, (const char *)&j->hdr, sizeof(j->hdr)) == -1) {
+    int saved_errno = errno;
+
+    unlink(j->path);
+    journalFail(j, "Can't write swap file: %s", strerror(saved_errno));
+    return -1;
+  }
+  j->live = 1;
+  journalStartWriter(j);
+  return 0;
+}
+
+void journalLog(char op, size_t pos, size_t len, size_t off, const char *s) {
+  struct journal *j = &E.journal;
+  char rec[JOURNAL_RECORD];
+  uint64_t v[3];
+
+  rec[0] = op;
+  v[0] = pos;
+  v[1] = len;
+  v[2] = off;
+  memcpy(rec + 1, v, sizeof(v));
+
+  abAppend(&j->pending, rec, sizeof(rec));
+  if (s)
+    abAppend(&j->pending, s, len);
+  if (E.save.active) {
+    abAppend(&j->saving, rec, sizeof(rec));
+    if (s)
+      abAppend(&j->saving, s, len);
+  }
+
+  if (!j->armed) {
+    j->armed = 1;
+    editorAddTimer(KILO_JOURNAL_MS, editorJournalFlush);
+  }
+}
+
+/* called by ptInsertPieces(), for the pieces that went in at pos */
+void editorJournalInsert(size_t pos, const struct piece *p, size_t n) {
+  struct journal *j = &E.journal;
+  size_t i, k;
+
+  if (j->path == NULL || j->replaying || journalStart(j) == -1)
+    return;
+
+  for (i = 0; i < n; pos += p[i++].len) {
+    /*
+     * a save in progress starts the swap file over against the file it
+     * writes, which isn't where these pieces are from
+     */
+    if (p[i].buf == PIECE_ORIG && j->orig && !E.save.active) {
+      journalLog('o', pos, p[i].len, p[i].off, NULL);
+      continue;
+    }
+    for (k = 0; k < p[i].len; k += KILO_JOURNAL_CHUNK) {
+      size_t len = p[i].len - k;
+
+      if (len > KILO_JOURNAL_CHUNK)
+        len = KILO_JOURNAL_CHUNK;
+      journalLog('i', pos + k, len, 0, pieceText(&p[i]) + k);
+    }
+  }
+}
+
+/* called by ptCut() */
+void editorJournalDelete(size_t pos, size_t len) {
+  struct journal *j = &E.journal;
+
+  if (j->path == NULL || j->replaying || journalStart(j) == -1)
+    return;
+  journalLog('d', pos, len, 0, NULL);
+}
+
+/* apply one record of a swap file; -1 if it makes no sense */
+int journalReplayRecord(const char *p, size_t avail, size_t *used) {
+  struct journalRecord r;
+  uint64_t v[3];
+  size_t size = ptSize();
+
+  if (avail < JOURNAL_RECORD)
+    return -1;
+  r.op = p[0];
+  memcpy(v, p + 1, sizeof(v));
+  r.pos = v[0];
+  r.len = v[1];
+  r.off = v[2];
+  *used = JOURNAL_RECORD;
+  if (r.pos > size)
+    return -1;
+
+  switch (r.op) {
+  case 'i':
+    if (r.len > avail - JOURNAL_RECORD)
+      return -1;
+    ptInsert(r.pos, p + JOURNAL_RECORD, r.len);
+    *used += r.len;
+    return 0;
+  case 'o': {
+    struct piece pc;
+
+    if (r.off > E.mapsize || r.len > E.mapsize - r.off)
+      return -1;
+    pc.buf = PIECE_ORIG;
+    pc.off = r.off;
+    pc.len = r.len;
+    pc.lf = pieceCountLF(PIECE_ORIG, r.off, r.len);
+    ptInsertPieces(r.pos, &pc, 1);
+    return 0;
+  }
+  case 'd':
+    if (r.len > size - r.pos)
+      return -1;
+    ptDelete(r.pos, r.len);
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Replay the swap file left behind by an editor that didn't get to quit. It
+ * stays, minus any torn batch at its end, and new changes go after it.
+ */
+void journalReplay(struct journal *j) {
+  struct journalHeader *h;
+  struct stat st;
+  size_t off, end, changes = 0;
+  char *map, *aside;
+  int fd = j->fd, bad = 0;
+
+  if (fstat(fd, &st) == -1 || st.st_size == 0)
+    return;
+  map = (size_t)st.st_size < sizeof(*h)
+            ? MAP_FAILED
+            : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  h = (struct journalHeader *)map;
+  if (map == MAP_FAILED || memcmp(h, &j->hdr, sizeof(*h)) != 0) {
+    /*
+     * the file changed since, the offsets would make no sense. But the
+     * changes may be all there is of someone's work, so rather than starting
+     * over on top of them, move them out of the way.
+     */
+    if (map != MAP_FAILED)
+      munmap(map, st.st_size);
+    aside = malloc(strlen(j->path) + 32);
+    if (aside == NULL)
+      die("malloc");
+    sprintf(aside, "%s.%lld", j->path, (long long)time(NULL));
+    if (rename(j->path, aside) == -1) {
+      journalFail(j, "Can't move an out of date swap file aside: %s",
+                  strerror(errno));
+    } else {
+      close(j->fd);
+      if ((j->fd = journalLock(j->path)) == -1)
+        journalFail(j, "Can't open swap file: %s", strerror(errno));
+      else
+        editorSetStatusMessage("Kept an out of date swap file as %s",
+                               strrchr(aside, '/') ? strrchr(aside, '/') + 1
+                                                   : aside);
+    }
+    free(aside);
+    return;
+  }
+
+  j->replaying = 1;
+  off = end = sizeof(*h);
+  while (!bad && off + sizeof(struct journalBatch) <= (size_t)st.st_size) {
+    struct journalBatch b;
+    const char *p = map + off + sizeof(b);
+    size_t at = 0, used;
+
+    memcpy(&b, map + off, sizeof(b));
+    if (b.len > st.st_size - off - sizeof(b) || journalSum(p, b.len) != b.sum)
+      break;
+    while (at < b.len) {
+      if (journalReplayRecord(p + at, b.len - at, &used) == -1) {
+        bad = 1;
+        break;
+      }
+      at += used;
+      changes++;
+    }
+    off += sizeof(b) + b.len;
+    if (!bad)
+      end = off;
+  }
+  j->replaying = 0;
+  munmap(map, st.st_size);
+
+  /* nothing recovered: the swap file starts over with the first change */
+  if (changes == 0 || ftruncate(fd, end) == -1 ||
+      lseek(fd, end, SEEK_SET) == -1)
+    return;
+  j->live = 1;
+  journalStartWriter(j);
+
+  /* the recovered changes are what there is to undo back to */
+  editorUndoClear();
+  E.dirty += changes;
+  editorSetStatusMessage("Recovered %zu changes from the swap file%s. "
+                         "^S keeps them",
+                         changes, bad ? ", some were broken" : "");
+}
+
+/* called by editorOpen(), st describes the file if there is one */
+void editorJournalOpen(struct stat *st) {
+  struct journal *j = &E.journal;
+
+  free(j->path);
+  j->path = NULL;
+  j->fd = -1;
+  j->live = 0;
+  j->main = pthread_self();
+  if (E.follow.enabled || E.headless || E.filename == NULL)
+    return;
+
+  j->path = journalPath(E.filename);
+  journalKey(&j->hdr, st);
+  j->orig = st != NULL;
+  if (j->path == NULL)
+    return;
+  if ((j->fd = journalLock(j->path)) == -1) {
+    if (errno == EWOULDBLOCK)
+      journalFail(j, "%s is open in another kilo, it has no swap file",
+                  E.filename);
+    else
+      journalFail(j, "Can't open swap file: %s", strerror(errno));
+    return;
+  }
+  journalReplay(j);
+}
+
+/*
+ * A save of filename finished. The file now has every change made before
+ * its snapshot, so the swap file starts over with just the ones since, which
+ * from now on apply to the file we just wrote.
+ */
+void editorJournalSaved(const char *filename, int ok) {
+  struct journal *j = &E.journal;
+  struct stat st;
+  char *path, *tmpname;
+  int fd, saved_errno;
+
+  if (!ok || E.follow.enabled || E.headless) {
+    j->saving.len = 0;
+    return;
+  }
+
+  /* what the writer had, and what's pending, is all in the file now */
+  journalIdle(j);
+  j->pending.len = 0;
+  j->batch.len = 0;
+  j->error = 0;
+  journalKey(&j->hdr, stat(filename, &st) == 0 ? &st : NULL);
+  j->orig = 0;
+
+  /* saved under another name: that name's swap file has to be ours first */
+  path = journalPath(filename);
+  if (path == NULL || j->path == NULL || strcmp(path, j->path) != 0) {
+    fd = path ? journalLock(path) : -1;
+    saved_errno = errno;
+
+    /* the old name's is done with */
+    if (j->path)
+      unlink(j->path);
+    if (fd == -1) {
+      free(path);
+      j->saving.len = 0;
+      journalFail(j,
+                  saved_errno == EWOULDBLOCK
+                      ? "%s is open in another kilo, it has no swap file"
+                      : "Can't open a swap file for %s",
+                  filename);
+      return;
+    }
+    if (j->fd != -1)
+      close(j->fd);
+    free(j->path);
+    j->path = path;
+    j->fd = fd;
+  } else {
+    free(path);
+  }
+  j->live = 0;
+
+  /*
+   * The changes since go into a new swap file that replaces the old one
+   * whole, locked before anyone else can see it. If there are none, or that
+   * fails, the old one is emptied: it describes the file as it was before.
+   */
+  fd = -1;
+  tmpname = NULL;
+  if (j->saving.len > 0) {
+    tmpname = malloc(strlen(j->path) + 8);
+    if (tmpname == NULL)
+      die("malloc");
+    sprintf(tmpname, "%s.XXXXXX", j->path);
+    fd = mkstemp(tmpname);
+    if (fd != -1 &&
+        (flock(fd, LOCK_EX | LOCK_NB) == -1 ||
+         journalWriteAll(fd, (const char *)&j->hdr, sizeof(j->hdr)) == -1 ||
+         journalAppend(fd, &j->saving) == -1 ||
+         rename(tmpname, j->path) == -1)) {
+      saved_errno = errno;
+      close(fd);
+      unlink(tmpname);
+      fd = -1;
+      errno = saved_errno;
+    }
+    if (fd == -1)
+      editorSetStatusMessage("Can't write swap file: %s", strerror(errno));
+  }
+  if (fd != -1) {
+    close(j->fd);
+    j->fd = fd;
+    j->live = 1;
+    journalStartWriter(j);
+  } else if (ftruncate(j->fd, 0) == -1) {
+    journalFail(j, "Can't write swap file: %s", strerror(errno));
+  }
+  free(tmpname);
+  j->saving.len = 0;
+}
+
+/*
+ * on the way out of a crash: write what's pending and wait for it. Only the
+ * main thread logs changes, so only it can know what's pending; a background
+ * thread that dies leaves the swap file as the writer last left it.
+ */
+void editorJournalSync(void) {
+  struct journal *j = &E.journal;
+  static int syncing;
+
+  if (!j->live || !j->started || syncing ||
+      !pthread_equal(pthread_self(), j->main))
+    return;
+  syncing = 1;
+  journalIdle(j);
+  if (j->batch.len && journalAppend(j->fd, &j->batch) == 0)
+    j->batch.len = 0;
+  if (j->batch.len == 0 && j->pending.len)
+    journalAppend(j->fd, &j->pending);
+  j->pending.len = 0;
+  syncing = 0;
+}
+
+/* quitting on purpose: whatever wasn't saved was meant to go */
+void editorJournalDiscard(void) {
+  struct journal *j = &E.journal;
+
+  journalStopWriter(j);
+  if (j->fd != -1) {
+    /* still holding the lock, so it can't be anyone else's yet */
+    unlink(j->path);
+    close(j->fd);
+    j->fd = -1;
+    j->live = 0;
+  }
+}
+
+/*** server ***/
+
+/*
+ * On a shared machine everyone who opens the same big log would index it
+ * again, into memory of their own. kilo --serve [SOCKET] runs a daemon that
+ * does that once per version of a file, for everyone: it writes the file's
+ * sidecar into a temporary file and keeps that open, and an editor started
+ * with KILO_SERVER=SOCKET gets a read-only descriptor of it and maps it just
+ * like a sidecar of its own. All of them share the same pages, those of the
+ * file itself as well since they're all mapping it, and nothing else ever
+ * goes over the socket: each editor draws its own screen from its mapping.
+ *
+ * The sidecar the daemon writes also has the lexer state at the end of every
+ * row, for the syntax the editor asked for, so nobody has to lex the file to
+ * draw its end either. That is everything about a file that costs a pass over
+ * it. What is left is per editor and cheap: rendering a screenful of rows
+ * from the mapping takes less than describing the difference from the last
+ * one would, and a thin client would have to wait for a round trip on every
+ * key. So nothing per frame goes over the socket, and there are no viewport
+ * diffs to send.
+ *
+ * To ask for an index the editor sends the daemon its own descriptor of the
+ * file, which proves that it may read it, and tells the daemon which file
+ * (and which version of it) is meant, and which syntax. An editor doesn't
+ * wait for the answer, it starts indexing lazily the usual way and switches
+ * over once the index arrives, after checking that its offsets make sense.
+ *
+ * The daemon gets to see the file and the editor maps what it sends back, so
+ * an editor only talks to one run by root, by the same user, or by whoever
+ * owns the file, see serverTrusted(). The socket is in a directory of the
+ * user's own unless they say otherwise, and only its owner may connect to it.
+ * Sharing the daemon with other users means opening the socket up to them on
+ * purpose (chmod it once it's there), not leaving it open to anyone.
+ */
+
+/* send fd, or no descriptor if it's -1, and the byte tag with it */
+int serverSendFd(int sock, int fd, char tag) {
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } u;
+  struct msghdr msg;
+  struct iovec iov;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &tag;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd != -1) {
+    struct cmsghdr *cm;
+
+    memset(&u, 0, sizeof(u));
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+/* the descriptor sent over sock, or -1, and the tag that came with it */
+int serverRecvFd(int sock, char *tag) {
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } u;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char c;
+  int fd = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = sizeof(u.buf);
+  if (recvmsg(sock, &msg, 0) != 1)
+    return -1;
+  if (tag)
+    *tag = c;
+  for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+      memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+  }
+  return fd;
+}
+
+/*
+ * Index the file open on fd into a sidecar, with the end states of its rows
+ * for syn if that isn't NULL, and open that read-only. The file is read, not
+ * mapped: whoever sent it may cut it short while we go through it, which a
+ * read just notices, where a mapping would take the whole daemon down with
+ * SIGBUS.
+ */
+int serverBuild(int fd, struct stat *st, struct sidecarHeader *key,
+                struct editorSyntax *syn) {
+  const char *tmpdir = getenv("TMPDIR");
+  struct sidecarHeader h = *key;
+  struct lineIndex idx = {NULL, 0, 0, 0, 0};
+  size_t size = st->st_size, off, words = 0, rows = 0, cap = 0;
+  unsigned char *hl = NULL;
+  char tmpname[4096], *buf;
+  uint64_t *tri;
+  FILE *fp = NULL;
+  int out, ro = -1, cancel = 0, lex = syn ? syn->start : 0;
+
+  /* each piece runs two bytes into the next, for the trigrams */
+  buf = malloc(KILO_SEARCH_CHUNK + 2);
+  tri = sidecarTrigramsAlloc(size, &words);
+  for (off = 0; buf && off < size; off += KILO_SEARCH_CHUNK) {
+    size_t want = size - off < KILO_SEARCH_CHUNK + 2 ? size - off
+                                                     : KILO_SEARCH_CHUNK + 2;
+    size_t len = want < KILO_SEARCH_CHUNK ? want : KILO_SEARCH_CHUNK;
+    ssize_t n;
+
+    while ((n = pread(fd, buf, want, off)) == -1 && errno == EINTR)
+      ;
+    if (n != (ssize_t)want)
+      goto done;
+    scanner->scan(&idx, buf, len, off);
+    if (tri)
+      sidecarTrigrams(tri, words, buf, want, off, &cancel);
+    if (syn) {
+      if (idx.count > cap) {
+        unsigned char *p = realloc(hl, idx.count);
+
+        if (p == NULL)
+          goto done;
+        hl = p;
+        cap = idx.count;
+      }
+      hlLexStates(syn, buf, len, &lex, hl, &rows);
+    }
+  }
+  if (buf == NULL)
+    goto done;
+  if (syn)
+    h.hlsyntax = syn - HLDB + 1;
+
+  snprintf(tmpname, sizeof(tmpname), "%s/kilo-idx-XXXXXX",
+           tmpdir && tmpdir[0] ? tmpdir : "/tmp");
+  if ((out = mkstemp(tmpname)) != -1) {
+    /* opened again read-only before it goes, so no editor can write it */
+    if ((fp = fdopen(out, "w")) == NULL)
+      close(out);
+    else if (sidecarWrite(fp, &h, idx.nl, idx.count, tri, words,
+                          syn ? hl : NULL) == 0 &&
+             fflush(fp) == 0)
+      ro = open(tmpname, O_RDONLY);
+    if (fp)
+      fclose(fp);
+    unlink(tmpname);
+  }
+
+done:
+  free(buf);
+  free(tri);
+  free(hl);
+  free(idx.nl);
+  return ro;
+}
+
+/*
+ * A descriptor of the sidecar for the file open on fd, built now unless we
+ * have it already or someone else is building it. The oldest one goes when
+ * there are KILO_SERVER_FILES.
+ */
+int serverLookup(int fd, struct stat *st, struct editorSyntax *syn) {
+  struct indexServer *s = &E.server;
+  struct sidecarHeader key;
+  int i, slot, built;
+
+  sidecarKey(&key, st);
+  key.hlsyntax = syn ? syn - HLDB + 1 : 0;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    for (i = 0; i < KILO_SERVER_FILES; i++) {
+      if (s->files[i].state != SERVER_EMPTY &&
+          memcmp(&s->files[i].key, &key, sizeof(key)) == 0)
+        break;
+    }
+    if (i == KILO_SERVER_FILES)
+      break;
+    if (s->files[i].state == SERVER_READY) {
+      s->files[i].used = editorNow();
+      built = dup(s->files[i].fd);
+      pthread_mutex_unlock(&s->lock);
+      return built;
+    }
+    pthread_cond_wait(&s->built, &s->lock);
+  }
+
+  for (slot = -1, i = 0; i < KILO_SERVER_FILES; i++) {
+    struct serverFile *f = &s->files[i];
+
+    if (f->state == SERVER_EMPTY) {
+      slot = i;
+      break;
+    }
+    if (f->state == SERVER_READY &&
+        (slot == -1 || f->used < s->files[slot].used))
+      slot = i;
+  }
+  if (slot != -1) {
+    if (s->files[slot].state == SERVER_READY)
+      close(s->files[slot].fd);
+    s->files[slot].key = key;
+    s->files[slot].state = SERVER_BUILDING;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  built = serverBuild(fd, st, &key, syn);
+  if (slot == -1)
+    return built;
+
+  pthread_mutex_lock(&s->lock);
+  s->files[slot].fd = built;
+  s->files[slot].used = editorNow();
+  s->files[slot].state = built == -1 ? SERVER_EMPTY : SERVER_READY;
+  pthread_cond_broadcast(&s->built);
+  pthread_mutex_unlock(&s->lock);
+  return built == -1 ? -1 : dup(built);
+}
+
+/* one editor asking for one index, the tag saying for which syntax */
+void *serverClient(void *arg) {
+  int c = (int)(intptr_t)arg, fd, out = -1;
+  unsigned char syntax = 0;
+  struct stat st;
+  struct timeval tv = {KILO_SERVER_TIMEOUT, 0};
+
+  /* a client that connects and says nothing doesn't get to keep us */
+  setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  fd = serverRecvFd(c, (char *)&syntax);
+  if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    out = serverLookup(fd, &st,
+                       syntax && syntax <= HLDB_ENTRIES ? &HLDB[syntax - 1]
+                                                        : NULL);
+  serverSendFd(c, out, 'i');
+
+  if (out != -1)
+    close(out);
+  if (fd != -1)
+    close(fd);
+  close(c);
+  return NULL;
+}
+
+int serverAddress(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return -1;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/*
+ * Where kilo --serve listens if it isn't told: somewhere only this user can
+ * get at, never a name in /tmp that anyone could have taken first. A daemon
+ * meant for everyone on the machine has to be given a socket they can reach.
+ */
+char *serverDefaultPath(void) {
+  const char *run = getenv("XDG_RUNTIME_DIR");
+  char *path;
+
+  if (run == NULL || run[0] == '\0')
+    return editorCachePath("kilo.sock");
+  path = malloc(strlen(run) + 11);
+  if (path == NULL)
+    die("malloc");
+  sprintf(path, "%s/kilo.sock", run);
+  return path;
+}
+
+/*
+ * whoever listens on the socket gets a descriptor of the file, and we map
+ * what it sends back: only talk to a daemon run by root, by us, or by the
+ * owner of the file, none of whom learns anything they couldn't read anyway
+ */
+int serverTrusted(int sock, struct stat *st) {
+  uid_t uid;
+#if defined(__linux__)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    return 0;
+  uid = cred.uid;
+#else
+  gid_t gid;
+
+  if (getpeereid(sock, &uid, &gid) == -1)
+    return 0;
+#endif
+  return uid == 0 || uid == getuid() || uid == st->st_uid;
+}
+
+/*
+ * kilo --serve [SOCKET], SOCKET defaulting to $KILO_SERVER, or kilo.sock in
+ * $XDG_RUNTIME_DIR or ~/.cache/kilo
+ */
+int editorServe(const char *path) {
+  struct indexServer *s = &E.server;
+  struct sockaddr_un addr;
+  pthread_attr_t attr;
+  int ls;
+
+  if (path == NULL)
+    path = getenv("KILO_SERVER");
+  if (path == NULL || path[0] == '\0')
+    path = serverDefaultPath();
+  if (path == NULL) {
+    fprintf(stderr, "nowhere to put the socket, give one\n");
+    return 1;
+  }
+  if (serverAddress(&addr, path) == -1) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+
+  /* don't take the socket away from a daemon that's still there */
+  if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return 1;
+  }
+  if (connect(ls, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "%s: already being served\n", path);
+    return 1;
+  }
+  close(ls);
+  unlink(path);
+
+  /* only we may connect, until whoever runs us says otherwise */
+  if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind(ls, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      chmod(path, 0600) == -1 || listen(ls, 64) == -1) {
+    perror(path);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->built, NULL);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  fprintf(stderr, "serving line indexes on %s\n", path);
+
+  for (;;) {
+    pthread_t t;
+    int c = accept(ls, NULL, NULL);
+
+    if (c == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      return 1;
+    }
+    if (pthread_create(&t, &attr, serverClient, (void *)(intptr_t)c) != 0)
+      close(c);
+  }
+}
+
+/* called by editorOpen(): ask the server for the index of the file on fd */
+void editorAskServer(int fd, struct stat *st) {
+  const char *path = getenv("KILO_SERVER");
+  struct sockaddr_un addr;
+  int s;
+
+  if (path == NULL || path[0] == '\0' || E.headless || E.follow.enabled ||
+      E.mapsize < KILO_SIDECAR_MIN || serverAddress(&addr, path) == -1)
+    return;
+
+  if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return;
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      !serverTrusted(s, st) ||
+      serverSendFd(s, fd, E.syntax ? E.syntax - HLDB + 1 : 0) == -1) {
+    close(s);
+    return;
+  }
+  E.server.fd = s;
+}
+
+/* the server answered */
+void editorCheckServer(void) {
+  int fd = serverRecvFd(E.server.fd, NULL);
+
+  close(E.server.fd);
+  E.server.fd = -1;
+  if (fd == -1)
+    return;
+
+  /*
+   * a sidecar of our own may have got there first. Otherwise this is just
+   * the lazy index finishing all at once.
+   */
+  if (!E.sidecar.active && E.sidecar.map == NULL && editorMapSidecar(fd)) {
+    ptRefreshTail();
+    E.redraw = 1;
+  }
+  close(fd);
+}
+
+/*** regex ***/
+
+/*
+ * ^R searches for a regular expression. A pattern is compiled to a Thompson
+ * NFA, which is run as a Pike VM: all the ways the pattern could go on are
+ * kept as threads, and the threads take each byte of the text together, in
+ * one pass. A search costs the length of the text times the size of the
+ * pattern at worst, so nothing like (a+)+b can make it go back over the same
+ * text again and again the way a backtracking matcher would. Matches are
+ * leftmost-first, as in Perl: of the matches starting at the same place,
+ * alternatives written first and greedy quantifiers win.
+ *
+ * The syntax is the usual one: . [] [^] ^ $ * + ? {m,n} | () and \d \w \s
+ * \D \W \S \t \n, with \ in front of anything else to take it literally. The
+ * program works on bytes, so [] and \w only know about ASCII, but . and [^...]
+ * take a whole UTF-8 character, and neither matches a newline. ^ and $ match
+ * at the start and end of a row, and matches only start where a character
+ * does.
+ */
+struct reParser {
+  struct regex *re;
+  const char *p;
+};
+
+int reEmit(struct regex *re, int op, int x, int y) {
+  if (re->n == re->cap) {
+    re->cap = re->cap ? re->cap * 2 : 64;
+    re->code = realloc(re->code, sizeof(struct reInst) * re->cap);
+    if (re->code == NULL)
+      die("realloc");
+  }
+  re->code[re->n].op = op;
+  re->code[re->n].x = x;
+  re->code[re->n].y = y;
+  return re->n++;
+}
+
+int reTargets(int op) { return op == RE_SPLIT || op == RE_JMP; }
+
+/*
+ * put an instruction in at pc, in front of the code from there on, which
+ * moves along. Jumps are to absolute pcs, so they move along with it, except
+ * that a jump from in front of pc to pc itself now goes to the new one.
+ */
+void reInsert(struct regex *re, int pc, int op, int x, int y) {
+  int i, from;
+
+  reEmit(re, RE_MATCH, 0, 0);
+  memmove(&re->code[pc + 1], &re->code[pc],
+          sizeof(struct reInst) * (re->n - 1 - pc));
+  for (i = 0; i < re->n; i++) {
+    struct reInst *in = &re->code[i];
+
+    if (i == pc || !reTargets(in->op))
+      continue;
+    from = i < pc ? pc + 1 : pc;
+    if (in->x >= from)
+      in->x++;
+    if (in->op == RE_SPLIT && in->y >= from)
+      in->y++;
+  }
+  re->code[pc].op = op;
+  re->code[pc].x = x;
+  re->code[pc].y = y;
+}
+
+/* append a copy of the code [from, to), with its jumps moved to match */
+void reCopy(struct regex *re, int from, int to) {
+  int delta = re->n - from, i;
+
+  for (i = from; i < to; i++) {
+    struct reInst in = re->code[i];
+
+    if (reTargets(in.op)) {
+      in.x += delta;
+      if (in.op == RE_SPLIT)
+        in.y += delta;
+    }
+    reEmit(re, in.op, in.x, in.y);
+  }
+}
+
+int reNewSet(struct regex *re) {
+  if (re->nsets == re->setcap) {
+    re->setcap = re->setcap ? re->setcap * 2 : 16;
+    re->sets = realloc(re->sets, sizeof(*re->sets) * re->setcap);
+    if (re->sets == NULL)
+      die("realloc");
+  }
+  memset(re->sets[re->nsets], 0, sizeof(*re->sets));
+  return re->nsets++;
+}
+
+void reSetAdd(uint64_t *set, int lo, int hi) {
+  for (; lo <= hi; lo++)
+    set[lo / 64] |= 1ULL << (lo % 64);
+}
+
+int reSetHas(const uint64_t *set, int c) { return set[c / 64] >> (c % 64) & 1; }
+
+/* \d \w \s, or 0 if c isn't one of those */
+int reClassEscape(int c, uint64_t *set) {
+  switch (c) {
+  case 'd':
+    reSetAdd(set, '0', '9');
+    return 1;
+  case 'w':
+    reSetAdd(set, '0', '9');
+    reSetAdd(set, 'a', 'z');
+    reSetAdd(set, 'A', 'Z');
+    reSetAdd(set, '_', '_');
+    return 1;
+  case 's':
+    reSetAdd(set, ' ', ' ');
+    reSetAdd(set, '\t', '\r');
+    return 1;
+  }
+  return 0;
+}
+
+int reLiteralEscape(int c) {
+  switch (c) {
+  case 't':
+    return '\t';
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  }
+  return c;
+}
+
+/*
+ * a character from set: a byte from it, and if the set is a negated one the
+ * continuation bytes of a UTF-8 character starting with that byte
+ */
+void reEmitSet(struct regex *re, int set, int negated) {
+  int cont, split;
+
+  reEmit(re, RE_BYTE, set, 0);
+  if (!negated)
+    return;
+
+  cont = reNewSet(re);
+  reSetAdd(re->sets[cont], 0x80, 0xbf);
+  split = reEmit(re, RE_SPLIT, re->n + 1, re->n + 3);
+  reEmit(re, RE_BYTE, cont, 0);
+  reEmit(re, RE_JMP, split, 0);
+}
+
+/* turn a set into everything but it, newlines and continuation bytes */
+void reNegate(uint64_t *set) {
+  int i;
+
+  for (i = 0; i < 4; i++)
+    set[i] = ~set[i];
+  set['\n' / 64] &= ~(1ULL << ('\n' % 64));
+  set[2] = 0; /* 0x80 to 0xbf */
+}
+
+int reParseClass(struct reParser *ps) {
+  struct regex *re = ps->re;
+  int set = reNewSet(re), negated = 0, lo, hi;
+
+  if (*ps->p == '^') {
+    negated = 1;
+    ps->p++;
+  }
+  if (*ps->p == ']') {
+    reSetAdd(re->sets[set], ']', ']');
+    ps->p++;
+  }
+  while (*ps->p != ']') {
+    if (*ps->p == '\0') {
+      re->error = "missing ]";
+      return -1;
+    }
+    if (*ps->p & 0x80) {
+      re->error = "only ASCII inside []";
+      return -1;
+    }
+    lo = (unsigned char)*ps->p++;
+    if (lo == '\\' && *ps->p) {
+      if (reClassEscape(*ps->p, re->sets[set])) {
+        ps->p++;
+        continue;
+      }
+      lo = reLiteralEscape((unsigned char)*ps->p++);
+    }
+    hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+      if (hi == '\\' && *ps->p)
+        hi = reLiteralEscape((unsigned char)*ps->p++);
+      if (hi & 0x80) {
+        re->error = "only ASCII inside []";
+        return -1;
+      }
+      if (hi < lo) {
+        re->error = "backwards range in []";
+        return -1;
+      }
+    }
+    reSetAdd(re->sets[set], lo, hi);
+  }
+  ps->p++;
+
+  if (negated)
+    reNegate(re->sets[set]);
+  reEmitSet(re, set, negated);
+  return 0;
+}
+
+int reParseAlt(struct reParser *ps);
+
+/* one thing a quantifier can apply to */
+int reParseAtom(struct reParser *ps) {
+  struct regex *re = ps->re;
+  int c = (unsigned char)*ps->p++, set;
+
+  switch (c) {
+  case '(':
+    if (ps->p[0] == '?' && ps->p[1] == ':')
+      ps->p += 2;
+    if (reParseAlt(ps) == -1)
+      return -1;
+    if (*ps->p != ')') {
+      re->error = "missing )";
+      return -1;
+    }
+    ps->p++;
+    return 0;
+  case '[':
+    return reParseClass(ps);
+  case '.':
+    set = reNewSet(re);
+    reNegate(re->sets[set]);
+    reEmitSet(re, set, 1);
+    return 0;
+  case '^':
+    reEmit(re, RE_BOL, 0, 0);
+    return 0;
+  case '$':
+    reEmit(re, RE_EOL, 0, 0);
+    return 0;
+  case '*':
+  case '+':
+  case '?':
+    re->error = "nothing to repeat";
+    return -1;
+  case '\\':
+    if (*ps->p == '\0') {
+      re->error = "trailing \\";
+      return -1;
+    }
+    c = (unsigned char)*ps->p++;
+    set = reNewSet(re);
+    if (reClassEscape(tolower(c), re->sets[set])) {
+      if (isupper(c))
+        reNegate(re->sets[set]);
+      reEmitSet(re, set, isupper(c));
+      return 0;
+    }
+    c = reLiteralEscape(c);
+    break;
+  default:
+    set = reNewSet(re);
+  }
+
+  /* a literal: a character typed as UTF-8 goes in whole */
+  reSetAdd(re->sets[set], c, c);
+  reEmit(re, RE_BYTE, set, 0);
+  while (c >= 0xc0 && (*ps->p & 0xc0) == 0x80) {
+    set = reNewSet(re);
+    reSetAdd(re->sets[set], (unsigned char)*ps->p, (unsigned char)*ps->p);
+    reEmit(re, RE_BYTE, set, 0);
+    ps->p++;
+  }
+  return 0;
+}
+
+/* {m}, {m,} or {m,n}, if that's what's at p */
+int reParseCount(struct reParser *ps, int *min, int *max) {
+  const char *p = ps->p + 1;
+  char *end;
+  long m, n;
+
+  if (!isdigit((unsigned char)*p))
+    return 0;
+  m = n = strtol(p, &end, 10);
+  if (*end == ',') {
+    p = end + 1;
+    n = isdigit((unsigned char)*p) ? strtol(p, &end, 10) : -1;
+    if (n == -1)
+      end = (char *)p;
+  }
+  if (*end != '}')
+    return 0;
+  if (m > KILO_RE_MAX_REPEAT || n > KILO_RE_MAX_REPEAT || (n != -1 && n < m))
+    return -1;
+  *min = m;
+  *max = n;
+  ps->p = end + 1;
+  return 1;
+}
+
+/* the atom compiled to [start, re->n), with whatever quantifiers follow it */
+int reParseRepeat(struct reParser *ps) {
+  struct regex *re = ps->re;
+  int start = re->n, end, min, max, most, i, r;
+
+  if (reParseAtom(ps) == -1)
+    return -1;
+
+  for (;;) {
+    end = re->n;
+    if (*ps->p == '*') {
+      reInsert(re, start, RE_SPLIT, start + 1, end + 2);
+      reEmit(re, RE_JMP, start, 0);
+    } else if (*ps->p == '+') {
+      reEmit(re, RE_SPLIT, start, end + 1);
+    } else if (*ps->p == '?') {
+      reInsert(re, start, RE_SPLIT, start + 1, end + 1);
+    } else if (*ps->p == '{' && (r = reParseCount(ps, &min, &max)) != 0) {
+      if (r == -1) {
+        re->error = "bad {m,n}";
+        return -1;
+      }
+      /* x{2,4} is xx followed by x?x?, and x{2,} xx followed by x* */
+      if (min == 0 && max == 0) {
+        re->n = start;
+        continue;
+      }
+      /* nested counts multiply, so see how big this gets before copying */
+      most = max == -1 ? min : max;
+      if (re->n + (long long)(end - start + 2) * (most + 1) >
+          KILO_RE_MAX_INSTS) {
+        re->error = "too big";
+        return -1;
+      }
+      for (i = 1; i < min; i++)
+        reCopy(re, start, end);
+      if (max == -1 || max > min) {
+        int from = re->n;
+
+        if (min > 0)
+          reCopy(re, start, end);
+        else
+          from = start;
+        if (max == -1) {
+          end = re->n;
+          reInsert(re, from, RE_SPLIT, from + 1, end + 2);
+          reEmit(re, RE_JMP, from, 0);
+        } else {
+          end = re->n;
+          reInsert(re, from, RE_SPLIT, from + 1, end + 1);
+          end = re->n;
+          for (i = min + 1; i < max; i++)
+            reCopy(re, from, end);
+        }
+      }
+      continue;
+    } else {
+      return 0;
+    }
+    ps->p++;
+  }
+}
+
+int reParseConcat(struct reParser *ps) {
+  while (*ps->p != '\0' && *ps->p != '|' && *ps->p != ')') {
+    if (reParseRepeat(ps) == -1)
+      return -1;
+    if (ps->re->n > KILO_RE_MAX_INSTS) {
+      ps->re->error = "too big";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* a|b compiles to: split L1, L2; L1: a; jmp L3; L2: b; L3: */
+int reParseAlt(struct reParser *ps) {
+  struct regex *re = ps->re;
+  int start = re->n, jmp;
+
+  if (reParseConcat(ps) == -1)
+    return -1;
+  if (*ps->p != '|')
+    return 0;
+  ps->p++;
+
+  reInsert(re, start, RE_SPLIT, start + 1, 0);
+  jmp = reEmit(re, RE_JMP, 0, 0);
+  re->code[start].y = re->n;
+  if (reParseAlt(ps) == -1)
+    return -1;
+  re->code[jmp].x = re->n;
+  return 0;
+}
+
+/*
+ * the bytes the program can start a match with, and whether it can match
+ * without taking any. The searcher skips straight past everything else.
+ */
+void reFirst(struct regex *re) {
+  int *stack = malloc(sizeof(int) * (re->n + 1));
+  char *seen = calloc(re->n, 1);
+  int top = 0, pc, i, count = 0;
+
+  if (stack == NULL || seen == NULL)
+    die("malloc");
+  stack[top++] = 0;
+  while (top > 0) {
+    pc = stack[--top];
+    if (seen[pc])
+      continue;
+    seen[pc] = 1;
+    switch (re->code[pc].op) {
+    case RE_BYTE:
+      for (i = 0; i < 4; i++)
+        re->first[i] |= re->sets[re->code[pc].x][i];
+      break;
+    case RE_SPLIT:
+      stack[top++] = re->code[pc].y;
+      stack[top++] = re->code[pc].x;
+      break;
+    case RE_JMP:
+      stack[top++] = re->code[pc].x;
+      break;
+    case RE_BOL:
+    case RE_EOL:
+      stack[top++] = pc + 1;
+      break;
+    case RE_MATCH:
+      re->nullable = 1;
+      break;
+    }
+  }
+  free(stack);
+  free(seen);
+
+  re->firstbyte = -1;
+  for (i = 0; i < 256; i++) {
+    if (reSetHas(re->first, i)) {
+      re->firstbyte = i;
+      count++;
+    }
+  }
+  if (count != 1)
+    re->firstbyte = -1;
+}
+
+void reFree(struct regex *re) {
+  if (re == NULL)
+    return;
+  free(re->code);
+  free(re->sets);
+  free(re);
+}
+
+/* compile pattern, or return NULL and say why in *error */
+struct regex *reCompile(const char *pattern, const char **error) {
+  struct regex *re = calloc(1, sizeof(struct regex));
+  struct reParser ps = {re, pattern};
+
+  if (re == NULL)
+    die("calloc");
+  if (reParseAlt(&ps) == 0 && *ps.p == ')')
+    re->error = "unmatched )";
+  if (re->error) {
+    *error = re->error;
+    reFree(re);
+    return NULL;
+  }
+  reEmit(re, RE_MATCH, 0, 0);
+  reFirst(re);
+  return re;
+}
+
+struct reVM *reVMNew(const struct regex *re) {
+  struct reVM *vm = calloc(1, sizeof(struct reVM));
+
+  if (vm == NULL)
+    die("calloc");
+  vm->re = re;
+  vm->cur = malloc(sizeof(struct reThread) * re->n);
+  vm->next = malloc(sizeof(struct reThread) * re->n);
+  vm->stack = malloc(sizeof(int) * (re->n + 1));
+  vm->mark = calloc(re->n, sizeof(unsigned));
+  if (vm->cur == NULL || vm->next == NULL || vm->stack == NULL ||
+      vm->mark == NULL)
+    die("malloc");
+  return vm;
+}
+
+void reVMFree(struct reVM *vm) {
+  if (vm == NULL)
+    return;
+  free(vm->cur);
+  free(vm->next);
+  free(vm->stack);
+  free(vm->mark);
+  free(vm);
+}
+
+/*
+ * add the thread at pc to list, or rather the threads it turns into before
+ * taking the next byte, in order of priority. prev is the byte before the
+ * position and c the one at it, -1 at the end of the document.
+ */
+int reAddThread(struct reVM *vm, struct reThread *list, int n, int pc,
+                size_t start, int prev, int c) {
+  const struct reInst *code = vm->re->code;
+  int top = 0;
+
+  vm->stack[top++] = pc;
+  while (top > 0) {
+    pc = vm->stack[--top];
+    if (vm->mark[pc] == vm->gen)
+      continue;
+    vm->mark[pc] = vm->gen;
+    switch (code[pc].op) {
+    case RE_SPLIT:
+      vm->stack[top++] = code[pc].y;
+      vm->stack[top++] = code[pc].x;
+      break;
+    case RE_JMP:
+      vm->stack[top++] = code[pc].x;
+      break;
+    case RE_BOL:
+      if (prev == '\n')
+        vm->stack[top++] = pc + 1;
+      break;
+    case RE_EOL:
+      if (c == '\n' || c == '\r' || c == -1)
+        vm->stack[top++] = pc + 1;
+      break;
+    default:
+      list[n].pc = pc;
+      list[n].start = start;
+      n++;
+    }
+  }
+  return n;
+}
+
+/* the text of span i of a search snapshot */
+const char *searchSpanText(const struct searchJob *job, size_t i) {
+  const struct saveSpan *sp = &job->spans[i];
+
+  return sp->text ? sp->text : job->map + sp->off;
+}
+
+/* the span of the snapshot that byte pos is in */
+size_t searchSpanAt(const struct searchJob *job, size_t pos) {
+  size_t lo = 0, hi = job->numspans;
+
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (job->spanstart[mid] <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * the leftmost-first match that starts in [from, limit) of the job's snapshot,
+ * which may run on past limit. Returns 0 if there is none, or the job was
+ * cancelled.
+ */
+int reSearch(struct reVM *vm, struct searchJob *job, size_t from,
+             size_t limit, size_t *mstart, size_t *mend) {
+  const struct regex *re = vm->re;
+  size_t si = searchSpanAt(job, from), pos = from, a, b, i;
+  const char *text = NULL;
+  int ncur = 0, nnext, matched = 0, prev = '\n', c;
+  struct reThread *t;
+
+  if (from >= limit || from > job->size)
+    return 0;
+  if (from > 0) {
+    size_t pi = searchSpanAt(job, from - 1);
+    prev = (unsigned char)searchSpanText(job, pi)[from - 1 -
+                                                 job->spanstart[pi]];
+  }
+  a = b = 0;
+  if (si < job->numspans) {
+    text = searchSpanText(job, si);
+    a = job->spanstart[si];
+    b = a + job->spans[si].len;
+  }
+
+  for (;;) {
+    /* the next span, once we're through this one */
+    while (pos >= b && si + 1 < job->numspans) {
+      si++;
+      text = searchSpanText(job, si);
+      a = job->spanstart[si];
+      b = a + job->spans[si].len;
+    }
+
+    /* with nothing on the go, skip to where a match could start */
+    if (ncur == 0 && !matched) {
+      if (pos >= limit)
+        return 0;
+      if (!re->nullable && pos < b) {
+        size_t end = b < limit ? b : limit;
+        const char *hit;
+
+        if (re->firstbyte >= 0) {
+          hit = memchr(text + (pos - a), re->firstbyte, end - pos);
+          i = hit ? (size_t)(hit - text) + a : end;
+        } else {
+          for (i = pos; i < end; i++)
+            if (reSetHas(re->first, (unsigned char)text[i - a]))
+              break;
+        }
+        if (i > pos) {
+          prev = (unsigned char)text[i - 1 - a];
+          pos = i;
+        }
+        if (pos >= end)
+          continue;
+      }
+    }
+
+    if ((pos & 0xffff) == 0 && searchCancelled(job))
+      return 0;
+    c = pos < b ? (unsigned char)text[pos - a] : -1;
+
+    /* the threads that were waiting for this byte, then a new one */
+    vm->gen++;
+    if (vm->gen == 0) {
+      memset(vm->mark, 0, sizeof(unsigned) * re->n);
+      vm->gen = 1;
+    }
+    nnext = 0;
+    for (i = 0; i < (size_t)ncur; i++)
+      nnext = reAddThread(vm, vm->next, nnext, vm->cur[i].pc,
+                          vm->cur[i].start, prev, c);
+    if (!matched && pos < limit && (c & 0xc0) != 0x80)
+      nnext = reAddThread(vm, vm->next, nnext, 0, pos, prev, c);
+
+    /* and what they do with it */
+    ncur = 0;
+    for (i = 0; i < (size_t)nnext; i++) {
+      t = &vm->next[i];
+      if (re->code[t->pc].op == RE_MATCH) {
+        /* the threads after this one can only find worse matches */
+        matched = 1;
+        *mstart = t->start;
+        *mend = pos;
+        break;
+      }
+      if (c != -1 && reSetHas(re->sets[re->code[t->pc].x], c)) {
+        vm->cur[ncur].pc = t->pc + 1;
+        vm->cur[ncur].start = t->start;
+        ncur++;
+      }
+    }
+
+    if (ncur == 0 && matched)
+      return 1;
+    if (c == -1)
+      return matched;
+    prev = c;
+    pos++;
+  }
+}
+
+/*** find ***/
+
+/* let go of a job; whoever lets go last frees it. Call with the lock held */
+void searchRelease(struct searchJob *job) {
+  size_t i;
+
+  if (--job->refs > 0)
+    return;
+  for (i = 0; i < job->numchunks; i++) {
+    free(job->chunks[i].hits);
+    free(job->chunks[i].lens);
+  }
+  free(job->chunks);
+  free(job->spans);
+  free(job->spanstart);
+  free(job->query);
+  reFree(job->re);
+  free(job);
+}
+
+int searchCancelled(struct searchJob *job) {
+  return __atomic_load_n(&job->cancel, __ATOMIC_RELAXED);
+}
+
+void searchAddHit(struct searchJob *job, struct searchChunk *c, size_t pos,
+                  size_t len) {
+  if (c->numhits % 256 == 0) {
+    size_t *hits = realloc(c->hits, sizeof(size_t) * (c->numhits + 256));
+    size_t *lens = NULL;
+
+    if (hits)
+      c->hits = hits;
+    if (hits && job->re &&
+        (lens = realloc(c->lens, sizeof(size_t) * (c->numhits + 256))))
+      c->lens = lens;
+    /* the count would be wrong from here on, and a replace would miss it */
+    if (hits == NULL || (job->re && lens == NULL)) {
+      __atomic_store_n(&job->truncated, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  c->hits[c->numhits] = pos;
+  if (job->re)
+    c->lens[c->numhits] = len;
+  c->numhits++;
+  __atomic_add_fetch(&job->total, 1, __ATOMIC_RELAXED);
+}
+
+/* how long hit i of chunk c is: the query, unless that's a regex */
+size_t searchHitLen(struct searchJob *job, struct searchChunk *c, size_t i) {
+  return job->re ? c->lens[i] : job->qlen;
+}
+
+/* copy the document bytes [from, to) into buf, starting at span i */
+void searchGather(struct searchJob *job, size_t i, size_t from, size_t to,
+                  char *buf) {
+  for (; i < job->numspans && from < to; i++) {
+    struct saveSpan *sp = &job->spans[i];
+    const char *text = sp->text ? sp->text : job->map + sp->off;
+    size_t a = job->spanstart[i], n;
+
+    if (from >= a + sp->len)
+      continue;
+    n = a + sp->len - from;
+    if (n > to - from)
+      n = to - from;
+    memcpy(buf, text + (from - a), n);
+    buf += n;
+    from += n;
+  }
+}
+
+/* could chunk ci have a hit, going by the trigram index */
+int searchMayMatch(struct searchJob *job, size_t ci) {
+  size_t i;
+
+  if (job->tri == NULL)
+    return 1;
+  for (i = 0; i + 2 < job->qlen; i++) {
+    const uint64_t *bits =
+        &job->tri[trigramBucket(job->query + i) * job->triwords];
+    size_t cj = ci + 1;
+
+    /* the empty chunk at the end of a file that fills its last one */
+    if (ci / 64 >= job->triwords)
+      return 1;
+    if (!(bits[ci / 64] >> (ci % 64) & 1) &&
+        !(cj < job->numchunks && cj / 64 < job->triwords &&
+          (bits[cj / 64] >> (cj % 64) & 1)))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Find the hits that start in chunk c, from from on. Most of them sit inside
+ * one span, and we search those in place. The few that run from one span
+ * into the next we find by copying the couple of bytes around the boundary
+ * into win. Hits don't overlap: after one, we carry on behind it.
+ */
+void searchChunk(struct searchJob *job, struct searchChunk *c, char *win,
+                 size_t from) {
+  const char *q = job->query;
+  size_t m = job->qlen;
+  size_t lo = 0, hi = job->numspans, i;
+  size_t next = from; /* no hit may start before this */
+
+  /* the span c starts in */
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (job->spanstart[mid] <= c->start)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  for (i = lo; i < job->numspans && job->spanstart[i] < c->end; i++) {
+    struct saveSpan *sp = &job->spans[i];
+    const char *text = sp->text ? sp->text : job->map + sp->off;
+    size_t a = job->spanstart[i], b = a + sp->len;
+    size_t from = next > a ? next : a;
+    size_t to = c->end + m - 1 < b ? c->end + m - 1 : b;
+    const char *hit;
+
+    if (searchCancelled(job) ||
+        __atomic_load_n(&job->total, __ATOMIC_RELAXED) >= KILO_SEARCH_MAX_HITS)
+      return;
+
+    while (from + m <= to &&
+           (hit = scanner->find(text + (from - a), to - from, q, m)) != NULL) {
+      size_t pos = a + (hit - text);
+      if (pos >= c->end)
+        break;
+      searchAddHit(job, c, pos, m);
+      from = next = pos + m;
+    }
+
+    /* hits that start in this span and end in a later one */
+    if (m > 1 && b < job->size) {
+      size_t wfrom = b > m - 1 ? b - (m - 1) : 0, wto = b + m - 1, off;
+
+      if (wfrom < from)
+        wfrom = from;
+      if (wto > job->size)
+        wto = job->size;
+      searchGather(job, i, wfrom, wto, win);
+      for (off = 0; wfrom + off + m <= wto; off++) {
+        size_t pos = wfrom + off;
+        if (pos >= b || pos >= c->end)
+          break;
+        if (pos >= next && memcmp(win + off, q, m) == 0) {
+          searchAddHit(job, c, pos, m);
+          next = pos + m;
+        }
+      }
+    }
+  }
+}
+
+/*
+ * the same for a regex, looking for hits from from on. A hit that matches
+ * nothing is followed by a search from the next byte on, not the same one.
+ */
+void reSearchChunk(struct searchJob *job, struct searchChunk *c,
+                   struct reVM *vm, size_t from) {
+  size_t start, end;
+
+  while (reSearch(vm, job, from, c->end, &start, &end)) {
+    if (__atomic_load_n(&job->total, __ATOMIC_RELAXED) >= KILO_SEARCH_MAX_HITS)
+      return;
+    searchAddHit(job, c, start, end - start);
+    from = end > start ? end : end + 1;
+  }
+}
+
+void *searchWorker(void *arg) {
+  struct searchState *st = arg;
+  unsigned long seen = 0;
+  char *win = NULL;
+  struct reVM *vm = NULL;
+
+  for (;;) {
+    struct searchJob *job;
+    size_t k;
+
+    pthread_mutex_lock(&st->lock);
+    while (st->job == NULL || st->serial == seen)
+      pthread_cond_wait(&st->wake, &st->lock);
+    job = st->job;
+    job->refs++;
+    seen = st->serial;
+    pthread_mutex_unlock(&st->lock);
+
+    free(win);
+    win = malloc(2 * job->qlen);
+    reVMFree(vm);
+    vm = job->re ? reVMNew(job->re) : NULL;
+
+    while (win && !searchCancelled(job)) {
+      k = __atomic_fetch_add(&job->claimed, 1, __ATOMIC_RELAXED);
+      if (k >= job->numchunks)
+        break;
+
+      size_t ci = (job->first + k) % job->numchunks;
+      struct searchChunk *c = &job->chunks[ci];
+      editorMapEnter();
+      if (vm)
+        reSearchChunk(job, c, vm, c->start);
+      else if (searchMayMatch(job, ci))
+        searchChunk(job, c, win, c->start);
+      editorMapLeave();
+      __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&job->finished, 1, __ATOMIC_RELEASE);
+      write(E.wakepipe[1], "f", 1);
+    }
+
+    pthread_mutex_lock(&st->lock);
+    searchRelease(job);
+    pthread_mutex_unlock(&st->lock);
+  }
+  return NULL;
+}
+
+/*
+ * The hits of a chunk were found without knowing where the last hit before
+ * the chunk ends. Usually that's before the chunk's first hit starts; if it
+ * isn't, the chunk is searched again from there. This goes through the
+ * chunks in order, as far as they are done, so a hit shown before its chunk
+ * got here may still go away.
+ */
+void searchSettle(struct searchJob *job) {
+  struct reVM *vm = NULL;
+  char *win = NULL;
+  size_t last;
+
+  for (; job->settled < job->numchunks; job->settled++) {
+    struct searchChunk *c = &job->chunks[job->settled];
+
+    if (!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE))
+      break;
+    if (c->numhits && c->hits[0] < job->next) {
+      __atomic_sub_fetch(&job->total, c->numhits, __ATOMIC_RELAXED);
+      c->numhits = 0;
+      if (job->re) {
+        if (vm == NULL)
+          vm = reVMNew(job->re);
+        reSearchChunk(job, c, vm, job->next);
+      } else {
+        if (win == NULL && (win = malloc(2 * job->qlen)) == NULL)
+          die("malloc");
+        searchChunk(job, c, win, job->next);
+      }
+    }
+    if (c->numhits) {
+      last = c->numhits - 1;
+      job->next = c->hits[last] + searchHitLen(job, c, last) +
+                  (searchHitLen(job, c, last) == 0);
+    }
+  }
+  free(win);
+  reVMFree(vm);
+}
+
+/* stop the current search, if there is one, and make job (or nothing) next */
+void editorSearchSwitch(struct searchJob *job) {
+  struct searchState *st = &E.search;
+
+  pthread_mutex_lock(&st->lock);
+  if (st->job) {
+    __atomic_store_n(&st->job->cancel, 1, __ATOMIC_RELAXED);
+    searchRelease(st->job);
+  }
+  st->job = job;
+  st->serial++;
+  pthread_cond_broadcast(&st->wake);
+  pthread_mutex_unlock(&st->lock);
+
+  st->found = 0;
+  st->matchlen = 0;
+  st->error = NULL;
+  free(st->replace);
+  st->replace = NULL;
+  E.redraw = 1;
+}
+
+/* search for query, taken as a regex if regex is set */
+void editorSearchStart(const char *query, int regex) {
+  struct searchState *st = &E.search;
+  struct searchJob *job;
+  struct regex *re = NULL;
+  const char *error;
+  size_t i, off;
+
+  if (st->nthreads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+      n = 1;
+    if (n > KILO_SEARCH_THREADS)
+      n = KILO_SEARCH_THREADS;
+    for (i = 0; i < (size_t)n; i++) {
+      if (pthread_create(&st->threads[i], NULL, searchWorker, st) != 0)
+        break;
+      pthread_detach(st->threads[i]);
+    }
+    st->nthreads = i;
+    if (st->nthreads == 0)
+      die("pthread_create");
+  }
+
+  if (query[0] == '\0') {
+    editorSearchSwitch(NULL);
+    return;
+  }
+  if (regex && (re = reCompile(query, &error)) == NULL) {
+    editorSearchSwitch(NULL);
+    st->error = error;
+    return;
+  }
+
+  job = calloc(1, sizeof(struct searchJob));
+  if (job == NULL)
+    die("calloc");
+  job->refs = 1;
+  job->query = strdup(query);
+  job->qlen = strlen(query);
+  job->re = re;
+  job->map = E.map;
+  job->size = ptSize();
+  job->version = E.version;
+  job->started = editorNowNs();
+
+  job->spans = malloc(sizeof(struct saveSpan) * (editorCountPieces(E.pt) + 1));
+  if (job->query == NULL || job->spans == NULL)
+    die("malloc");
+  editorSnapshotNode(E.pt, job->spans, &job->numspans);
+  job->spanstart = malloc(sizeof(size_t) * (job->numspans + 1));
+  if (job->spanstart == NULL)
+    die("malloc");
+  for (i = 0, off = 0; i < job->numspans; i++) {
+    job->spanstart[i] = off;
+    off += job->spans[i].len;
+  }
+
+  job->numchunks = job->size / KILO_SEARCH_CHUNK + 1;
+  job->chunks = calloc(job->numchunks, sizeof(struct searchChunk));
+  if (job->chunks == NULL)
+    die("calloc");
+  for (i = 0; i < job->numchunks; i++) {
+    job->chunks[i].start = i * KILO_SEARCH_CHUNK;
+    job->chunks[i].end = i + 1 == job->numchunks ? job->size
+                                                  : (i + 1) * KILO_SEARCH_CHUNK;
+  }
+  job->first = st->origin / KILO_SEARCH_CHUNK;
+
+  /* the trigram index describes the file, so it only helps while unedited */
+  if (E.sidecar.tri && !re && job->numspans == 1 &&
+      job->spans[0].text == NULL && job->spans[0].off == 0 &&
+      job->size == E.sidecar.hdr.size) {
+    job->tri = E.sidecar.tri;
+    job->triwords = E.sidecar.triwords;
+  }
+  if (job->first >= job->numchunks)
+    job->first = job->numchunks - 1;
+
+  editorSearchSwitch(job);
+}
+
+/* move the cursor to the hit at off, showing its row at the top */
+void editorSearchJump(size_t off, size_t len) {
+  /* the piece table only counts newlines in the part that's indexed */
+  while (!editorIndexComplete() && E.idx.scanned <= off)
+    editorIndexChunk();
+
+  E.cy = ptRowAt(off);
+  E.cx = off - editorRowOffset(E.cy);
+  E.rowoff = E.cy + 1;
+  E.search.matchoff = off;
+  E.search.matchlen = len;
+  E.redraw = 1;
+}
+
+/*
+ * Called when a worker finished a chunk. Until we've found something, walk
+ * the chunks in the order they're searched, from the cursor round to just
+ * before it, and jump to the first hit once everything in front of it is
+ * done.
+ */
+void editorCheckSearch(void) {
+  struct searchState *st = &E.search;
+  struct searchJob *job = st->job;
+  size_t k, i;
+
+  if (job == NULL)
+    return;
+  E.redraw = 1;
+
+  /* the hit we're on may have been one that overlapped another */
+  searchSettle(job);
+  if (st->found && st->hit >= job->chunks[st->chunk].numhits) {
+    st->found = job->chunks[st->chunk].numhits > 0;
+    st->hit = st->found ? job->chunks[st->chunk].numhits - 1 : 0;
+  }
+
+  if (!job->ended &&
+      __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE) == job->numchunks) {
+    job->ended = editorNowNs();
+    if (job->re) {
+      E.prof.re_bytes = job->size;
+      E.prof.re_ns = job->ended - job->started;
+    }
+  }
+  if (st->replace && job->ended) {
+    editorReplaceAll();
+    return;
+  }
+  if (st->found)
+    return;
+
+  for (k = 0; k <= job->numchunks; k++) {
+    size_t ci = (job->first + k) % job->numchunks;
+    struct searchChunk *c = &job->chunks[ci];
+
+    if (!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE))
+      return;
+    for (i = 0; i < c->numhits; i++) {
+      if (k == 0 && c->hits[i] < st->origin)
+        continue;
+      if (k == job->numchunks && c->hits[i] >= st->origin)
+        break;
+      st->found = 1;
+      st->chunk = ci;
+      st->hit = i;
+      editorSearchJump(c->hits[i], searchHitLen(job, c, i));
+      return;
+    }
+  }
+}
+
+/* go to the next (dir 1) or previous (dir -1) hit, among the chunks done */
+void editorSearchStep(int dir) {
+  struct searchState *st = &E.search;
+  struct searchJob *job = st->job;
+  size_t ci, hit, k;
+
+  if (job == NULL || !st->found)
+    return;
+  ci = st->chunk;
+  hit = st->hit;
+
+  if (dir > 0 && hit + 1 < job->chunks[ci].numhits) {
+    st->hit++;
+    editorSearchJump(job->chunks[ci].hits[st->hit],
+                     searchHitLen(job, &job->chunks[ci], st->hit));
+    return;
+  }
+  if (dir < 0 && hit > 0) {
+    st->hit--;
+    editorSearchJump(job->chunks[ci].hits[st->hit],
+                     searchHitLen(job, &job->chunks[ci], st->hit));
+    return;
+  }
+
+  /* the next chunk over that is done and has hits, wrapping around */
+  for (k = 1; k <= job->numchunks; k++) {
+    size_t cj = (ci + job->numchunks + (dir > 0 ? k : -k)) % job->numchunks;
+    struct searchChunk *c = &job->chunks[cj];
+
+    if (!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE) || c->numhits == 0)
+      continue;
+    st->chunk = cj;
+    st->hit = dir > 0 ? 0 : c->numhits - 1;
+    editorSearchJump(c->hits[st->hit], searchHitLen(job, c, st->hit));
+    return;
+  }
+}
+
+/*
+ * "3/120 matches", with how far the search has got while it isn't done. Which
+ * hit we're on is only known once every chunk before ours is settled; until
+ * then it's shown as "?" rather than a number that keeps going up.
+ */
+int editorSearchStatus(char *buf, size_t size) {
+  struct searchState *st = &E.search;
+  struct searchJob *job = st->job;
+  size_t finished, before = 0, i;
+  const char *lost;
+  char at[32] = "0";
+
+  if (job == NULL)
+    return st->error ? snprintf(buf, size, " [bad regex: %s]", st->error) : 0;
+  finished = __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE);
+  lost = __atomic_load_n(&job->truncated, __ATOMIC_RELAXED)
+             ? ", out of memory, some missed"
+             : "";
+
+  if (st->replace)
+    return snprintf(buf, size, " [replacing, %d%%]",
+                    (int)(finished * 100 / job->numchunks));
+  if (st->found && job->settled > st->chunk) {
+    for (i = 0; i < st->chunk; i++)
+      before += job->chunks[i].numhits;
+    snprintf(at, sizeof(at), "%zu", before + st->hit + 1);
+  } else if (st->found) {
+    strcpy(at, "?");
+  }
+  if (finished < job->numchunks)
+    return snprintf(buf, size, " [%s/%zu+ matches, %d%%%s]", at,
+                    __atomic_load_n(&job->total, __ATOMIC_RELAXED),
+                    (int)(finished * 100 / job->numchunks), lost);
+  return snprintf(buf, size, " [%s/%zu matches%s]", at,
+                  __atomic_load_n(&job->total, __ATOMIC_RELAXED), lost);
+}
+
+void editorSearchKey(char *query, int key, int regex) {
+  struct searchJob *job = E.search.job;
+
+  if (key == '\r' || key == '\x1b') {
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    editorSearchStep(1);
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    editorSearchStep(-1);
+  } else if (job == NULL ? query[0] != '\0'
+                         : strcmp(job->query, query) || !job->re != !regex) {
+    editorSearchStart(query, regex);
+  }
+}
+
+void editorFindCallback(char *query, int key) {
+  editorSearchKey(query, key, 0);
+}
+
+void editorRegexCallback(char *query, int key) {
+  editorSearchKey(query, key, 1);
+}
+
+/*
+ * ask for what to search for, searching as it's typed. Returns it, or NULL
+ * if the user hit ESC, which puts the cursor back where it was.
+ */
+char *editorSearchPrompt(char *prompt, void (*callback)(char *, int)) {
+  size_t saved_cx = E.cx;
+  size_t saved_cy = E.cy;
+  size_t saved_coloff = E.coloff;
+  size_t saved_rowoff = E.rowoff;
+  size_t saved_rowsub = E.rowsub;
+
+  E.search.origin = editorCursorOffset();
+  char *query = editorPrompt(prompt, callback);
+
+  if (query == NULL) {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+    E.rowsub = saved_rowsub;
+  }
+  return query;
+}
+
+void editorFind(void) {
+  free(editorSearchPrompt("Search: %s (Use ESC/Arrows/Enter)",
+                          editorFindCallback));
+  editorSearchSwitch(NULL);
+}
+
+/*** replace ***/
+
+/*
+ * ^R searches for a regex like ^F does for text, and then asks what to
+ * replace the hits with; ESC there just leaves the cursor on the hit. In the
+ * replacement & stands for what the hit matched, and \& \\ \n \t for an &, a
+ * backslash, a newline and a tab.
+ *
+ * Once the search is done, every hit is replaced in one edit: the stretch of
+ * the document from the first hit to the end of the last is cut out, and
+ * goes back in as pieces of what was there between the hits, with the new
+ * text in the add buffer in between. The row caches see that as a single
+ * change, and it's a single group in the undo history. Only if the document
+ * changed while the search ran is nothing replaced.
+ */
+
+/* the pieces of t, in document order */
+void ptPieces(struct pieceNode *t, struct piece *out, size_t *n) {
+  if (t == NULL)
+    return;
+  ptPieces(t->left, out, n);
+  out[(*n)++] = t->p;
+  ptPieces(t->right, out, n);
+}
+
+/*
+ * where a replace-all has got to in the pieces that were cut out: byte off of
+ * piece k, and the first newline of its buffer's index at or after that. The
+ * newlines of what's kept are counted by walking the index along with it.
+ */
+struct replaceWalk {
+  const struct piece *in;
+  size_t k, off;
+  size_t nl;
+};
+
+/* the next len bytes, added to out (unless out is NULL, which skips them) */
+void replaceTake(struct replaceWalk *w, size_t len, struct piece *out,
+                 size_t *n) {
+  while (len > 0) {
+    const struct piece *p = &w->in[w->k];
+    struct lineIndex *idx = pieceIndex(p);
+    size_t take = p->len - w->off < len ? p->len - w->off : len;
+    size_t end = p->off + w->off + take, nl = w->nl;
+
+    if (w->off == 0)
+      nl = w->nl = idxLowerBound(idx, p->off);
+    while (w->nl < idx->count && idx->nl[w->nl] < end)
+      w->nl++;
+    if (out) {
+      struct piece *q = &out[(*n)++];
+
+      q->buf = p->buf;
+      q->off = p->off + w->off;
+      q->len = take;
+      q->lf = w->nl - nl;
+    }
+    len -= take;
+    w->off += take;
+    if (w->off == p->len) {
+      w->k++;
+      w->off = 0;
+    }
+  }
+}
+
+/* the replacement for the hit at [start, start + len) of t, into ab */
+void replaceExpand(const char *with, struct pieceNode *t, size_t start,
+                   size_t len, struct abuf *ab) {
+  for (; *with; with++) {
+    if (*with == '&') {
+      ptCopyNode(t, 0, start, start + len, ab);
+    } else if (*with == '\\' && with[1]) {
+      char c = *++with == 'n' ? '\n' : *with == 't' ? '\t' : *with;
+      abAppend(ab, &c, 1);
+    } else {
+      abAppend(ab, with, 1);
+    }
+  }
+}
+
+/* does with have an & in it, other than as \& */
+int replaceUsesMatch(const char *with) {
+  for (; *with; with++) {
+    if (*with == '&')
+      return 1;
+    if (*with == '\\' && with[1])
+      with++;
+  }
+  return 0;
+}
+
+size_t replaceCollect(struct searchJob *job) {
+  size_t ci, n = 0;
+
+  searchSettle(job);
+  for (ci = 0; ci < job->numchunks; ci++)
+    n += job->chunks[ci].numhits;
+  return n;
+}
+
+void editorReplaceAll(void) {
+  struct searchState *st = &E.search;
+  struct searchJob *job = st->job;
+  struct abuf text = ABUF_INIT;
+  struct piece *old, *pieces, same = {PIECE_ADD, 0, 0, 0};
+  struct pieceNode *cut;
+  struct replaceWalk w = {NULL, 0, 0, 0};
+  size_t nhits, ci, i, lo = (size_t)-1, hi = 0, pos, ncut, nold = 0, n = 0;
+  long long t0 = editorNowNs();
+  int each = replaceUsesMatch(st->replace);
+
+  if (job->version != E.version) {
+    editorSearchSwitch(NULL);
+    editorSetStatusMessage("The text changed while searching, not replaced");
+    return;
+  }
+  if (__atomic_load_n(&job->total, __ATOMIC_RELAXED) >= KILO_SEARCH_MAX_HITS) {
+    editorSearchSwitch(NULL);
+    editorSetStatusMessage("Too many matches to replace");
+    return;
+  }
+  nhits = replaceCollect(job);
+  if (__atomic_load_n(&job->truncated, __ATOMIC_RELAXED)) {
+    editorSearchSwitch(NULL);
+    editorSetStatusMessage("Out of memory for the matches, not replaced");
+    return;
+  }
+  if (nhits == 0) {
+    editorSearchSwitch(NULL);
+    editorSetStatusMessage("No matches");
+    return;
+  }
+
+  for (ci = 0; ci < job->numchunks; ci++) {
+    struct searchChunk *c = &job->chunks[ci];
+
+    if (c->numhits == 0)
+      continue;
+    if (lo == (size_t)-1)
+      lo = c->hits[0];
+    hi = c->hits[c->numhits - 1] + c->lens[c->numhits - 1];
+  }
+
+  /* edits only happen where the line index has been */
+  while (!editorIndexComplete() && E.idx.scanned <= hi)
+    editorIndexChunk();
+
+  /* an undo group of its own: the cut and the pieces that go back in */
+  editorUndoBreak();
+  E.undo.sealed = 1;
+  editorBeginBatch();
+
+  cut = hi > lo ? ptCut(lo, hi - lo) : NULL;
+  if (cut)
+    editorUndoDelete(lo, hi - lo, cut);
+  ncut = editorCountPieces(cut);
+  old = malloc(sizeof(struct piece) * (ncut + 1));
+  pieces = malloc(sizeof(struct piece) * (ncut + 2 * nhits + 1));
+  if (old == NULL || pieces == NULL)
+    die("malloc");
+  ptPieces(cut, old, &nold);
+  w.in = old;
+
+  /* without an &, all the hits share one copy of the text in the add buffer */
+  if (!each) {
+    replaceExpand(st->replace, NULL, 0, 0, &text);
+    if (text.len) {
+      same.off = addAppend(text.b, text.len);
+      same.len = text.len;
+      same.lf = pieceCountLF(PIECE_ADD, same.off, same.len);
+    }
+  }
+
+  for (ci = 0, pos = lo; ci < job->numchunks; ci++) {
+    struct searchChunk *c = &job->chunks[ci];
+
+    for (i = 0; i < c->numhits; i++) {
+      size_t start = c->hits[i], len = c->lens[i];
+
+      replaceTake(&w, start - pos, pieces, &n);
+      replaceTake(&w, len, NULL, NULL);
+      pos = start + len;
+
+      if (!each) {
+        if (same.len)
+          pieces[n++] = same;
+        continue;
+      }
+      text.len = 0;
+      replaceExpand(st->replace, cut, start - lo, len, &text);
+      if (text.len) {
+        struct piece *q = &pieces[n++];
+
+        q->buf = PIECE_ADD;
+        q->off = addAppend(text.b, text.len);
+        q->len = text.len;
+        q->lf = pieceCountLF(PIECE_ADD, q->off, q->len);
+      }
+    }
+  }
+
+  if (n) {
+    editorUndoInsertPieces(lo, pieces, n);
+    ptInsertPieces(lo, pieces, n);
+  }
+  editorEndBatch();
+  editorUndoBreak();
+  E.undo.sealed = 1;
+  E.dirty++;
+
+  ptFree(cut);
+  free(old);
+  free(pieces);
+  abFree(&text);
+  editorCursorTo(st->origin < ptSize() ? st->origin : ptSize());
+  editorSearchSwitch(NULL);
+  editorSetStatusMessage("Replaced %zu matches in %.0f ms", nhits,
+                         (editorNowNs() - t0) / 1e6);
+}
+
+void editorReplace(void) {
+  char *query = editorSearchPrompt("Regex: %s (Use ESC/Arrows/Enter)",
+                                   editorRegexCallback);
+  const char *error = E.search.error;
+  char *with;
+
+  if (query == NULL || E.search.job == NULL) {
+    editorSearchSwitch(NULL);
+    if (query && error)
+      editorSetStatusMessage("Bad regex: %s", error);
+    free(query);
+    return;
+  }
+  free(query);
+
+  with = editorPromptLine("Replace with: %s (& is the match, ESC to stop here)",
+                          NULL, 1);
+  if (with == NULL) {
+    editorSearchSwitch(NULL);
+    return;
+  }
+  E.search.replace = with;
+  editorCheckSearch();
+}
+
+/*** follow ***/
+
+/*
+ * kilo -f FILE follows FILE as something else appends to it, like tail -f.
+ * What the file has is read into a copy of our own, in a reservation of far
+ * more address space than it needs, so E.map never moves: growing the
+ * document is just a matter of reading the new bytes in after the old ones,
+ * raising E.mapsize, adding them to the last piece and indexing them. Nothing
+ * that was already indexed gets scanned again, and since only the rows at the
+ * end change, the shadow screen only redraws those.
+ *
+ * Mapping the file itself would save the copy, but the file isn't ours. When
+ * it's truncated (logrotate's copytruncate does that every night) the pages
+ * behind the text our pieces point at are gone, and touching them is SIGBUS,
+ * in whichever thread gets there first. A copy keeps the text we have until
+ * we've decided what to do about it, as it does for a stream.
+ *
+ * We follow the file we opened rather than its name, as tail -f does. We hear
+ * about writes from inotify on Linux or kqueue on the BSDs and macOS, whose
+ * descriptors both go into the same poll() as the terminal. Anywhere else we
+ * just look at the file once a second.
+ */
+#if UINTPTR_MAX > 0xffffffffu
+#define KILO_FOLLOW_RESERVE ((size_t)1 << 36)
+#else
+#define KILO_FOLLOW_RESERVE ((size_t)1 << 28)
+#endif
+#define KILO_RESERVE_MIN ((size_t)16 << 20)  /* less than this, give up */
+#define KILO_RESERVE_STEP ((size_t)64 << 20) /* made writable at a time */
+
+/*
+ * Reserve address space for a document we fill in ourselves as it comes,
+ * *size bytes of it if we can. It starts out inaccessible, which costs no
+ * memory and, under strict overcommit, no commit charge either (see
+ * editorCommit()). If even the address space is refused, as under a low
+ * RLIMIT_AS, we make do with less, halving it until it fits. NULL if not even
+ * KILO_RESERVE_MIN will.
+ */
+char *editorReserve(size_t *size) {
+  void *map;
+
+  for (;;) {
+    map = mmap(NULL, *size, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map != MAP_FAILED)
+      return map;
+    if (*size / 2 < KILO_RESERVE_MIN)
+      return NULL;
+    *size /= 2;
+  }
+}
+
+/*
+ * make the first need bytes of a reservation writable, KILO_RESERVE_STEP at a
+ * time; *committed is how far it already is. -1 if the system won't give us
+ * the memory.
+ */
+int editorCommit(char *map, size_t reserve, size_t *committed, size_t need) {
+  size_t to;
+
+  if (need <= *committed)
+    return 0;
+  to = (need + KILO_RESERVE_STEP - 1) / KILO_RESERVE_STEP * KILO_RESERVE_STEP;
+  if (to > reserve)
+    to = reserve;
+  if (mprotect(map + *committed, to - *committed,
+               PROT_READ | PROT_WRITE) == -1)
+    return -1;
+  *committed = to;
+  return 0;
+}
+
+/*
+ * Stop following. The text we have stays in our copy, and from now on that's
+ * the only place it comes from, saves included: the file may not have it any
+ * more.
+ */
+void editorFollowStop(void) {
+  struct follow *f = &E.follow;
+
+  f->enabled = 0;
+  if (f->fd != -1)
+    close(f->fd);
+  f->fd = -1;
+  close(E.fd);
+  E.fd = -1;
+}
+
+/*
+ * Compare the bytes just before where we got to with what the file has there
+ * now. If they differ, it was cut short and written again, past where it was,
+ * before we looked.
+ */
+int editorFollowRewritten(void) {
+  char buf[KILO_FOLLOW_CHECK];
+  size_t n = E.mapsize < KILO_FOLLOW_CHECK ? E.mapsize : KILO_FOLLOW_CHECK;
+
+  return n && (pread(E.fd, buf, n, E.mapsize - n) != (ssize_t)n ||
+               memcmp(buf, E.map + E.mapsize - n, n) != 0);
+}
+
+/*
+ * the file was cut short, which isn't something a piece table can follow, so
+ * start over from what it has now. Unless there are changes that were never
+ * saved: starting over would throw them away without a word, so stop
+ * following instead and keep the text they were made to. A save that is
+ * still writing out our copy has to finish before we read over it.
+ */
+void editorFollowReload(void) {
+  if (E.dirty) {
+    editorFollowStop();
+    editorSetStatusMessage("%s was truncated, stopped following it to keep "
+                           "your changes",
+                           E.filename);
+    return;
+  }
+  if (E.save.active) {
+    editorAddTimer(KILO_FOLLOW_POLL_MS, editorFollowCheck);
+    return;
+  }
+
+  editorSearchSwitch(NULL);
+  editorRowsChanged(0, ptLF(E.pt), 0);
+  ptFree(E.pt);
+  E.pt = NULL;
+  E.mapsize = 0;
+  E.idx.count = 0;
+  E.idx.scanned = 0;
+  E.version++;
+  editorUndoClear();
+  editorUndoSaved(editorUndoState());
+  editorHlReset();
+
+  E.cx = E.cy = 0;
+  E.rowoff = E.rowsub = E.coloff = 0;
+  editorInvalidateScreen();
+  editorSetStatusMessage("%s was truncated, reloaded it", E.filename);
+  editorFollowCheck();
+}
+
+/*
+ * see whether the file grew, and if so read in what's new. At most
+ * KILO_FOLLOW_SLICE of it at a time, so that opening a big file, or a burst
+ * of writes to one, doesn't hold up the keys: the rest comes in on the next
+ * turns of the main loop.
+ */
+void editorFollowCheck(void) {
+  struct follow *f = &E.follow;
+  struct stat st;
+  size_t size, old = E.mapsize, want;
+  ssize_t n;
+  int tail;
+
+  if (!f->enabled || fstat(E.fd, &st) == -1)
+    return;
+  size = st.st_size;
+  if (size < old || editorFollowRewritten()) {
+    editorFollowReload();
+    return;
+  }
+  if (size > old && old == f->reserve) {
+    editorFollowStop();
+    editorSetStatusMessage("%s got too big to follow, stopped at %zu MB",
+                           E.filename, f->reserve >> 20);
+    return;
+  }
+
+  want = size - old;
+  if (want > f->reserve - old)
+    want = f->reserve - old;
+  if (want > KILO_FOLLOW_SLICE)
+    want = KILO_FOLLOW_SLICE;
+  if (want == 0)
+    return;
+  if (editorCommit(f->map, f->reserve, &f->committed, old + want) == -1) {
+    editorFollowStop();
+    editorSetStatusMessage("Out of memory following %s, stopped at %zu MB",
+                           E.filename, old >> 20);
+    return;
+  }
+  while ((n = pread(E.fd, f->map + old, want, old)) == -1 && errno == EINTR)
+    ;
+  /* cut short since the fstat(), which we'll hear about */
+  if (n <= 0)
+    return;
+  if (old + n < size)
+    editorAddTimer(0, editorFollowCheck);
+
+  /* a cursor on the last row keeps following the end of the file */
+  tail = old > 0 && editorIndexComplete() && E.cy + 1 >= editorNumRows();
+
+  E.mapsize = old + n;
+  ptAppendOrig(old, n);
+
+  /*
+   * index the new bytes now if we had already indexed the rest, so the rows
+   * they add can be drawn. Otherwise the lazy index gets to them in its time.
+   */
+  if (E.idx.scanned == old) {
+    while (!editorIndexComplete())
+      editorIndexChunk();
+  }
+
+  if (tail && editorNumRows() > 0) {
+    E.cy = editorNumRows() - 1;
+    E.cx = 0;
+  }
+  E.redraw = 1;
+}
+
+void editorFollowPoll(void) {
+  if (!E.follow.enabled)
+    return;
+  editorFollowCheck();
+  editorAddTimer(KILO_FOLLOW_POLL_MS, editorFollowPoll);
+}
+
+void editorFollowStart(void) {
+  struct follow *f = &E.follow;
+
+  f->fd = -1;
+  if (E.fd == -1) {
+    f->enabled = 0;
+    return;
+  }
+
+  f->reserve = KILO_FOLLOW_RESERVE;
+  if ((f->map = editorReserve(&f->reserve)) == NULL)
+    die("mmap");
+  f->committed = 0;
+  E.map = f->map;
+
+#if defined(__linux__)
+  /*
+   * watch the file we have open, which /proc/self/fd leads to, rather than
+   * whatever has its name by the time inotify looks it up. Without /proc, the
+   * name will do if it's still the same file after the watch is set.
+   */
+  {
+    char path[64];
+    struct stat a, b;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", E.fd);
+    f->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->fd != -1 &&
+        inotify_add_watch(f->fd, path, IN_MODIFY | IN_ATTRIB) == -1 &&
+        (inotify_add_watch(f->fd, E.filename, IN_MODIFY | IN_ATTRIB) == -1 ||
+         stat(E.filename, &a) == -1 || fstat(E.fd, &b) == -1 ||
+         a.st_dev != b.st_dev || a.st_ino != b.st_ino)) {
+      close(f->fd);
+      f->fd = -1;
+    }
+  }
+#elif defined(KILO_KQUEUE)
+  f->fd = kqueue();
+  if (f->fd != -1) {
+    struct kevent ev;
+
+    EV_SET(&ev, E.fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB, 0, NULL);
+    if (kevent(f->fd, &ev, 1, NULL, 0, NULL) == -1) {
+      close(f->fd);
+      f->fd = -1;
+    }
+  }
+#endif
+
+  if (f->fd == -1)
+    editorAddTimer(KILO_FOLLOW_POLL_MS, editorFollowPoll);
+  editorFollowCheck();
+}
+
+/* the watch descriptor is readable: drain it and look at the file */
+void editorHandleFollow(void) {
+#if defined(__linux__)
+  char buf[4096];
+
+  while (read(E.follow.fd, buf, sizeof(buf)) > 0)
+    ;
+#elif defined(KILO_KQUEUE)
+  struct kevent evs[8];
+  struct timespec zero = {0, 0};
+
+  while (kevent(E.follow.fd, NULL, 0, evs, 8, &zero) > 0)
+    ;
+#endif
+  editorFollowCheck();
+}
+
+/*** stream ***/
+
+/*
+ * A pipe can't be mapped, and neither can the text inside a compressed file.
+ * So for kilo - (stdin) and kilo FILE.gz (or .zst, .xz, .bz2, which go
+ * through the decompressor of the same name) we reserve address space for
+ * anything we'd reasonably get, as for a followed file, and a reader thread
+ * fills it in as the bytes come. Only what has come in is ever backed by
+ * memory.
+ *
+ * To the rest of the editor that looks just like a file being followed: the
+ * mapping stays where it is, and whenever the reader says it got more, the
+ * new bytes are added to the end of the document and indexed. The first
+ * screen is up as soon as the first read returns, and the rest keeps coming
+ * in while you scroll. There's no file behind it to overwrite, so saving asks
+ * for a name, and not one of a compressed file: what we'd write is the text.
+ */
+#if UINTPTR_MAX > 0xffffffffu
+#define KILO_STREAM_RESERVE ((size_t)1 << 36)
+#else
+#define KILO_STREAM_RESERVE ((size_t)1 << 28)
+#endif
+
+struct streamFilter {
+  const char *suffix;
+  const char *command; /* run as command -dc, reading the file */
+};
+
+struct streamFilter streamFilters[] = {
+    {".gz", "gzip"},
+    {".zst", "zstd"},
+    {".xz", "xz"},
+    {".bz2", "bzip2"},
+};
+
+void *streamReader(void *arg) {
+  struct stream *s = arg;
+  size_t filled = 0;
+
+  for (;;) {
+    size_t room = s->reserve - filled;
+    size_t want = room < KILO_STREAM_CHUNK ? room : KILO_STREAM_CHUNK;
+    ssize_t n;
+
+    if (room == 0) {
+      s->error = EFBIG;
+      break;
+    }
+    if (editorCommit(s->map, s->reserve, &s->committed, filled + want) == -1) {
+      s->error = ENOMEM;
+      break;
+    }
+    n = read(s->in, s->map + filled, want);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == -1)
+        s->error = errno;
+      break;
+    }
+    filled += n;
+    __atomic_store_n(&s->filled, filled, __ATOMIC_RELEASE);
+
+    /* one poke is enough until the main thread has looked */
+    if (!__atomic_exchange_n(&s->poked, 1, __ATOMIC_ACQ_REL))
+      write(E.wakepipe[1], "r", 1);
+  }
+
+  __atomic_store_n(&s->finished, 1, __ATOMIC_RELEASE);
+  write(E.wakepipe[1], "r", 1);
+  return NULL;
+}
+
+/*
+ * kilo - : the document comes in on stdin, so the keys have to come from the
+ * terminal instead. Called before raw mode is set up, on the new stdin.
+ */
+void editorTakeStdin(void) {
+  int tty;
+
+  E.stream.in = dup(STDIN_FILENO);
+  tty = open("/dev/tty", O_RDWR);
+  if (E.stream.in == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    die("/dev/tty");
+  close(tty);
+  E.stream.piped = 1;
+}
+
+/* the filter for filename's suffix, NULL if it isn't one we know */
+struct streamFilter *streamFilterFor(const char *filename) {
+  size_t len = strlen(filename), i;
+
+  for (i = 0; i < sizeof(streamFilters) / sizeof(streamFilters[0]); i++) {
+    struct streamFilter *f = &streamFilters[i];
+    size_t n = strlen(f->suffix);
+
+    if (len > n && strcmp(filename + len - n, f->suffix) == 0)
+      return f;
+  }
+  return NULL;
+}
+
+/* the suffix, if filename is a compressed file we'd decompress */
+const char *streamSuffix(const char *filename) {
+  struct streamFilter *f = streamFilterFor(filename);
+
+  return f ? f->suffix : NULL;
+}
+
+/* run the decompressor for filename, if it has a suffix we know */
+int streamFilter(const char *filename) {
+  struct streamFilter *f = streamFilterFor(filename);
+  int fd, p[2];
+
+  /* one that isn't there yet is a new file like any other */
+  if (f == NULL || (fd = open(filename, O_RDONLY)) == -1)
+    return 0;
+  if (pipe(p) == -1)
+    die("pipe");
+
+  E.stream.child = fork();
+  if (E.stream.child == -1)
+    die("fork");
+  if (E.stream.child == 0) {
+    int null = open("/dev/null", O_WRONLY);
+
+    /* it mustn't write over the screen, its exit status tells us enough */
+    dup2(fd, STDIN_FILENO);
+    dup2(p[1], STDOUT_FILENO);
+    if (null != -1)
+      dup2(null, STDERR_FILENO);
+    execlp(f->command, f->command, "-dc", (char *)NULL);
+    _exit(127);
+  }
+  close(fd);
+  close(p[1]);
+  E.stream.in = p[0];
+  E.stream.command = f->command;
+  return 1;
+}
+
+/* open filename as a stream if it's - or compressed; 0 if it's neither */
+int editorOpenStream(const char *filename) {
+  struct stream *s = &E.stream;
+
+  if (!s->piped && !streamFilter(filename))
+    return 0;
+
+  /* with less address space to be had, we only read as much as fits */
+  s->reserve = KILO_STREAM_RESERVE;
+  if ((s->map = editorReserve(&s->reserve)) == NULL)
+    die("mmap");
+  s->name = strdup(s->piped ? "stdin" : filename);
+
+  /* this is only ever the document we start with */
+  E.map = s->map;
+  E.mapsize = 0;
+  E.fd = -1;
+
+  if (pthread_create(&s->thread, NULL, streamReader, s) != 0)
+    die("pthread_create");
+  s->active = 1;
+  return 1;
+}
+
+/* called from the main loop when the reader has news */
+void editorCheckStream(void) {
+  struct stream *s = &E.stream;
+  size_t old = E.mapsize, filled;
+  int status;
+
+  if (!s->active)
+    return;
+
+  __atomic_store_n(&s->poked, 0, __ATOMIC_RELEASE);
+  filled = __atomic_load_n(&s->filled, __ATOMIC_ACQUIRE);
+  if (filled > old) {
+    E.mapsize = filled;
+    ptAppendOrig(old, filled - old);
+
+    /* as with follow, the rows at the end only get indexed if we're there */
+    if (E.idx.scanned == old) {
+      while (!editorIndexComplete())
+        editorIndexChunk();
+    }
+    E.redraw = 1;
+  }
+
+  if (!__atomic_load_n(&s->finished, __ATOMIC_ACQUIRE) ||
+      __atomic_load_n(&s->filled, __ATOMIC_ACQUIRE) != E.mapsize)
+    return;
+
+  pthread_join(s->thread, NULL);
+  s->active = 0;
+  close(s->in);
+  E.redraw = 1;
+
+  if (s->error == EFBIG)
+    editorSetStatusMessage("Only the first %zu MB were read", s->reserve >> 20);
+  else if (s->error)
+    editorSetStatusMessage("Can't read %s: %s", s->name, strerror(s->error));
+
+  /*
+   * when we stopped reading because we were full (or out of memory), the
+   * decompressor would only block writing into the pipe, or die of SIGPIPE,
+   * so stop it, and don't call that a failure
+   */
+  if (s->child > 0 && (s->error == EFBIG || s->error == ENOMEM)) {
+    kill(s->child, SIGKILL);
+    waitpid(s->child, &status, 0);
+  } else if (s->child > 0 && waitpid(s->child, &status, 0) == s->child &&
+             !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+      editorSetStatusMessage("Can't read %s: no %s to decompress it",
+                             s->name, s->command);
+    else
+      editorSetStatusMessage("%s failed on %s, this may not be all of it",
+                             s->command, s->name);
+  }
+}
+
+/*** instrumentation ***/
+
+long long editorNowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void profAdd(struct profStat *st, long long ns) {
+  st->v[st->next] = ns;
+  st->next = (st->next + 1) % KILO_PROF_SAMPLES;
+  if (st->n < KILO_PROF_SAMPLES)
+    st->n++;
+}
+
+int profCompare(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* the pct-th percentile of the samples we have, in microseconds */
+double profPercentile(struct profStat *st, int pct) {
+  long long sorted[KILO_PROF_SAMPLES];
+
+  if (st->n == 0)
+    return 0;
+  memcpy(sorted, st->v, sizeof(long long) * st->n);
+  qsort(sorted, st->n, sizeof(long long), profCompare);
+  return sorted[(st->n - 1) * pct / 100] / 1000.0;
+}
+
+/*
+ * every write() to the terminal goes through here so it can be counted. A
+ * frame is meant to go out in one write(), but the terminal may take less
+ * than all of it (or a signal may cut it short), and then the rest goes in
+ * more writes, each of which is counted: that's what frame_writes is for.
+ */
+ssize_t editorWrite(const void *buf, size_t len) {
+  const char *p = buf;
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = write(STDOUT_FILENO, p + done, len - done);
+
+    E.prof.writes++;
+    E.prof.frame_writes++;
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+  E.prof.bytes += done;
+  E.prof.frame_bytes += done;
+  return done ? (ssize_t)done : -1;
+}
+
+int editorProfileFormat(char *buf, size_t size) {
+  struct profile *p = &E.prof;
+
+  int len = snprintf(
+      buf, size,
+      "key %.0f/%.0fus draw %.0f/%.0fus flush %.0f/%.0fus "
+      "lat %.0f/%.0fus %luw %luB",
+      profPercentile(&p->keypress, 50), profPercentile(&p->keypress, 99),
+      profPercentile(&p->draw, 50), profPercentile(&p->draw, 99),
+      profPercentile(&p->flush, 50), profPercentile(&p->flush, 99),
+      profPercentile(&p->latency, 50), profPercentile(&p->latency, 99),
+      p->frame_writes, p->frame_bytes);
+
+  /* how fast the last regex search went through the document */
+  if (p->re_ns > 0 && len < (int)size)
+    len += snprintf(buf + len, size - len, " re %.0fMB/s",
+                    p->re_bytes * 1e3 / p->re_ns);
+  return len;
+}
+
+void editorProfileDump(void) {
+  struct profile *p = &E.prof;
+  FILE *fp = fopen(p->dumpfile, "w");
+
+  if (fp == NULL)
+    return;
+
+  fprintf(fp, "frames %lu\nwrites %lu\nbytes %llu\n", p->frames, p->writes,
+          p->bytes);
+  fprintf(fp, "%-10s %10s %10s\n", "(us)", "p50", "p99");
+  fprintf(fp, "%-10s %10.1f %10.1f\n", "keypress",
+          profPercentile(&p->keypress, 50), profPercentile(&p->keypress, 99));
+  fprintf(fp, "%-10s %10.1f %10.1f\n", "draw", profPercentile(&p->draw, 50),
+          profPercentile(&p->draw, 99));
+  fprintf(fp, "%-10s %10.1f %10.1f\n", "flush", profPercentile(&p->flush, 50),
+          profPercentile(&p->flush, 99));
+  fprintf(fp, "%-10s %10.1f %10.1f\n", "latency",
+          profPercentile(&p->latency, 50), profPercentile(&p->latency, 99));
+  if (p->re_ns > 0)
+    fprintf(fp, "regex %.1f MB/s\n", p->re_bytes * 1e3 / p->re_ns);
+  fclose(fp);
+}
+
+void editorInitProfile(void) {
+  const char *env = getenv("KILO_PROFILE");
+
+  if (env == NULL || *env == '\0')
+    return;
+
+  E.prof.enabled = 1;
+  if (strcmp(env, "1") != 0) {
+    E.prof.dumpfile = strdup(env);
+    atexit(editorProfileDump);
+  }
+}
+
+/*** output ***/
+
+/*
+ * Damage tracking: E.shadow holds a copy of every row as we last emitted it,
+ * cell by cell. Only the cells whose contents differ from the shadow copy are
+ * sent again (all of them when the shadow is marked dirty because we can't
+ * trust what's on the terminal, like after a resize), and "\x1b[K" erases
+ * whatever is left of a longer old row, so we never have to clear the whole
+ * screen.
+ *
+ * Getting the cursor to each change and setting its colors is most of what a
+ * frame costs once only changes are sent, and every byte counts on a slow
+ * serial line or a laggy ssh session. So E.term tracks where the cursor is and
+ * which attributes are set, and editorGotoCell() and editorSetAttr() only
+ * send the cheapest way to get from there to what the next cell needs.
+ */
+void editorInvalidateScreen(void) {
+  int y;
+  for (y = 0; y < E.shadowrows; y++)
+    E.shadow[y].dirty = 1;
+  E.term.x = E.term.y = E.term.attr = -1;
+}
+
+/* the text rows plus the status bar and the message bar */
+void editorResizeShadow(void) {
+  int rows = E.screenrows + 2;
+  int y;
+
+  if (E.shadowrows == rows)
+    return;
+
+  for (y = rows; y < E.shadowrows; y++) {
+    free(E.shadow[y].chars);
+    free(E.shadow[y].cells);
+    free(E.shadow[y].attrs);
+  }
+
+  E.shadow = realloc(E.shadow, sizeof(struct screenLine) * rows);
+  if (E.shadow == NULL)
+    die("realloc");
+
+  for (y = E.shadowrows; y < rows; y++) {
+    E.shadow[y].chars = NULL;
+    E.shadow[y].cells = NULL;
+    E.shadow[y].attrs = NULL;
+    E.shadow[y].len = 0;
+  }
+  E.shadowrows = rows;
+  editorInvalidateScreen();
+}
+
+/* an empty row to render into, as wide as the screen, for this frame only */
+void lineInit(struct screenLine *l) {
+  int cols = E.screencols > 0 ? E.screencols : 1;
+
+  l->chars = arenaAlloc(&E.frame, cols);
+  l->cells = NULL;
+  l->attrs = arenaAlloc(&E.frame, cols);
+  l->len = 0;
+  l->cap = cols;
+  l->dirty = 0;
+}
+
+/*
+ * where the bytes of cell x start. As long as every cell of a row is a single
+ * byte (in other words, nearly always) the row has no cells[] at all, and
+ * drawing it costs no more than it did before there was UTF-8.
+ */
+static inline int cellStart(const struct screenLine *l, int x) {
+  return l->cells ? l->cells[x] : x;
+}
+
+/* add a glyph of width 1 or 2, made of s[0..n), unless the row is full */
+void linePutGlyph(struct screenLine *l, const char *s, int n, int width,
+                  int attr) {
+  int used = cellStart(l, l->len), x;
+
+  if (l->len + width > E.screencols)
+    return;
+  if (l->cells == NULL) {
+    l->cells = arenaAlloc(&E.frame, sizeof(int) * (E.screencols + 1));
+    for (x = 0; x <= l->len; x++)
+      l->cells[x] = x;
+  }
+  if (used + n > l->cap) {
+    /* most cells are one byte, which is all lineInit() makes room for */
+    char *chars = arenaAlloc(&E.frame, 2 * (l->cap + n));
+
+    memcpy(chars, l->chars, used);
+    l->chars = chars;
+    l->cap = 2 * (l->cap + n);
+  }
+  memcpy(l->chars + used, s, n);
+  l->attrs[l->len] = attr;
+  l->cells[++l->len] = used + n;
+  if (width == 2) {
+    l->attrs[l->len] = attr;
+    l->cells[++l->len] = used + n;
+  }
+}
+
+static inline void linePut(struct screenLine *l, char c, int attr) {
+  if (l->len >= E.screencols)
+    return;
+  if (l->cells) {
+    linePutGlyph(l, &c, 1, 1, attr);
+    return;
+  }
+  l->chars[l->len] = c;
+  l->attrs[l->len++] = attr;
+}
+
+/* s[0..len) as text: UTF-8, with anything unprintable shown as '?' */
+void linePuts(struct screenLine *l, const char *s, int len, int attr) {
+  int j = 0, kind;
+
+  while (j < len) {
+    int n = editorUtf8Glyph(s + j, len - j, &kind);
+
+    if (kind == GLYPH_BAD || kind == GLYPH_MARK || s[j] == '\t')
+      linePut(l, '?', attr);
+    else
+      linePutGlyph(l, s + j, n, kind == GLYPH_WIDE ? 2 : 1, attr);
+    j += n;
+  }
+}
+
+/* "\x1b[<n><cmd>", leaving out n when it's 1, which is the default */
+int csiMove(char *buf, size_t size, int n, char cmd) {
+  return n == 1 ? snprintf(buf, size, "\x1b[%c", cmd)
+                : snprintf(buf, size, "\x1b[%d%c", n, cmd);
+}
+
+/*
+ * move the cursor to column x of screen row y, by whichever is shortest: an
+ * absolute CUP, or moving relative to where it is with line feeds, CR and
+ * CUU/CUD/CUF/CUB. Line feeds only move down with OPOST off, and never scroll
+ * here because y is always on the screen.
+ */
+void editorGotoCell(struct abuf *ab, int x, int y) {
+  struct terminal *t = &E.term;
+  char abs[32], rel[64], tmp[32];
+  int alen, rlen = 0, dy, dx;
+
+  if (t->x == x && t->y == y)
+    return;
+
+  if (x == 0)
+    alen = y == 0 ? snprintf(abs, sizeof(abs), "\x1b[H")
+                  : snprintf(abs, sizeof(abs), "\x1b[%dH", y + 1);
+  else
+    alen = snprintf(abs, sizeof(abs), "\x1b[%d;%dH", y + 1, x + 1);
+
+  if (t->x < 0 || t->y < 0) {
+    abAppend(ab, abs, alen);
+    t->x = x;
+    t->y = y;
+    return;
+  }
+
+  dy = y - t->y;
+  if (dy > 0 && dy <= csiMove(tmp, sizeof(tmp), dy, 'B')) {
+    memset(rel, '\n', dy);
+    rlen = dy;
+  } else if (dy > 0) {
+    rlen = csiMove(rel, sizeof(rel), dy, 'B');
+  } else if (dy < 0) {
+    rlen = csiMove(rel, sizeof(rel), -dy, 'A');
+  }
+
+  dx = x - t->x;
+  if (dx != 0 && x == 0) {
+    rel[rlen++] = '\r';
+  } else if (dx > 0) {
+    rlen += csiMove(rel + rlen, sizeof(rel) - rlen, dx, 'C');
+  } else if (dx < 0) {
+    int back = csiMove(tmp, sizeof(tmp), -dx, 'D');
+    int cr = 1 + csiMove(tmp, sizeof(tmp), x, 'C');
+
+    if (back <= cr) {
+      rlen += csiMove(rel + rlen, sizeof(rel) - rlen, -dx, 'D');
+    } else {
+      rel[rlen++] = '\r';
+      rlen += csiMove(rel + rlen, sizeof(rel) - rlen, x, 'C');
+    }
+  }
+
+  if (rlen < alen)
+    abAppend(ab, rel, rlen);
+  else
+    abAppend(ab, abs, alen);
+  t->x = x;
+  t->y = y;
+}
+
+/* switch to attributes attr, changing only what differs from the current */
+void editorSetAttr(struct abuf *ab, int attr) {
+  struct terminal *t = &E.term;
+  char buf[32];
+  int len = 2, cur = t->attr;
+
+  if (cur == attr)
+    return;
+
+  memcpy(buf, "\x1b[", 2);
+  if (cur < 0) {
+    /* we don't know what's set, so start over from the defaults */
+    buf[len++] = '0';
+    cur = ATTR_DEFAULT;
+  }
+  if ((cur ^ attr) & ATTR_REVERSE)
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%s", len > 2 ? ";" : "",
+                    attr & ATTR_REVERSE ? "7" : "27");
+  if ((cur ^ attr) & ~ATTR_REVERSE)
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%d", len > 2 ? ";" : "",
+                    attr & ~ATTR_REVERSE);
+  buf[len++] = 'm';
+
+  abAppend(ab, buf, len);
+  t->attr = attr;
+}
+
+/* the bytes of cell x of l; a wide glyph's second cell has none */
+static inline const char *cellChars(const struct screenLine *l, int x,
+                                    int *n) {
+  if (l->cells == NULL) {
+    *n = 1;
+    return l->chars + x;
+  }
+  *n = l->cells[x + 1] - l->cells[x];
+  return l->chars + l->cells[x];
+}
+
+/* a cell the terminal shows as blank after erasing */
+static inline int cellBlank(const struct screenLine *l, int x) {
+  int n;
+  const char *c = cellChars(l, x, &n);
+
+  return n == 1 && *c == ' ' && !(l->attrs[x] & ATTR_REVERSE);
+}
+
+/* write cells [from, to) of l, which start where the cursor already is */
+void editorEmitCells(struct abuf *ab, const struct screenLine *l, int from,
+                     int to) {
+  int x = from, run;
+
+  /* the bytes of neighbouring cells follow each other, so go by attributes */
+  while (x < to) {
+    for (run = x + 1; run < to && l->attrs[run] == l->attrs[x]; run++)
+      ;
+    editorSetAttr(ab, l->attrs[x]);
+    abAppend(ab, l->chars + cellStart(l, x),
+             cellStart(l, run) - cellStart(l, x));
+    x = run;
+  }
+
+  /* in the last column the cursor waits to wrap, and where it is gets murky */
+  E.term.x = to < E.screencols ? to : -1;
+}
+
+/* whether the terminal already shows cell x of l, given it shows old */
+static inline int cellSame(const struct screenLine *old,
+                           const struct screenLine *l, int x) {
+  int n, m;
+  const char *a, *b;
+
+  if (x >= old->len)
+    return cellBlank(l, x);
+  if (old->attrs[x] != l->attrs[x])
+    return 0;
+  if (old->cells == NULL && l->cells == NULL)
+    return old->chars[x] == l->chars[x];
+  a = cellChars(old, x, &m);
+  b = cellChars(l, x, &n);
+  if (n != m)
+    return 0;
+  return n == 1 ? *a == *b : memcmp(a, b, n) == 0;
+}
+
+/* the second cell of a wide glyph can't be written by itself */
+static inline int cellTail(const struct screenLine *l, int x) {
+  return l->cells && x < l->len && l->cells[x] == l->cells[x + 1];
+}
+
+/* queue the cells of row y that differ from what the terminal shows */
+void editorEmitRow(struct abuf *ab, int y, const struct screenLine *l) {
+  struct screenLine *sl = &E.shadow[y];
+  int x = 0, end, blank, bytes = cellStart(l, l->len);
+
+  while (x < l->len) {
+    if (!sl->dirty && cellSame(sl, l, x)) {
+      x++;
+      continue;
+    }
+    while (x > 0 && cellTail(l, x))
+      x--;
+
+    /*
+     * the run of changed cells ends at the first few unchanged ones in a row.
+     * Resending a short gap costs about what moving over it would.
+     */
+    end = x + 1;
+    while (end < l->len) {
+      int gap = 0;
+
+      while (end + gap < l->len && !sl->dirty && cellSame(sl, l, end + gap))
+        gap++;
+      if (gap > 3 || end + gap == l->len)
+        break;
+      end += gap + 1;
+    }
+    while (cellTail(l, end))
+      end++;
+
+    editorGotoCell(ab, x, y);
+    editorEmitCells(ab, l, x, end);
+    x = end;
+  }
+
+  /* erase what's left of the old row, unless it's blank already */
+  blank = l->len;
+  if (!sl->dirty) {
+    int x2;
+
+    for (x2 = sl->len - 1; x2 >= l->len; x2--)
+      if (!cellBlank(sl, x2))
+        break;
+    blank = x2 + 1 > l->len ? x2 + 1 : l->len;
+  } else if (l->len < E.screencols) {
+    blank = E.screencols;
+  }
+  if (blank > l->len) {
+    editorGotoCell(ab, l->len, y);
+    editorSetAttr(ab, E.term.attr < 0 ? ATTR_DEFAULT
+                                      : E.term.attr & ~ATTR_REVERSE);
+    abAppend(ab, "\x1b[K", 3);
+  }
+
+  if (sl->dirty || sl->len != l->len || !sl->cells != !l->cells ||
+      (l->cells &&
+       memcmp(sl->cells, l->cells, sizeof(int) * (l->len + 1)) != 0) ||
+      memcmp(sl->chars, l->chars, bytes) != 0 ||
+      memcmp(sl->attrs, l->attrs, l->len) != 0) {
+    char *chars = realloc(sl->chars, bytes ? bytes : 1);
+    unsigned char *attrs = realloc(sl->attrs, l->len ? l->len : 1);
+
+    if (chars == NULL || attrs == NULL)
+      die("realloc");
+    memcpy(chars, l->chars, bytes);
+    memcpy(attrs, l->attrs, l->len);
+    sl->chars = chars;
+    sl->attrs = attrs;
+
+    free(sl->cells);
+    sl->cells = NULL;
+    if (l->cells) {
+      sl->cells = malloc(sizeof(int) * (l->len + 1));
+      if (sl->cells == NULL)
+        die("malloc");
+      memcpy(sl->cells, l->cells, sizeof(int) * (l->len + 1));
+    }
+    sl->len = l->len;
+    sl->dirty = 0;
+  }
+}
+
+/*
+ * When the view moved by less than a screenful, let the terminal move the rows
+ * it already shows: a scroll region over the text rows, scrolled by n with SU
+ * or SD (or n line feeds at the bottom or reverse indexes at the top, on older
+ * terminals). The shadow moves the same way, with blank rows coming in, so
+ * only the n new rows get drawn. The bars stay put, being outside the region.
+ */
+void editorScrollScreen(struct abuf *ab) {
+  struct screenLine *moved;
+  int rows = E.screenrows, n, y;
+  size_t top = editorVisualLine(E.rowoff, E.rowsub);
+  int up = top > E.shadowoff;
+  size_t dist = up ? top - E.shadowoff : E.shadowoff - top;
+  char buf[32];
+
+  E.shadowoff = top;
+  if (!E.term.scroll || dist == 0 || dist >= (size_t)rows)
+    return;
+  for (y = 0; y < rows; y++)
+    if (E.shadow[y].dirty)
+      return;
+  n = (int)dist;
+
+  snprintf(buf, sizeof(buf), "\x1b[1;%dr", rows);
+  abAppend(ab, buf, strlen(buf));
+  if (E.term.su) {
+    snprintf(buf, sizeof(buf), "\x1b[%d%c", n, up ? 'S' : 'T');
+    abAppend(ab, buf, strlen(buf));
+  } else if (up) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", rows);
+    abAppend(ab, buf, strlen(buf));
+    for (y = 0; y < n; y++)
+      abAppend(ab, "\n", 1);
+  } else {
+    abAppend(ab, "\x1b[H", 3);
+    for (y = 0; y < n; y++)
+      abAppend(ab, "\x1bM", 2);
+  }
+  abAppend(ab, "\x1b[r", 3);
+  E.term.x = E.term.y = 0; /* resetting the region homes the cursor */
+
+  /* rotate the shadow, reusing the buffers of the rows that scrolled away */
+  moved = arenaAlloc(&E.frame, sizeof(*moved) * n);
+  if (up) {
+    memcpy(moved, E.shadow, sizeof(*moved) * n);
+    memmove(E.shadow, E.shadow + n, sizeof(*moved) * (rows - n));
+    memcpy(E.shadow + rows - n, moved, sizeof(*moved) * n);
+    for (y = rows - n; y < rows; y++)
+      E.shadow[y].len = 0;
+  } else {
+    memcpy(moved, E.shadow + rows - n, sizeof(*moved) * n);
+    memmove(E.shadow + n, E.shadow, sizeof(*moved) * (rows - n));
+    memcpy(E.shadow, moved, sizeof(*moved) * n);
+    for (y = 0; y < n; y++)
+      E.shadow[y].len = 0;
+  }
+}
+
+/*
+ * with soft wrap the view moves by screen lines: far enough to show the
+ * cursor's, measuring no more than the screenful of rows above it
+ */
+void editorScrollWrapped(void) {
+  size_t sub = editorWrapSub(E.cy, E.rx), from, cur, top, i;
+
+  E.coloff = 0;
+  if (E.rowsub >= editorWrapLines(E.rowoff))
+    E.rowsub = 0;
+
+  if (E.cy < E.rowoff || (E.cy == E.rowoff && sub < E.rowsub)) {
+    E.rowoff = E.cy;
+    E.rowsub = sub;
+    return;
+  }
+
+  from = E.cy > (size_t)E.screenrows ? E.cy - E.screenrows : 0;
+  wrapCover(from, E.cy);
+  for (i = from; i <= E.cy && editorRowExists(i); i++)
+    editorWrapLines(i);
+  cur = editorVisualLine(E.cy, sub);
+  top = editorVisualLine(E.rowoff, E.rowsub);
+  if (E.cy - E.rowoff >= (size_t)E.screenrows ||
+      cur - top >= (size_t)E.screenrows)
+    editorWrapFind(cur - E.screenrows + 1, &E.rowoff, &E.rowsub);
+}
+
+void editorScroll(void) {
+  size_t len;
+  const char *chars = editorRowChars(E.cy, &len);
+
+  E.rx = editorRowCxToRx(E.cy, chars, len, E.cx);
+  if (E.wrap.enabled) {
+    editorScrollWrapped();
+    return;
+  }
+
+  if (E.cy < E.rowoff)
+    E.rowoff = E.cy;
+  if (E.cy >= E.rowoff + E.screenrows)
+    E.rowoff = E.cy - E.screenrows + 1;
+  if (E.rx < E.coloff)
+    E.coloff = E.rx;
+  if (E.rx >= E.coloff + E.screencols)
+    E.coloff = E.rx - E.screencols + 1;
+}
+
+/*
+ * turn row at into what the terminal should show: tabs expanded to spaces and
+ * control characters replaced, from column first on. That fills nlines screen
+ * lines, one after the other: more than one is how soft wrap draws a long row.
+ */
+void editorRenderRow(struct screenLine *lines, int nlines, size_t at,
+                     size_t first) {
+  size_t len, j, next, c;
+  size_t rx = 0, end = first + (size_t)nlines * E.screencols;
+  int state = E.syntax ? editorHlStartState(at) : LEX_NORMAL;
+  const char *chars = editorRowChars(at, &len);
+  const unsigned char *kinds;
+  unsigned char *hl = NULL;
+  size_t lexlen;
+  int kind;
+
+  /*
+   * only rows that are on screen ever get a full highlight pass, and only as
+   * far as they're shown: every glyph takes at least a column, so none past
+   * end are (bar the odd combining mark). A little more is lexed so a word
+   * cut off by the edge of the screen isn't taken for a keyword.
+   */
+  lexlen = len < end + 64 ? len : end + 64;
+  if (E.syntax) {
+    hl = arenaAlloc(&E.frame, lexlen ? lexlen : 1);
+    editorLexRow(chars, lexlen, state, hl);
+  }
+
+  /* and the search hit we're on, if it's in this row */
+  if (E.search.matchlen) {
+    size_t start = editorRowOffset(at);
+    size_t from = E.search.matchoff, to = from + E.search.matchlen;
+
+    if (from < start + lexlen && to > start) {
+      if (hl == NULL) {
+        hl = arenaAlloc(&E.frame, lexlen);
+        memset(hl, HL_NORMAL, lexlen);
+      }
+      from = from > start ? from - start : 0;
+      to = to - start < lexlen ? to - start : lexlen;
+      memset(&hl[from], HL_MATCH, to - from);
+    }
+  }
+
+  /*
+   * the ASCII at the start of the row, a byte per column. We're looking at
+   * every byte here anyway, so rather than a pass of editorAsciiPrefix() this
+   * just stops at the first byte with its top bit set, or at the ASCII byte
+   * before it, which might be what a combining mark sits on.
+   */
+  for (j = 0; j < len && rx < end; j++) {
+    char c = chars[j];
+    int n = 1;
+    int attr;
+
+    if ((c | (j + 1 < len ? chars[j + 1] : 0)) & 0x80)
+      break;
+    attr = hl && hl[j] != HL_NORMAL ? editorSyntaxToColor(hl[j])
+                                    : ATTR_DEFAULT;
+    if (c == '\t') {
+      n = KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+      c = ' ';
+    } else if (iscntrl((unsigned char)c)) {
+      c = '?';
+    }
+
+    while (n-- > 0 && rx < end) {
+      if (rx >= first)
+        linePut(&lines[(rx - first) / E.screencols], c, attr);
+      rx++;
+    }
+  }
+  if (j == len || rx >= end)
+    return;
+
+  /* and the rest a glyph at a time */
+  kinds = editorRowGlyphs(at, chars, len);
+  for (; j < len && rx < end; j = next) {
+    int attr = hl && j < lexlen && hl[j] != HL_NORMAL
+                   ? editorSyntaxToColor(hl[j])
+                   : ATTR_DEFAULT;
+    const char *g = chars + j;
+    size_t width;
+
+    next = editorGlyphNext(kinds, chars, len, j, &kind);
+    if (*g == '\t' || kind == GLYPH_BAD) {
+      width = *g == '\t' ? KILO_TAB_STOP - (rx % KILO_TAB_STOP) : 1;
+      for (c = rx; c < rx + width && c < end; c++)
+        if (c >= first)
+          linePut(&lines[(c - first) / E.screencols], *g == '\t' ? ' ' : '?',
+                  attr);
+      rx += width;
+      continue;
+    }
+
+    width = kind == GLYPH_WIDE ? 2 : 1;
+    if (kind == GLYPH_MARK) {
+      /* give a stray combining mark a space to sit on */
+      char *based = arenaAlloc(&E.frame, next - j + 1);
+
+      based[0] = ' ';
+      memcpy(based + 1, g, next - j);
+      g = based;
+    }
+    if (rx >= first && rx + width <= end &&
+        (rx - first) / E.screencols ==
+            (rx + width - 1 - first) / E.screencols) {
+      linePutGlyph(&lines[(rx - first) / E.screencols], g,
+                   next - j + (kind == GLYPH_MARK), width, attr);
+    } else {
+      /* a wide glyph cut in half by the edge of the screen */
+      for (c = rx; c < rx + width && c < end; c++)
+        if (c >= first)
+          linePut(&lines[(c - first) / E.screencols], ' ', attr);
+    }
+    rx += width;
+  }
+}
+
+/*
+ * the cursors of a column, other than the terminal's own, on row at. It was
+ * drawn into nlines screen lines starting from column first.
+ */
+void editorDrawBlockCursor(struct screenLine *lines, int nlines, size_t at,
+                           size_t first) {
+  struct screenLine *l;
+  size_t top, bottom, len, x;
+  const char *chars;
+
+  editorBlockRows(&top, &bottom);
+  if (!E.block.active || at == E.cy || at < top || at > bottom)
+    return;
+  chars = editorRowChars(at, &len);
+  if (E.rx < first || editorRowRxToCx(at, chars, len, E.rx) == (size_t)-1)
+    return;
+  x = E.rx - first;
+  if (x / E.screencols >= (size_t)nlines)
+    return;
+
+  l = &lines[x / E.screencols];
+  x %= E.screencols;
+  while ((size_t)l->len < x)
+    linePut(l, ' ', ATTR_DEFAULT);
+  if ((size_t)l->len == x)
+    linePut(l, ' ', ATTR_DEFAULT | ATTR_REVERSE);
+  else
+    l->attrs[x] |= ATTR_REVERSE;
+}
+
+void editorDrawRows(struct abuf *ab) {
+  struct screenLine *lines;
+  size_t filerow = E.rowoff, sub = E.wrap.enabled ? E.rowsub : 0;
+  int y = 0, n, i;
+
+  /* index everything on screen in one go, instead of row by row */
+  editorIndexRows(E.rowoff + E.screenrows);
+  if (E.wrap.enabled)
+    wrapCover(E.rowoff, E.rowoff + E.screenrows);
+
+  lines = arenaAlloc(&E.frame, sizeof(*lines) * E.screenrows);
+  while (y < E.screenrows) {
+    n = 1;
+    if (E.wrap.enabled && editorRowExists(filerow)) {
+      size_t left = editorWrapLines(filerow) - sub;
+      n = left < (size_t)(E.screenrows - y) ? (int)left : E.screenrows - y;
+    }
+
+    for (i = 0; i < n; i++)
+      lineInit(&lines[i]);
+    if (!editorRowExists(filerow))
+      linePut(&lines[0], '~', ATTR_DEFAULT);
+    else if (E.wrap.enabled)
+      editorRenderRow(lines, n, filerow, sub * E.screencols);
+    else
+      editorRenderRow(lines, 1, filerow, E.coloff);
+    if (E.block.active && editorRowExists(filerow))
+      editorDrawBlockCursor(lines, n, filerow,
+                            E.wrap.enabled ? sub * E.screencols : E.coloff);
+
+    for (i = 0; i < n; i++)
+      editorEmitRow(ab, y + i, &lines[i]);
+    y += n;
+    sub = 0;
+    filerow++;
+  }
+}
+
+void editorDrawStatusBar(struct abuf *ab) {
+  struct screenLine line;
+  char status[80], rstatus[80];
+  const char *name = E.filename ? E.filename : E.stream.name;
+  int len, rlen;
+
+  /* until all of the file is in and indexed we only know a lower bound */
+  if (E.stream.active)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%zu/%zu+", E.cy + 1,
+                    editorNumRows());
+  else if (E.view.enabled && !editorViewComplete())
+    rlen = snprintf(rstatus, sizeof(rstatus), "%zu/%zu+ (%d%%)", E.cy + 1,
+                    editorNumRows(), editorViewPercent());
+  else if (editorIndexComplete())
+    rlen = snprintf(rstatus, sizeof(rstatus), "%zu/%zu", E.cy + 1,
+                    editorNumRows());
+  else
+    rlen = snprintf(rstatus, sizeof(rstatus), "%zu/%zu+ (%d%%)", E.cy + 1,
+                    editorNumRows(),
+                    (int)(E.idx.scanned * 100 / E.mapsize));
+  len = snprintf(status, sizeof(status), "%.20s%s",
+                 name ? name : "[No Name]",
+                 E.dirty ? " (modified)" : "");
+  if (E.save.active)
+    len += snprintf(status + len, sizeof(status) - len, " [saving %d%%]",
+                    editorSavePercent());
+  if (E.view.enabled && len < (int)sizeof(status))
+    len += snprintf(status + len, sizeof(status) - len, " [read only]");
+  if (E.follow.enabled && len < (int)sizeof(status))
+    len += snprintf(status + len, sizeof(status) - len, " [following]");
+  if (E.stream.active && len < (int)sizeof(status))
+    len += snprintf(status + len, sizeof(status) - len, " [reading %zu MB]",
+                    E.mapsize >> 20);
+  if (E.block.active && len < (int)sizeof(status)) {
+    size_t first, last;
+
+    editorBlockRows(&first, &last);
+    len += snprintf(status + len, sizeof(status) - len, " [%zu cursors]",
+                    last - first + 1);
+  }
+  if ((E.search.job || E.search.error) && len < (int)sizeof(status))
+    len += editorSearchStatus(status + len, sizeof(status) - len);
+
+  if (len > (int)sizeof(status) - 1)
+    len = sizeof(status) - 1;
+  lineInit(&line);
+  linePuts(&line, status, len, ATTR_DEFAULT | ATTR_REVERSE);
+  while (line.len < E.screencols) {
+    if (E.screencols - line.len == rlen) {
+      linePuts(&line, rstatus, rlen, ATTR_DEFAULT | ATTR_REVERSE);
+      break;
+    }
+    linePut(&line, ' ', ATTR_DEFAULT | ATTR_REVERSE);
+  }
+
+  editorEmitRow(ab, E.screenrows, &line);
+}
+
+/*
+ * ask for a line of input in the message bar. Returns what was typed, or NULL
+ * if the user hit ESC. The caller frees it. If there's a callback, it gets
+ * called with what's been typed so far after every key. Enter on an empty
+ * line only counts if empty is set.
+ */
+char *editorPromptLine(char *prompt, void (*callback)(char *, int),
+                       int empty) {
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      /* the whole character, not just its last byte */
+      while (buflen != 0 && (buf[buflen - 1] & 0xc0) == 0x80)
+        buflen--;
+      if (buflen != 0)
+        buflen--;
+      buf[buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      if (callback)
+        callback(buf, c);
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0 || empty) {
+        editorSetStatusMessage("");
+        if (callback)
+          callback(buf, c);
+        return buf;
+      }
+    } else if (c < 0x110000 && !(c < 0x80 ? iscntrl(c) : c < 0xa0)) {
+      /* no C0 or C1 controls, they'd be sent to the terminal as they are */
+      if (buflen + 4 >= bufsize) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buflen += utf8Encode(c, buf + buflen);
+      buf[buflen] = '\0';
+    }
+
+    if (callback)
+      callback(buf, c);
+  }
+}
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+  return editorPromptLine(prompt, callback, 0);
+}
+
+void editorDrawMessageBar(struct abuf *ab) {
+  struct screenLine line;
+  char prof[160];
+  const char *msg = E.statusmsg;
+  int len = strlen(msg);
+
+  /* the profile overlay gives way to real messages */
+  if (len == 0 && E.prof.enabled && E.prof.dumpfile == NULL) {
+    len = editorProfileFormat(prof, sizeof(prof));
+    msg = prof;
+  }
+
+  lineInit(&line);
+  linePuts(&line, msg, len, ATTR_DEFAULT);
+  editorEmitRow(ab, E.screenrows + 1, &line);
+}
+
+void editorRefreshScreen(void) {
+  struct abuf ab = ABUF_ARENA(&E.frame);
+  long long t0, t1, t2;
+
+  /* editorApplyResize() draws everything once the size has settled */
+  if (E.resizing)
+    return;
+
+  /* everything from the last frame is garbage now */
+  arenaReset(&E.frame);
+
+  editorScroll();
+  editorResizeShadow();
+
+  /*
+   * the terminal shows the frame all at once, rather than as it arrives. If
+   * it can't, hide the cursor so it isn't seen jumping around the screen.
+   */
+  if (E.term.sync)
+    abAppend(&ab, "\x1b[?2026h", 8);
+  else
+    abAppend(&ab, "\x1b[?25l", 6);
+  editorScrollScreen(&ab);
+  t0 = E.prof.enabled ? editorNowNs() : 0;
+  editorDrawRows(&ab);
+  if (E.prof.enabled)
+    profAdd(&E.prof.draw, editorNowNs() - t0);
+  editorDrawStatusBar(&ab);
+  editorDrawMessageBar(&ab);
+
+  if (E.wrap.enabled) {
+    size_t sub = editorWrapSub(E.cy, E.rx);
+    size_t x = E.rx - sub * E.screencols;
+
+    size_t y = editorVisualLine(E.cy, sub) -
+               editorVisualLine(E.rowoff, E.rowsub);
+
+    editorGotoCell(&ab, x < (size_t)E.screencols ? (int)x : E.screencols - 1,
+                   y < (size_t)E.screenrows ? (int)y : E.screenrows - 1);
+  } else {
+    editorGotoCell(&ab, (int)(E.rx - E.coloff), (int)(E.cy - E.rowoff));
+  }
+  if (E.term.sync)
+    abAppend(&ab, "\x1b[?2026l", 8);
+  else
+    abAppend(&ab, "\x1b[?25h", 6);
+
+  /*
+   * the whole frame goes out to the terminal in a single write(), unless the
+   * terminal takes it in pieces; the overlay shows how many it took
+   */
+  E.prof.frame_writes = 0;
+  E.prof.frame_bytes = 0;
+  t1 = E.prof.enabled ? editorNowNs() : 0;
+  editorWrite(ab.b, ab.len);
+  abFree(&ab);
+
+  E.prof.frames++;
+  if (E.prof.enabled) {
+    t2 = editorNowNs();
+    profAdd(&E.prof.flush, t2 - t1);
+    if (E.prof.key_at) {
+      profAdd(&E.prof.latency, t2 - E.prof.key_at);
+      E.prof.key_at = 0;
+    }
+  }
+}
+
+void editorClearStatusMessage(void) {
+  E.statusmsg[0] = '\0';
+  E.redraw = 1;
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+
+  E.redraw = 1;
+  editorAddTimer(KILO_STATUS_MSG_MS, editorClearStatusMessage);
+}
+
+/*** input ***/
+
+/*
+ * Everything up to the closing "\x1b[201~" is pasted text. We read it
+ * straight out of the input buffer into one block and hand that to the
+ * storage engine as a single insert, so a 5 MB paste is a memcpy, not five
+ * million trips through editorProcessKeypress().
+ */
+void editorPaste(void) {
+  static const char end[] = "\x1b[201~";
+  struct abuf text = ABUF_INIT;
+  size_t matched = 0, i, j;
+  char c;
+
+  while (matched < sizeof(end) - 1) {
+    /*
+     * copy everything up to the next '\x1b' (or where the ring wraps) in one
+     * go; only the bytes that might be the end marker go one at a time
+     */
+    if (matched == 0 && (editorInputPending() || editorReadInput())) {
+      unsigned at = E.in.tail % KILO_INPUT_RING;
+      size_t run = E.in.head - E.in.tail;
+      char *esc;
+
+      if (run > KILO_INPUT_RING - at)
+        run = KILO_INPUT_RING - at;
+      esc = memchr(E.in.buf + at, '\x1b', run);
+      if (esc)
+        run = esc - (E.in.buf + at);
+      abAppend(&text, E.in.buf + at, run);
+      E.in.tail += run;
+      if (run)
+        continue;
+    }
+
+    if (!editorNextByte(&c)) {
+      /* a paste isn't typed, if the rest doesn't come we just stop */
+      struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+      int n = poll(&pfd, 1, 1000);
+      if (n == -1 && errno != EINTR)
+        die("poll");
+      if (n == 0)
+        break;
+      continue;
+    }
+
+    if (c == end[matched]) {
+      matched++;
+      continue;
+    }
+    /* not the end marker after all; '\x1b' only appears at its start */
+    abAppend(&text, end, matched);
+    matched = c == end[0];
+    if (!matched)
+      abAppend(&text, &c, 1);
+  }
+
+  /* terminals send newlines in pastes as "\r", turn those (and "\r\n") into
+   * "\n" */
+  for (i = 0, j = 0; i < (size_t)text.len; i++) {
+    if (text.b[i] == '\r') {
+      if (i + 1 < (size_t)text.len && text.b[i + 1] == '\n')
+        continue;
+      text.b[i] = '\n';
+    }
+    text.b[j++] = text.b[i];
+  }
+
+  if (j)
+    editorInsertBlock(text.b, j);
+  abFree(&text);
+}
+
+void editorMoveCursor(int key) {
+  size_t len;
+
+  editorRowChars(E.cy, &len);
+
+  switch (key) {
+  case ARROW_LEFT:
+    if (E.cx != 0) {
+      E.cx = editorGlyphStart(E.cy, E.cx - 1);
+    } else if (E.cy > 0) {
+      E.cy--;
+      editorRowChars(E.cy, &E.cx);
+    }
+    break;
+  case ARROW_RIGHT:
+    if (E.cx < len) {
+      E.cx = editorGlyphEnd(E.cy, E.cx);
+    } else if (editorCursorRowOk(E.cy + 1)) {
+      E.cy++;
+      E.cx = 0;
+    }
+    break;
+  case ARROW_UP:
+    if (E.cy != 0)
+      E.cy--;
+    break;
+  case ARROW_DOWN:
+    if (editorCursorRowOk(E.cy + 1))
+      E.cy++;
+    break;
+  }
+
+  /*
+   * snap to the end of the row when moving onto a shorter one, and to the
+   * start of a character when landing in the middle of one
+   */
+  editorRowChars(E.cy, &len);
+  if (E.cx > len)
+    E.cx = len;
+  if (key == ARROW_UP || key == ARROW_DOWN)
+    E.cx = editorGlyphStart(E.cy, E.cx);
+}
+
+void editorProcessKeypress(void) {
+  static int quit_times = KILO_QUIT_TIMES;
+
+  int c = editorReadKey();
+  size_t len;
+
+  editorUndoBreak();
+  if (E.view.enabled && editorViewRefuses(c))
+    return;
+  if (E.block.active && editorBlockKey(c)) {
+    quit_times = KILO_QUIT_TIMES;
+    E.redraw = 1;
+    return;
+  }
+  switch (c) {
+  case '\r':
+    editorInsertNewline();
+    break;
+
+  case CTRL_KEY('q'):
+    if (E.dirty && quit_times > 0) {
+      editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                             "Press Ctrl-Q %d more times to quit.",
+                             quit_times);
+      quit_times--;
+      return;
+    }
+    /* don't leave a half written temporary file behind */
+    editorFinishSave();
+    editorStopSidecar();
+    editorJournalDiscard();
+    write(STDOUT_FILENO, "\x1b[m\x1b[2J", 7);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+    break;
+
+  case CTRL_KEY('s'):
+    editorSave();
+    break;
+
+  case CTRL_KEY('f'):
+    editorFind();
+    break;
+
+  case CTRL_KEY('r'):
+    editorReplace();
+    break;
+
+  case HOME_KEY:
+    E.cx = 0;
+    break;
+
+  case END_KEY:
+    editorRowChars(E.cy, &len);
+    E.cx = len;
+    break;
+
+  case CTRL_KEY('w'):
+    editorToggleWrap();
+    break;
+
+  case CTRL_KEY('g'):
+    editorGoTo();
+    break;
+
+  case CTRL_KEY('b'):
+    editorBlockToggle();
+    break;
+
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+
+  case CTRL_KEY('y'):
+    editorRedo();
+    break;
+
+  case PAGE_UP:
+  case PAGE_DOWN: {
+    int times = E.screenrows;
+
+    if (c == PAGE_UP) {
+      E.cy = E.rowoff;
+    } else {
+      E.cy = E.rowoff + E.screenrows - 1;
+      /* this is the only place the index has to grow to get the next page */
+      editorIndexRows(E.cy);
+      if (E.cy >= editorNumRows())
+        E.cy = editorNumRows() ? editorNumRows() - 1 : 0;
+    }
+
+    while (times--)
+      editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+  } break;
+
+  case PASTE_START:
+    editorPaste();
+    break;
+
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    if (c == DEL_KEY)
+      editorMoveCursor(ARROW_RIGHT);
+    editorDelChar();
+    break;
+
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    editorMoveCursor(c);
+    break;
+
+  case CTRL_KEY('l'):
+  case '\x1b':
+    return;
+
+  default:
+    if (c > 0x10ffff || (c != '\t' && c < 0x80 && iscntrl(c)))
+      return;
+    editorInsertChar(c);
+    break;
+  }
+
+  quit_times = KILO_QUIT_TIMES;
+  E.redraw = 1;
+}
+
+/*** events ***/
+
+/*
+ * The main loop sleeps in poll() until one of three things happens: a key is
+ * pressed, the terminal is resized (SIGWINCH), or a timer is due. The screen
+ * is only redrawn when one of those actually changed something (E.redraw), so
+ * an idle editor uses no CPU at all.
+ */
+long long editorNow(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* run fn once, ms milliseconds from now. If fn is already due, postpone it */
+void editorAddTimer(int ms, void (*fn)(void)) {
+  int i;
+  for (i = 0; i < EDITOR_MAX_TIMERS; i++) {
+    if (E.timers[i].deadline != 0 && E.timers[i].fn == fn) {
+      E.timers[i].deadline = editorNow() + ms;
+      return;
+    }
+  }
+  for (i = 0; i < EDITOR_MAX_TIMERS; i++) {
+    if (E.timers[i].deadline == 0) {
+      E.timers[i].deadline = editorNow() + ms;
+      if (E.timers[i].deadline == 0)
+        E.timers[i].deadline = 1;
+      E.timers[i].fn = fn;
+      return;
+    }
+  }
+}
+
+/* the poll() timeout until the next timer is due, or -1 to wait forever */
+int editorNextTimeout(void) {
+  long long now = editorNow();
+  long long next = -1;
+  int i;
+
+  for (i = 0; i < EDITOR_MAX_TIMERS; i++) {
+    long long d = E.timers[i].deadline;
+    if (d == 0)
+      continue;
+    if (d <= now)
+      return 0;
+    if (next == -1 || d - now < next)
+      next = d - now;
+  }
+  return (int)next;
+}
+
+void editorRunTimers(void) {
+  long long now = editorNow();
+  int i;
+
+  for (i = 0; i < EDITOR_MAX_TIMERS; i++) {
+    if (E.timers[i].deadline != 0 && E.timers[i].deadline <= now) {
+      void (*fn)(void) = E.timers[i].fn;
+      E.timers[i].deadline = 0;
+      fn();
+    }
+  }
+}
+
+/*
+ * signal handlers can't safely do much, so the SIGWINCH handler just writes a
+ * byte into a pipe (the "self-pipe trick") and poll() wakes up the main loop.
+ */
+void editorHandleSigwinch(int sig) {
+  int saved_errno = errno;
+  (void)sig;
+
+  write(E.sigpipe[1], "w", 1);
+  errno = saved_errno;
+}
+
+/* SIGHUP and SIGTERM: the connection dropped, or we're being shut down */
+void editorHandleHangup(int sig) {
+  int saved_errno = errno;
+  (void)sig;
+
+  write(E.sigpipe[1], "h", 1);
+  errno = saved_errno;
+}
+
+/* leave room for the status bar and the message bar */
+void editorUpdateWindowSize(void) {
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    die("getWindowSize");
+  E.screenrows -= 2;
+  if (E.screenrows < 1)
+    E.screenrows = 1;
+}
+
+/* the size has held still for a while, see editorHandleResize() */
+void editorApplyResize(void) {
+  E.resizing = 0;
+  editorUpdateWindowSize();
+
+  /*
+   * we don't know what the terminal did to its contents while resizing, even
+   * if it ended up the size it started at: a shrink may have clipped or
+   * reflowed them. So every row on screen gets drawn again. That's all
+   * though: nothing about the rows off screen depends on the size of the
+   * window.
+   */
+  editorInvalidateScreen();
+  E.redraw = 1;
+}
+
+/*
+ * Dragging the edge of a window sends a stream of SIGWINCHs, and resizing
+ * means painting the whole screen, which over a slow link could take longer
+ * than the next signal takes to arrive. So we only resize once the size has
+ * stopped changing for KILO_RESIZE_MS: each signal pushes the timer back.
+ */
+void editorHandleResize(void) {
+  char buf[64];
+  ssize_t n;
+
+  /* drain the pipe, several signals in a row only need one resize */
+  while ((n = read(E.sigpipe[0], buf, sizeof(buf))) > 0) {
+    /* a hangup comes down the same pipe: get the journal out and go */
+    if (memchr(buf, 'h', n)) {
+      editorJournalSync();
+      exit(1);
+    }
+  }
+
+  /*
+   * the terminal may have moved the cursor and changed what it shows, and
+   * until the size settles, a frame drawn for the old one would only add to
+   * the mess
+   */
+  editorInvalidateScreen();
+  E.resizing = 1;
+  editorAddTimer(KILO_RESIZE_MS, editorApplyResize);
+}
+
+void editorHandleKey(void) {
+  if (E.prof.enabled) {
+    long long t0 = editorNowNs();
+
+    editorProcessKeypress();
+    profAdd(&E.prof.keypress, editorNowNs() - t0);
+    if (E.prof.key_at == 0)
+      E.prof.key_at = t0;
+  } else {
+    editorProcessKeypress();
+  }
+}
+
+/*
+ * run every key that has arrived, and keep reading until the terminal has
+ * nothing more for us. Only then does the main loop get to draw, so a paste
+ * costs one frame no matter how long it is.
+ */
+void editorProcessInput(void) {
+  while (editorReadInput() > 0 || editorInputPending()) {
+    while (editorInputPending())
+      editorHandleKey();
+  }
+}
+
+/* one of the background threads has news for us */
+void editorHandleWakeup(void) {
+  char buf[64];
+
+  while (read(E.wakepipe[0], buf, sizeof(buf)) > 0)
+    ;
+  editorCheckSave();
+  editorCheckSearch();
+  editorCheckSidecar();
+  editorCheckStream();
+  editorCheckView();
+}
+
+void editorWaitForEvents(void) {
+  struct pollfd fds[5] = {
+      {STDIN_FILENO, POLLIN, 0},
+      {E.sigpipe[0], POLLIN, 0},
+      {E.wakepipe[0], POLLIN, 0},
+      {E.follow.enabled ? E.follow.fd : -1, POLLIN, 0},
+      {E.server.fd, POLLIN, 0},
+  };
+
+  if (poll(fds, 5, editorNextTimeout()) == -1) {
+    if (errno == EINTR)
+      return;
+    die("poll");
+  }
+
+  if (fds[4].revents & (POLLIN | POLLHUP | POLLERR))
+    editorCheckServer();
+  if (fds[3].revents & POLLIN)
+    editorHandleFollow();
+  if (fds[2].revents & POLLIN)
+    editorHandleWakeup();
+  if (fds[1].revents & POLLIN)
+    editorHandleResize();
+  if (fds[0].revents & POLLIN)
+    editorProcessInput();
+  editorRunTimers();
+}
+
+void editorInitEvents(void) {
+  struct sigaction sa;
+
+  if (pipe(E.sigpipe) == -1 || pipe(E.wakepipe) == -1)
+    die("pipe");
+  fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(E.wakepipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.wakepipe[1], F_SETFL, O_NONBLOCK);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleSigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+  sa.sa_handler = editorHandleHangup;
+  if (sigaction(SIGHUP, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+    die("sigaction");
+}
+
+/*** benchmarks ***/
+
+/*
+ * kilo --bench-scan FILE indexes FILE with every scanner this CPU supports and
+ * prints the throughput of each, so the SIMD paths can be compared against the
+ * portable one (and against each other).
+ */
+int editorScanBenchmark(const char *filename) {
+  struct lineIndex idx = {NULL, 0, 0, 0, 0};
+  size_t expect = 0;
+  int i;
+
+  editorOpen((char *)filename);
+  if (E.mapsize == 0) {
+    fprintf(stderr, "%s: nothing to scan\n", filename);
+    return 1;
+  }
+
+  for (i = 0; i < KILO_NSCANNERS; i++) {
+    struct newlineScanner *sc = &scanners[i];
+    long long start, elapsed;
+    int runs = 0;
+
+    if (!editorScannerSupported(sc))
+      continue;
+
+    /* one untimed run to fault the file in and size the index */
+    idx.count = 0;
+    sc->scan(&idx, E.map, E.mapsize, 0);
+    if (expect == 0)
+      expect = idx.count;
+
+    start = editorNow();
+    do {
+      idx.count = 0;
+      sc->scan(&idx, E.map, E.mapsize, 0);
+      runs++;
+    } while ((elapsed = editorNow() - start) < 1000);
+
+    printf("%-8s %8.2f GB/s  %zu lines%s\n", sc->name,
+           (double)E.mapsize * runs / (elapsed / 1000.0) / 1e9, idx.count,
+           idx.count == expect ? "" : "  MISMATCH");
+  }
+
+  free(idx.nl);
+  return 0;
+}
+
+/*
+ * kilo --bench-keys SCRIPT [FILE] runs the editor without a terminal: the
+ * window size comes from getWindowSize()'s stub, keystrokes are replayed from
+ * SCRIPT, and frames go to /dev/null, but through the same editorWrite() path
+ * so every byte is counted. When the script runs out (or hits Ctrl-Q) we
+ * report keys per second, bytes written per key and frame counts.
+ *
+ * Each line of SCRIPT is "COUNT KEYS": KEYS is typed COUNT times. KEYS may use
+ * \e (escape), \r, \t, \\ and \xNN, and ^X for Ctrl-X. Lines starting with #
+ * are comments.
+ */
+void editorBenchDecodeLine(const char *keys, struct abuf *out) {
+  const char *p = keys;
+
+  while (*p && *p != '\n') {
+    char c = *p++;
+
+    if (c == '\\' && *p) {
+      c = *p++;
+      switch (c) {
+      case 'e':
+        c = '\x1b';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'x': {
+        char hex[3] = {0, 0, 0};
+        if (p[0])
+          hex[0] = *p++;
+        if (p[0] && p[0] != '\n')
+          hex[1] = *p++;
+        c = (char)strtol(hex, NULL, 16);
+      } break;
+      }
+    } else if (c == '^' && *p && *p != '\n') {
+      c = CTRL_KEY(*p++);
+    }
+    abAppend(out, &c, 1);
+  }
+}
+
+/* turn SCRIPT into raw keystrokes and make that file our stdin */
+void editorBenchLoadScript(const char *script) {
+  FILE *in = fopen(script, "r");
+  FILE *keys = tmpfile();
+  struct abuf line = ABUF_INIT;
+  char *buf = NULL;
+  size_t cap = 0;
+
+  if (in == NULL)
+    die(script);
+  if (keys == NULL)
+    die("tmpfile");
+
+  while (getline(&buf, &cap, in) != -1) {
+    char *rest;
+    long count;
+
+    if (buf[0] == '#' || buf[0] == '\n')
+      continue;
+    count = strtol(buf, &rest, 10);
+    if (rest == buf || *rest != ' ')
+      continue;
+
+    line.len = 0;
+    editorBenchDecodeLine(rest + 1, &line);
+    while (count-- > 0)
+      fwrite(line.b, 1, line.len, keys);
+  }
+  free(buf);
+  abFree(&line);
+  fclose(in);
+
+  fflush(keys);
+  E.bench.script_size = ftello(keys);
+  if (dup2(fileno(keys), STDIN_FILENO) == -1)
+    die("dup2");
+  lseek(STDIN_FILENO, 0, SEEK_SET);
+}
+
+int editorBenchInputLeft(void) {
+  return editorInputPending() ||
+         lseek(STDIN_FILENO, 0, SEEK_CUR) < E.bench.script_size;
+}
+
+void editorBenchReport(void) {
+  struct benchRun *b = &E.bench;
+  double secs = (editorNow() - b->start) / 1000.0;
+  unsigned long keys = b->keys ? b->keys : 1;
+
+  if (secs <= 0)
+    secs = 0.001;
+  fprintf(b->report, "keys          %lu\n", b->keys);
+  fprintf(b->report, "keys/s        %.0f\n", b->keys / secs);
+  fprintf(b->report, "frames        %lu\n", E.prof.frames);
+  fprintf(b->report, "bytes         %llu\n", E.prof.bytes);
+  fprintf(b->report, "bytes/key     %.1f\n", (double)E.prof.bytes / keys);
+  fprintf(b->report, "writes/frame  %.2f\n",
+          E.prof.frames ? (double)E.prof.writes / E.prof.frames : 0);
+  fclose(b->report);
+}
+
+/*
+ * The keys of a benchmark come from a file, which is always readable, so
+ * editorReadKey() never waits in poll() where background work reports in.
+ * It sees to that here between keys instead. A replace is waited for, since
+ * the keys after ^R assume it happened; a save only at the end (wait), so
+ * that it isn't cut short and doesn't leave its temporary file behind.
+ */
+void editorBenchService(int wait) {
+  struct pollfd fd = {E.wakepipe[0], POLLIN, 0};
+  int busy;
+
+  for (;;) {
+    busy = (E.search.job && E.search.replace) || (wait && E.save.active);
+    if (poll(&fd, 1, busy ? editorNextTimeout() : 0) > 0)
+      editorHandleWakeup();
+    editorRunTimers();
+    if (!busy)
+      return;
+  }
+}
+
+int editorKeyBenchmark(const char *script, char *filename) {
+  int devnull;
+
+  E.headless = 1;
+  editorBenchLoadScript(script);
+
+  /* keep a copy of the real stdout for the report, frames go nowhere */
+  E.bench.report = fdopen(dup(STDOUT_FILENO), "w");
+  devnull = open("/dev/null", O_WRONLY);
+  if (E.bench.report == NULL || devnull == -1 ||
+      dup2(devnull, STDOUT_FILENO) == -1)
+    die("bench");
+  close(devnull);
+
+  initEditor();
+  if (filename)
+    editorOpen(filename);
+  atexit(editorBenchReport);
+
+  E.bench.start = editorNow();
+  editorRefreshScreen();
+  while (editorBenchInputLeft()) {
+    editorProcessKeypress();
+    E.bench.keys++;
+    if (E.redraw) {
+      editorRefreshScreen();
+      E.redraw = 0;
+    }
+  }
+  editorBenchService(1);
+  return 0;
+}
+
+/*** init ***/
+/*
+ * KILO_ALLOC_STATS=1 prints the allocator counters on exit, to check that the
+ * frame arena settles down to one block and the node pool recycles nodes
+ */
+void editorDumpAllocStats(void) {
+  fprintf(stderr,
+          "frame arena: %lu resets, %lu allocs, %lu mallocs, %zu bytes peak\r\n"
+          "node pool: %lu live, %lu allocs, %lu slabs\r\n",
+          E.frame.resets, E.frame.allocs, E.frame.mallocs, E.frame.high_water,
+          E.nodes.live, E.nodes.allocs, E.nodes.slabs);
+}
+
+void initEditor(void) {
+  E.redraw = 1;
+  E.journal.fd = -1;
+  E.server.fd = -1;
+  editorInitProfile();
+  editorUndoInit();
+  if (getenv("KILO_ALLOC_STATS"))
+    atexit(editorDumpAllocStats);
+
+  editorUpdateWindowSize();
+  editorInitEvents();
+  editorProbeTerminal();
+  pthread_mutex_init(&E.search.lock, NULL);
+  pthread_cond_init(&E.search.wake, NULL);
+  pthread_mutex_init(&E.gate.lock, NULL);
+  pthread_cond_init(&E.gate.cond, NULL);
+}
+
+int main(int argc, char *argv[]) {
+  editorInitScanner();
+  E.nodes.size = sizeof(struct pieceNode);
+
+  if (argc == 3 && strcmp(argv[1], "--bench-scan") == 0)
+    return editorScanBenchmark(argv[2]);
+  if ((argc == 3 || argc == 4) && strcmp(argv[1], "--bench-keys") == 0)
+    return editorKeyBenchmark(argv[2], argc == 4 ? argv[3] : NULL);
+  if ((argc == 2 || argc == 3) && strcmp(argv[1], "--serve") == 0)
+    return editorServe(argc == 3 ? argv[2] : NULL);
+
+  /* kilo -f FILE follows FILE as it grows */
+  if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+    E.follow.enabled = 1;
+    argv++;
+    argc--;
+  }
+
+  /* kilo - reads stdin, so the terminal has to be found first */
+  if (argc >= 2 && strcmp(argv[1], "-") == 0)
+    editorTakeStdin();
+
+  enableRawMode();
+  initEditor();
+  /* kilo -v FILE views FILE however big it is */
+  if (argc >= 3 && strcmp(argv[1], "-v") == 0)
+    editorOpenView(argv[2]);
+  else if (argc >= 2 && !editorOpenStream(argv[1]))
+    editorOpen(argv[1]);
+  if (E.follow.enabled)
+    editorFollowStart();
+
+  /* opening the file may have had something more important to say */
+  if (E.statusmsg[0] == '\0')
+    editorSetStatusMessage("HELP: ^S save | ^Q quit | ^F find | ^R replace | "
+                           "^G go to | ^W wrap | ^Z ^Y undo | ^B column");
+
+  /**
+   * read method enable use to read one byte from standard input
+   * into a varibale c
+   * here we add when user press q, it will exit the program
+   */
+  while (1) {
+    if (E.redraw) {
+      editorRefreshScreen();
+      E.redraw = 0;
+    }
+
+    editorWaitForEvents();
   }
   return 0;
 }